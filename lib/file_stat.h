@@ -5,8 +5,14 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-/* Structure for file stream and its statistics */
+/* Structure for file stream and its statistics. Input read from a    *
+ * regular file is memory mapped, any other input is kept in `buffer'  *
+ * as it is read so that it can be replayed after a rewind_stat, and   *
+ * is read without the stdio buffer so that none is held back there.   *
+ * Output is collected in `wbuf' and written out when it fills up, on  *
+ * fflush_stat and on fclose_stat.                                     */
 typedef struct file_stat
 {
 	FILE    *file;
@@ -16,17 +22,93 @@ typedef struct file_stat
 	size_t   buffer_usage;
 	size_t   buffer_ptr;
 	bool 	 fully_buffered;
+	void    *map;
+	size_t   map_size;
+	bool     map_checked;
+	bool     random_access;
+	void    *wbuf;
+	size_t   wbuf_size;
+	size_t   wbuf_usage;
 } f_stat;
 
+/* Default size of the write buffer */
+#define FSTAT_WBUF_SIZE (256*1024)
+
+/* Initialise the stream structure for the open file `file' */
+void finit_stat(f_stat *stream, FILE *file);
+
+/* Initialise a memory stream which reads the `size' bytes at `data' or, *
+ * when `data' is NULL, collects everything written to it in `buffer'.   */
+void fmemopen_stat(f_stat *stream, const void *data, size_t size);
+
+/* Hint that the input will be read at a few scattered places rather   *
+ * than from start to end, so a mapped file is not read ahead.         */
+void frandom_stat(f_stat *stream);
+
+/* Set the size of the write buffer, 0 for none, before anything has  *
+ * been written to the stream. Equivalent of setvbuf.                  */
+int fsetbuf_stat(f_stat *stream, size_t size);
+
 /* Equivalent of fwrite */
 size_t fwrite_stat(const void *ptr, size_t size, size_t count, f_stat *stream);
 
+/* Returns true if the stream is an output file which can be written at *
+ * any position with fpwrite_stat.                                       */
+bool fpositioned_stat(f_stat *stream);
+
+/* Write `count' bytes `offset' bytes past the current position of the  *
+ * output without moving it, so that several threads can fill in        *
+ * different parts of the output at once. The write buffer must have    *
+ * been flushed with fflush_stat first. Equivalent of pwrite.           */
+int fpwrite_stat(const void *ptr, size_t count, uint64_t offset,
+		f_stat *stream);
+
+/* Move the position of the output on by `count' bytes, past the bytes *
+ * filled in by fpwrite_stat.                                          */
+int fskip_stat(f_stat *stream, uint64_t count);
+
 /* Equivalent of fputc */
 int fputc_stat (int character, f_stat *stream);
 
+/* Equivalent of fread */
+size_t fread_stat(void *ptr, size_t size, size_t count, f_stat *stream);
+
+/* Most bytes viewed at once by fview_stat and fview_some_stat, so that *
+ * a negative error code, which returns as a larger size_t, can be told  *
+ * apart from a count even when SIZE_MAX bytes are asked for.            */
+#define FVIEW_MAX (SIZE_MAX/2)
+
+/* Return a pointer to the next `count' bytes of input through `ptr'    *
+ * without copying them. Returns the number of bytes available, which is *
+ * less than `count' only at the end of the input, so a `count' of       *
+ * SIZE_MAX views the rest of the input. The pointer is valid until the  *
+ * next read from the stream. On an error returns one of the negative    *
+ * codes of file_stat_error.h, greater than both `count' and FVIEW_MAX   *
+ * as a size_t, and leaves `ptr' unset.                                  */
+size_t fview_stat(const void **ptr, size_t count, f_stat *stream);
+
+/* As fview_stat, but when nothing is held in memory returns whatever   *
+ * input is ready, as read does, rather than waiting for `count' bytes.  *
+ * Returns 0 only at the end of the input.                               */
+size_t fview_some_stat(const void **ptr, size_t count, f_stat *stream);
+
+/* Returns true if all of the input is held in memory, as for a mapped *
+ * file or a memory stream, so that fview_stat can view the rest of it  *
+ * without reading anything.                                            */
+bool fbuffered_stat(f_stat *stream);
+
 /* Eqivalent of fgetc */
 int fgetc_stat(f_stat *stream);
 
+/* Release the buffered input that has already been read, so the buffer  *
+ * does not grow with the length of the input. A later rewind_stat only   *
+ * returns to the first byte that has not been released.                  */
+int fdiscard_stat(f_stat *stream);
+
+/* Empty a memory stream opened with fmemopen_stat to collect output, *
+ * keeping its buffer so that writing to it again does not allocate.   */
+int freset_stat(f_stat *stream);
+
 /* Equivalent of rewind */
 int rewind_stat(f_stat *stream);
 
@@ -8,6 +8,7 @@ enum file_stat_error {
 	E_OUT_OF_MEMORY = -1,
 	E_UNEXPECTED_NULL_POINTER = -2,
 	E_FAILED_FILE_WRITE = -3,
+	E_FAILED_FILE_READ = -4,
 };
 
 #endif /* FILE_STAT_ERROR_H */
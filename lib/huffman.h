@@ -3,23 +3,240 @@
 
 
 #include "file_stat.h"
+#include "huffman_histogram.h"
 
-/* Tree node structure */
+#include <stdint.h>
+
+/* Index of a missing node, such as the parent of the root */
+#define HUFF_NO_NODE UINT16_MAX
+
+/* Tree node structure. The nodes of a tree are kept in one array and  *
+ * refer to each other by their index in it, so a whole tree fits in a *
+ * few kilobytes and is thrown away by simply reusing the array.        */
 typedef struct symbol
 {
-	struct symbol *next;
-	struct symbol *parent;
-	struct symbol *left;
-	struct symbol *right;
+	uint64_t       weight;
+	uint16_t       parent;
+	uint16_t       left;
+	uint16_t       right;
 	unsigned char  symbol;
-	long int       weight;
 	bool           code;
 } Symbol;
 
+/* Stages of coding timed in the statistics */
+enum huff_stage {
+	HUFF_STAGE_HISTOGRAM,	/* Counting the symbols of the input */
+	HUFF_STAGE_TREE,	/* Working out the codes, or the decode table */
+	HUFF_STAGE_HEADER,	/* Writing the headers and code lengths */
+	HUFF_STAGE_CODE,	/* Coding or decoding the symbols */
+	HUFF_STAGE_WRITE,	/* Writing the output */
+	HUFF_STAGES
+};
+
+/* Statistics of one call, collected when asked for in the options.     *
+ * Times are taken from the monotonic clock, the stage times of blocks  *
+ * coded on several threads are added up over the threads.             */
+typedef struct huffman_statistics
+{
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+	double   seconds;		/* Of the whole call */
+	double   stage_seconds[HUFF_STAGES];
+	uint64_t blocks;		/* 1 for a single stream */
+	uint64_t stored_blocks;		/* Stored as they are, as coding   *
+					 * would not have shrunk them      */
+	uint64_t run_blocks;		/* Holding runs of one byte */
+	uint64_t counted_bytes;		/* Counted to build the code of a  *
+					 * single stream, fewer than       *
+					 * `in_bytes' for a sample         */
+	unsigned int max_code_len;	/* Longest code used */
+	uint64_t buffer_bytes;		/* Held by the stream buffers */
+	uint64_t peak_memory;		/* Peak resident size of the process */
+} huffman_stats;
+
+/* A code trained on sample data ahead of time, see huffman_codebook_train */
+typedef struct huff_codebook HuffCodebook;
+
+/* Options controlling how the input is compressed */
+typedef struct huffman_options
+{
+	size_t block_size;	/* Code the input in independent blocks of  *
+				 * this many bytes, 0 for a single stream   */
+	unsigned int max_code_len; /* Longest code in bits, 11 to 15, or   *
+				 * 0 for the default of 15                  */
+	unsigned int threads;	/* Code blocks on this many threads, 0 or  *
+				 * 1 for one. Implies blocks of the default *
+				 * size if `block_size' is 0                */
+	unsigned int streams;	/* Bitstreams per block, 1 or 4, 0 for 1.  *
+				 * More streams decode faster, 4 implies    *
+				 * blocks as `threads' does                 */
+	bool index;		/* End a block stream with an index of the  *
+				 * blocks, which is always done with        *
+				 * `threads'. Implies blocks as `threads'   *
+				 * does                                     */
+	huffman_stats *stats;	/* Filled in with the statistics of the    *
+				 * call when not NULL                       */
+	const HuffCodebook *codebook;	/* Code the input with this       *
+				 * codebook rather than its own tree, which *
+				 * rules out blocks. Needed again to decode */
+	bool adaptive;		/* Code the input in one pass as it is     *
+				 * read, with a tree updated after every    *
+				 * symbol, which rules out blocks and a     *
+				 * codebook                                 */
+	bool context;		/* Code each block with several codes, the *
+				 * code of each byte picked by the byte     *
+				 * before it, where that is smaller. Implies *
+				 * blocks as `threads' does, and rules out  *
+				 * interleaved streams                      */
+	unsigned int sample;	/* Build the code of a single stream from  *
+				 * this percentage of the input, 1 to 100,  *
+				 * read in pieces spread across it, so the  *
+				 * input is only read in full once. Every   *
+				 * byte is counted for input which is not   *
+				 * all in memory or is too short to sample. *
+				 * 0 counts every byte                      */
+	bool checksum;		/* End each block with a CRC-32C of its    *
+				 * data, checked when it is decoded.        *
+				 * Implies blocks as `threads' does         */
+} huffman_opts;
+
 /* Huffman encodes the input, `in' and outputs to `out' */
 int huffman(f_stat *in, f_stat *out);
 
+/* Huffman encodes the input, `in' and outputs to `out' as set out by   *
+ * `opts'. A NULL `opts' gives the same output as huffman().           */
+int huffman_opt(f_stat *in, f_stat *out, const huffman_opts *opts);
+
 /* Huffman decodes the input, `in' and outputs to `out' */
 int unhuffman(f_stat *in, f_stat *out);
 
+/* Huffman decodes the input, `in' and outputs to `out'. With more than *
+ * one of `opts->threads' a block stream with an index which is read    *
+ * from a file or memory is decoded in parallel.                        */
+int unhuffman_opt(f_stat *in, f_stat *out, const huffman_opts *opts);
+
+/* Huffman decodes the `length' bytes of uncompressed data starting at *
+ * `offset' from the indexed block stream `in' to `out', decoding only  *
+ * the blocks which hold them. Bytes past the end of the data are left  *
+ * out. Returns HUFF_NOINDEX if `in' has no block index.                */
+int huffman_read_range(f_stat *in, f_stat *out, uint64_t offset,
+		uint64_t length);
+
+/* Most bytes huffman_compress_buffer can write for `len' bytes of     *
+ * input.                                                               */
+size_t huffman_compress_bound(size_t len);
+
+/* Huffman encodes the `src_len' bytes at `src' into the `dst_cap' bytes *
+ * at `dst', giving the same output as huffman(). The number of bytes    *
+ * written is returned through `dst_len'. Returns HUFF_NOSPACE if the    *
+ * output does not fit, which cannot happen when `dst_cap' is at least   *
+ * huffman_compress_bound(src_len). Works only on the memory it is      *
+ * given, without any heap allocation or stdio.                          */
+int huffman_compress_buffer(const void *src, size_t src_len, void *dst,
+		size_t dst_cap, size_t *dst_len);
+
+/* Bytes of scratch memory in which huffman_decompress_buffer_scratch *
+ * builds the decode tables of context blocks                         */
+#define HUFF_DECODE_SCRATCH_SIZE ((size_t)16*6144*4)
+
+/* Huffman decodes the `src_len' bytes at `src', either layout, into the *
+ * `dst_cap' bytes at `dst'. The number of bytes decoded is returned     *
+ * through `dst_len'. Returns HUFF_NOSPACE if the output does not fit.   *
+ * Works only on the memory it is given, without any stdio, except that  *
+ * the tables of any context blocks are allocated once for the call.     */
+int huffman_decompress_buffer(const void *src, size_t src_len, void *dst,
+		size_t dst_cap, size_t *dst_len);
+
+/* As huffman_decompress_buffer, with the tables of context blocks built *
+ * in the `scratch_size' bytes at `scratch', aligned as by malloc, so    *
+ * that no heap allocation is made at all. Returns HUFF_INVALIDARG if    *
+ * `scratch_size' is less than HUFF_DECODE_SCRATCH_SIZE. A NULL          *
+ * `scratch' is the same as huffman_decompress_buffer.                   */
+int huffman_decompress_buffer_scratch(const void *src, size_t src_len,
+		void *dst, size_t dst_cap, size_t *dst_len, void *scratch,
+		size_t scratch_size);
+
+/* Build a codebook from the symbol `counts' of a sample of the data it *
+ * is to code, with no code longer than `max_len' bits, 0 for 15. Every  *
+ * symbol gets a code, seen in the sample or not.                        */
+int huffman_codebook_train(HuffCodebook **book,
+		const uint64_t counts[HUFF_SYMBOLS], unsigned int max_len);
+
+/* Write a codebook to `out' */
+int huffman_codebook_save(const HuffCodebook *book, f_stat *out);
+
+/* Read a codebook written by huffman_codebook_save from `in'. The     *
+ * encoder and decoder tables are built as it is read, once for all of  *
+ * the messages coded with it.                                           */
+int huffman_codebook_load(HuffCodebook **book, f_stat *in);
+
+/* The ID by which messages name the codebook */
+uint32_t huffman_codebook_id(const HuffCodebook *book);
+
+/* Number of bits the codebook codes `symbol' in */
+unsigned int huffman_codebook_length(const HuffCodebook *book,
+		unsigned int symbol);
+
+/* Free the codebook */
+void huffman_codebook_free(HuffCodebook *book);
+
+/* Code the `src_len' bytes at `src' with `book' into the `dst_cap'     *
+ * bytes at `dst', as huffman_compress_buffer does. The output has only  *
+ * an 8 byte header and a footer byte around the codes, and fits in     *
+ * huffman_compress_bound(src_len) bytes.                               */
+int huffman_codebook_compress(const HuffCodebook *book, const void *src,
+		size_t src_len, void *dst, size_t dst_cap, size_t *dst_len);
+
+/* Decode a message coded with `book', as huffman_decompress_buffer    *
+ * does. Returns HUFF_CODEBOOK if it was coded with another codebook.   */
+int huffman_codebook_decompress(const HuffCodebook *book, const void *src,
+		size_t src_len, void *dst, size_t dst_cap, size_t *dst_len);
+
+/* An incremental encoder or decoder, which takes its input and gives   *
+ * its output in pieces of any size. The encoder writes a block stream   *
+ * and codes each block once it is full, the decoder takes either       *
+ * layout.                                                               */
+typedef struct huff_stream HuffStream;
+
+/* Start an encoder with the settings in `opts', NULL for the defaults. *
+ * The input is coded in blocks, of the default size unless            *
+ * `opts->block_size' is set, or with `opts->adaptive' as it is pushed  *
+ * and pulled with no block to fill. `opts->codebook' cannot be used,   *
+ * and `opts->threads' is not used. `opts->stats' is filled in as the   *
+ * stream is coded with the bytes pushed and pulled, the blocks and the *
+ * stage times so far, without the time or memory of the whole call.    */
+int huffman_stream_init(HuffStream **stream, const huffman_opts *opts);
+
+/* Start a decoder */
+int unhuffman_stream_init(HuffStream **stream);
+
+/* Give the stream the `len' bytes at `data'. The number of bytes taken *
+ * is returned through `used', which is less than `len' once the stream *
+ * holds as much input as it can. Pull output to make room for more.    */
+int huffman_stream_push(HuffStream *stream, const void *data, size_t len,
+		size_t *used);
+
+/* Take up to `cap' bytes of output into `buf', the number of bytes     *
+ * written being returned through `len'. An encoder has output once a   *
+ * block is full, after a flush and after the input has finished. Less  *
+ * than `cap' bytes means that more input is needed.                    */
+int huffman_stream_pull(HuffStream *stream, void *buf, size_t cap,
+		size_t *len);
+
+/* Code the input given to an encoder so far as a block, or end it with *
+ * a flush when adaptive, so that all of it can be decoded from the      *
+ * output pulled after the flush.                                        */
+int huffman_stream_flush(HuffStream *stream);
+
+/* Mark the end of the input. An encoder then ends the stream after the *
+ * last block, and a decoder reports a truncated stream as corrupt.     */
+int huffman_stream_finish(HuffStream *stream);
+
+/* Returns true once all of the output has been pulled from a stream    *
+ * which has reached its end.                                            */
+bool huffman_stream_done(const HuffStream *stream);
+
+/* Free the stream */
+void huffman_stream_end(HuffStream *stream);
+
 #endif /* HUFFMAN_H */
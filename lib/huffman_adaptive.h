@@ -0,0 +1,109 @@
+/* One pass adaptive huffman coding, after the FGK algorithm.
+ *
+ * The encoder and decoder start with a tree holding only the escape leaf
+ * and update it after every symbol, so the code follows the input without
+ * a pass over it first and without any code lengths in the output. The
+ * first time a symbol is seen it is coded as the escape followed by its
+ * value in HUFA_RAW_BITS bits. Escape values past the bytes mark a flush,
+ * after which the coded stream is padded to a whole byte, and the end of
+ * the stream.
+ *
+ * The state is a fixed size whatever the length of the input, and both
+ * sides take their input in pieces of any size, so output can be given
+ * out as soon as it has been coded.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_ADAPTIVE_H_
+#define _HUFFMAN_ADAPTIVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "huffman.h"
+#include "huffman_errno.h"
+#include "huffman_histogram.h"
+#include "huffman_bits.h"
+
+/* Escape values which are not bytes */
+#define HUFA_FLUSH    256	/* Pad to a whole byte and carry on */
+#define HUFA_END      257	/* End of the stream */
+
+/* Bits of the value following the escape */
+#define HUFA_RAW_BITS 9
+
+/* Nodes of a tree with every byte and the escape */
+#define HUFA_NODES    (2*HUFF_SYMBOLS+1)
+
+/* Deepest leaf of the tree. Node weights are symbol counts, and in a  *
+ * tree with the sibling property a leaf d deep needs a total weight   *
+ * of at least the (d+1)th Fibonacci number, which passes 2^64 before  *
+ * d reaches 93.                                                        */
+#define HUFA_MAX_DEPTH 96
+
+/* Longest code written for one symbol, an escape and its value */
+#define HUFA_MAX_CODE_BITS (HUFA_MAX_DEPTH + HUFA_RAW_BITS)
+
+/* Most bytes huffman_adaptive_encode writes for `len' symbols, counting *
+ * the bits held over from the last call and the bit writer slack, and   *
+ * that huffman_adaptive_mark writes.                                     */
+#define HUFA_ENCODE_BOUND(len) \
+	(((len) + 1)*HUFA_MAX_CODE_BITS/8 + 2 + HUFF_BITS_SLACK)
+#define HUFA_MARK_BOUND HUFA_ENCODE_BOUND(1)
+
+/* State of an adaptive encoder or decoder. Nodes are numbered in order  *
+ * of weight, with the root last and siblings next to each other, and    *
+ * refer to each other by number. The tree only grows downwards from    *
+ * `root', new leaves taking the two numbers below the escape leaf.     */
+typedef struct huff_adaptive
+{
+	uint64_t weight[HUFA_NODES];
+	uint16_t parent[HUFA_NODES];
+	uint16_t child[HUFA_NODES][2];	/* HUFF_NO_NODE for a leaf */
+	uint16_t symbol[HUFA_NODES];	/* Of a leaf */
+	uint16_t leaf[HUFF_SYMBOLS];	/* HUFF_NO_NODE until seen */
+	uint16_t escape;		/* Leaf for symbols not yet seen */
+	unsigned int max_len;		/* Longest code so far, in bits */
+
+	/* Encoder: bits of a byte not yet written */
+	uint64_t acc;
+	unsigned int count;
+
+	/* Decoder: where it is in the tree and in the input */
+	uint16_t node;
+	unsigned int depth;		/* Bits read of the code so far */
+	unsigned int raw_bits;		/* Bits read of an escape value */
+	unsigned int raw;
+	unsigned int byte;		/* Bits of the last byte taken */
+	unsigned int bits;		/* How many of them are left */
+	bool done;			/* End of the stream reached */
+} HuffAdaptive;
+
+/* Start a new encoder or decoder */
+void huffman_adaptive_init(HuffAdaptive *a);
+
+/* Code the `len' bytes at `in' into `out', which must have room for    *
+ * HUFA_ENCODE_BOUND(len) bytes. Returns the number of whole bytes      *
+ * written, the bits of a last part byte are written by the next call.   */
+size_t huffman_adaptive_encode(HuffAdaptive *a, const uint8_t *in,
+		size_t len, uint8_t *out);
+
+/* Code the HUFA_FLUSH or HUFA_END `mark' into `out', which must have   *
+ * room for HUFA_MARK_BOUND bytes, padding the output to a whole byte  *
+ * so that the decoder can decode everything coded before it. Returns  *
+ * the number of bytes written.                                         */
+size_t huffman_adaptive_mark(HuffAdaptive *a, unsigned int mark,
+		uint8_t *out);
+
+/* Decode the `len' bytes at `in' into the `cap' bytes at `out', stopping *
+ * early when the output is full or at the end of the stream. The number  *
+ * of bytes taken and written are returned through `used' and `written'.  *
+ * A code may run across pieces of the input, so every byte taken has     *
+ * been decoded as far as it can be.                                      */
+HUFF_ERR huffman_adaptive_decode(HuffAdaptive *a, const uint8_t *in,
+		size_t len, size_t *used, uint8_t *out, size_t cap,
+		size_t *written);
+
+#endif /* _HUFFMAN_ADAPTIVE_H_ */
@@ -0,0 +1,136 @@
+/* Bit level input and output for the huffman coder.
+ *
+ * Codes are written most significant bit first. The bit writer collects
+ * codes in a 64 bit accumulator and stores the whole accumulator to the
+ * output at once, moving the output pointer on by the number of complete
+ * bytes it held, so the output needs 8 bytes of room past the last byte
+ * written.
+ *
+ * The bit reader does the reverse, loading the 64 bits from any bit
+ * position into an accumulator with the first bit at the top, so that
+ * several codes can be decoded from one load.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_BITS_H_
+#define _HUFFMAN_BITS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/* Bytes the bit writer may store past the end of its output */
+#define HUFF_BITS_SLACK 8
+
+/* Bit writer state */
+typedef struct bit_writer
+{
+	uint64_t  acc;		/* Pending bits, left aligned */
+	unsigned int count;	/* Number of pending bits */
+	uint8_t  *ptr;		/* Where the pending bits are written */
+} BitWriter;
+
+/* Store a 64 bit value most significant byte first */
+static inline void huff_store_be64(uint8_t *p, uint64_t v)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+	memcpy(p,&v,sizeof(v));
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(p,&v,sizeof(v));
+#else
+	int i;
+	for (i=0; i<8; i++)
+	{
+		p[i] = v >> (56 - 8*i);
+	}
+#endif
+}
+
+/* Load a 64 bit value stored most significant byte first */
+static inline uint64_t huff_load_be64(const uint8_t *p)
+{
+	uint64_t v;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&v,p,sizeof(v));
+	v = __builtin_bswap64(v);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(&v,p,sizeof(v));
+#else
+	int i;
+	for (v=0, i=0; i<8; i++)
+	{
+		v = (v << 8) | p[i];
+	}
+#endif
+	return v;
+}
+
+/* Return the bits of the `size' bytes at `data' from bit `pos' onwards, *
+ * left aligned in the accumulator. At least 57 bits are valid. Needs    *
+ * 8 bytes of input from the byte holding bit `pos', see br_peek_tail.   */
+static inline uint64_t br_peek(const uint8_t *data, size_t pos)
+{
+	return huff_load_be64(data + (pos >> 3)) << (pos & 7);
+}
+
+/* As br_peek, for positions within 8 bytes of the end of the input.   *
+ * Bits past the end of the input read as zero.                        */
+static inline uint64_t br_peek_tail(const uint8_t *data, size_t size,
+		size_t pos)
+{
+	uint8_t tail[8] = { 0 };
+	size_t byte = pos >> 3;
+
+	if (byte < size)
+	{
+		memcpy(tail,data+byte,(size-byte < 8) ? size-byte : 8);
+	}
+	return huff_load_be64(tail) << (pos & 7);
+}
+
+/* Start writing bits at `out' */
+static inline void bw_init(BitWriter *w, uint8_t *out)
+{
+	w->acc   = 0;
+	w->count = 0;
+	w->ptr   = out;
+}
+
+/* Append the `len' low bits of `code', 1 <= len. There must be room for *
+ * `len' more bits in the accumulator, which after a bw_flush holds at   *
+ * most 7 bits, leaving room for at least three 15 bit codes.            */
+static inline void bw_put(BitWriter *w, uint32_t code, unsigned int len)
+{
+	w->acc |= (uint64_t)code << (64 - w->count - len);
+	w->count += len;
+}
+
+/* Write out the complete bytes in the accumulator */
+static inline void bw_flush(BitWriter *w)
+{
+	huff_store_be64(w->ptr,w->acc);
+	w->ptr   += w->count >> 3;
+	w->acc   <<= w->count & ~7u;
+	w->count &= 7;
+}
+
+/* Write out any remaining bits, padding the last byte with zeros.      *
+ * Returns the number of bits used in the last byte, 0 if it is full.   */
+static inline unsigned int bw_finish(BitWriter *w)
+{
+	unsigned int bits = w->count & 7;
+
+	bw_flush(w);
+	if (w->count > 0)
+	{
+		*w->ptr++ = w->acc >> 56;
+		w->acc   = 0;
+		w->count = 0;
+	}
+	return bits;
+}
+
+#endif /* _HUFFMAN_BITS_H_ */
@@ -0,0 +1,17 @@
+/* CRC-32C (Castagnoli) checksums of the uncompressed data of blocks.
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_CRC_H_
+#define _HUFFMAN_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Add the `len' bytes at `data' to the CRC-32C `crc' and return the    *
+ * new checksum. Start with a `crc' of 0, and pass the result back in   *
+ * to checksum data given in pieces. Uses the SSE4.2 crc32 instruction  *
+ * where the processor has it.                                          */
+uint32_t huffman_crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif /* _HUFFMAN_CRC_H_ */
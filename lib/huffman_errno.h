@@ -11,6 +11,11 @@ typedef enum {
 	HUFF_INVALIDARG = 2, 	/* Invalid function argument */
 	HUFF_INVALIDHEADER=3, 	/* Invalid file header for huffman */
 	HUFF_WRITEFAIL  =4, 	/* Failed to write */
+	HUFF_CORRUPT    =5, 	/* Compressed data is corrupt or truncated */
+	HUFF_NOINDEX    =6, 	/* Compressed data has no block index */
+	HUFF_NOSPACE    =7, 	/* Output buffer is too small */
+	HUFF_CODEBOOK   =8, 	/* Coded with a codebook not given */
+	HUFF_CHECKSUM   =9, 	/* Decoded data does not match its checksum */
 } HUFF_ERR;
 
 #endif /* __HUFFMAN_ERRNO_H__ */
@@ -0,0 +1,187 @@
+/* Layout of the block based compressed format.
+ *
+ * A block stream starts with a file header, followed by any number of
+ * blocks and is terminated by an end block:
+ *
+ *   file header:  "HUFB" | version (1) | flags (1) | reserved (2) |
+ *                 block size (4)
+ *   block header: type (1) | flags (1) | reserved (2) |
+ *                 uncompressed length (4) | compressed length (4)
+ *
+ * followed by `compressed length' bytes of block payload. Every block is
+ * coded independently with its own huffman tree so it can be decoded as
+ * soon as it has been read. All integers are stored little endian.
+ *
+ * The payload of a HUFB_HUFFMAN block is the code lengths followed by a
+ * single coded stream ending with a footer byte. A HUFB_HUFFMAN4 block
+ * codes each quarter of its input as a separate stream, padded to a
+ * whole byte, with one set of code lengths:
+ *
+ *   payload:      stream 1, 2 and 3 sizes (4 each) | code lengths |
+ *                 stream 1 | stream 2 | stream 3 | stream 4
+ *
+ * A HUFB_CONTEXT block has several codes and codes each byte with the
+ * code picked by the byte before it, the first byte of the block coming
+ * after a 0. The context map holds the number of the code for each
+ * previous byte in a nibble, low nibble first:
+ *
+ *   payload:      code count (1) | context map (128) | code lengths of
+ *                 each code | coded stream | footer
+ *
+ * A block which coding would not shrink is a HUFB_STORED block, with the
+ * input as it is for its payload. Input which would not shrink as a
+ * single stream is written as a block stream of stored blocks instead.
+ *
+ * A block of one byte repeated is a HUFB_RUN block, with that byte for
+ * its payload. A block with long runs of one byte in it is a HUFB_RUNS
+ * block, which lists the runs, each after the number of other bytes
+ * between it and the run before it. The other bytes, one after another,
+ * are coded as a HUFB_HUFFMAN, HUFB_HUFFMAN4, HUFB_CONTEXT or HUFB_STORED
+ * block of their own, header included, which is left out when the runs
+ * cover the whole block:
+ *
+ *   payload:      run count (4) | runs | block header | block payload
+ *   run:          bytes before it (4) | length (4) | byte (1)
+ *
+ * When the HUFB_BLOCK_CRC block flag is set the payload ends with the
+ * CRC-32C of the uncompressed data of the block, which the compressed
+ * length counts, and the decoder checks the data against it:
+ *
+ *   payload:      payload of the block type | CRC-32C (4)
+ *
+ * When the HUFB_FLAG_INDEX file flag is set the end block is followed by
+ * an index of the blocks and a trailer at the very end of the file:
+ *
+ *   index entry:  offset (8) | compressed size (4) | uncompressed size (4)
+ *   trailer:      index offset (8) | block count (4) | "HUFI"
+ *
+ * Offsets are counted from the start of the file header, and the
+ * compressed size of an entry covers the block header and its payload.
+ * The index lets the blocks be found without reading the whole stream.
+ *
+ * Short messages can instead be coded with a codebook trained ahead of
+ * time and kept outside the messages. A codebook file holds the code
+ * lengths, in the same layout as those of a block, and a message names
+ * its codebook by the 32 bit ID of those lengths:
+ *
+ *   codebook:     "HUFD" | version (1) | reserved (3) | ID (4) |
+ *                 code lengths
+ *   message:      "HUFC" | codebook ID (4) | coded stream | footer
+ *
+ * An adaptive stream has no code lengths at all, the code is built up as
+ * the symbols are coded, see huffman_adaptive.h. Flushes within the codes
+ * pad them to a whole byte, and the end escape ends the stream:
+ *
+ *   adaptive:     "HUFA" | codes | end escape | padding
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_FORMAT_H_
+#define _HUFFMAN_FORMAT_H_
+
+#include <stdint.h>
+
+/* Magic number at the start of a single stream file */
+#define HUFF_MAGIC        "HUFF"
+#define HUFF_HEADER_SIZE  4
+
+/* Magic number at the start of a block stream */
+#define HUFB_MAGIC        "HUFB"
+#define HUFB_VERSION      1
+
+#define HUFB_HEADER_SIZE  12
+#define HUFB_BLOCK_HEADER_SIZE 12
+
+/* File header flags */
+#define HUFB_FLAG_INDEX   0x01	/* Block index after the end block */
+
+/* Block header flags */
+#define HUFB_BLOCK_CRC    0x01	/* Payload ends with a checksum */
+#define HUFB_CRC_SIZE     4
+
+/* Magic numbers of a codebook file and of a message coded with one */
+#define HUFD_MAGIC        "HUFD"
+#define HUFD_VERSION      1
+#define HUFD_HEADER_SIZE  12
+#define HUFC_MAGIC        "HUFC"
+#define HUFC_HEADER_SIZE  8
+
+/* Magic number at the start of an adaptive stream */
+#define HUFA_MAGIC        "HUFA"
+
+/* Magic number at the end of the block index trailer */
+#define HUFI_MAGIC        "HUFI"
+
+#define HUFB_INDEX_ENTRY_SIZE 16
+#define HUFB_TRAILER_SIZE 16
+
+/* Range of block sizes accepted by the encoder and decoder */
+#define HUFB_MIN_BLOCK_SIZE (1024)
+#define HUFB_MAX_BLOCK_SIZE (64*1024*1024)
+
+/* Default block size */
+#define HUFB_BLOCK_SIZE   (1024*1024)
+
+/* Block types */
+enum hufb_block_type {
+	HUFB_END     = 0,	/* Last block in the stream, no payload */
+	HUFB_HUFFMAN = 1,	/* Huffman tree followed by coded data */
+	HUFB_HUFFMAN4 = 2,	/* Huffman tree followed by four streams */
+	HUFB_CONTEXT = 3,	/* Huffman trees picked by the previous byte */
+	HUFB_STORED  = 4,	/* The input as it is */
+	HUFB_RUN     = 5,	/* One byte repeated */
+	HUFB_RUNS    = 6,	/* Runs of one byte and coded data between */
+};
+
+/* Size of a run in the list of a HUFB_RUNS block */
+#define HUFB_RUN_SIZE     9
+
+/* Most codes in a HUFB_CONTEXT block, and the size of its context map */
+#define HUFB_CONTEXT_CODES 16
+#define HUFB_CONTEXT_MAP_SIZE 128
+
+/* Number of interleaved streams in a HUFB_HUFFMAN4 block, and the size *
+ * of the stream sizes at the start of its payload                     */
+#define HUFB_STREAMS      4
+#define HUFB_STREAMS_HEADER_SIZE (4*(HUFB_STREAMS-1))
+
+/* Store a 16/32/64 bit integer in little endian byte order */
+static inline void huff_put_u16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void huff_put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void huff_put_u64(uint8_t *p, uint64_t v)
+{
+	huff_put_u32(p,v);
+	huff_put_u32(p+4,v >> 32);
+}
+
+/* Load a 16/32/64 bit little endian integer */
+static inline uint16_t huff_get_u16(const uint8_t *p)
+{
+	return (uint16_t)p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t huff_get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t huff_get_u64(const uint8_t *p)
+{
+	return (uint64_t)huff_get_u32(p) | (uint64_t)huff_get_u32(p+4) << 32;
+}
+
+#endif /* _HUFFMAN_FORMAT_H_ */
@@ -0,0 +1,29 @@
+/* Byte histogram used to collect the symbol statistics for the encoder.
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_HISTOGRAM_H_
+#define _HUFFMAN_HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+/* Number of distinct symbols in the alphabet, 2**CHAR_BIT */
+#define HUFF_SYMBOLS (UCHAR_MAX+1)
+
+/* Add the number of occurrences of every byte value in `data' to the *
+ * matching entry in `counts'. `counts' is not cleared first so the   *
+ * histogram of a file can be accumulated over several calls.         */
+void huffman_histogram(uint64_t counts[HUFF_SYMBOLS], const uint8_t *data,
+		size_t len);
+
+/* Add the number of occurrences of every byte value in `data' after   *
+ * every other byte value to `counts', indexed by the byte before then  *
+ * by the byte itself. The first byte is counted as following a 0. As   *
+ * with huffman_histogram `counts' is not cleared, and it must not go   *
+ * past 2^32 - 1 in any entry.                                          */
+void huffman_histogram_order1(uint32_t counts[HUFF_SYMBOLS][HUFF_SYMBOLS],
+		const uint8_t *data, size_t len);
+
+#endif /* _HUFFMAN_HISTOGRAM_H_ */
@@ -0,0 +1,33 @@
+/* A fixed pool of worker threads for coding blocks in parallel.
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_POOL_H_
+#define _HUFFMAN_POOL_H_
+
+#include <stddef.h>
+
+#include "huffman_errno.h"
+
+/* Most threads a pool can be created with */
+#define HUFF_MAX_THREADS 256
+
+/* A job, run with the `arg' passed to huffman_pool_run and the number *
+ * of the job, from 0 to one less than the number of jobs.            */
+typedef void (*huff_job_fn)(void *arg, size_t job);
+
+typedef struct huff_pool HuffPool;
+
+/* Create a pool which runs jobs on `threads' threads, the thread      *
+ * calling huffman_pool_run being one of them.                         */
+HUFF_ERR huffman_pool_create(HuffPool **pool, unsigned int threads);
+
+/* Run jobs 0 to `njobs'-1 across the pool and wait for them all to   *
+ * finish. Jobs may run in any order.                                  */
+void huffman_pool_run(HuffPool *pool, huff_job_fn fn, void *arg,
+		size_t njobs);
+
+/* Stop the worker threads and free the pool */
+void huffman_pool_destroy(HuffPool *pool);
+
+#endif /* _HUFFMAN_POOL_H_ */
@@ -0,0 +1,47 @@
+/* Huffman tree construction and canonical code assignment shared by the
+ * single stream and block coders.
+ * Iestyn Pryce 2012/2013
+ */
+
+#ifndef _HUFFMAN_TREE_H_
+#define _HUFFMAN_TREE_H_
+
+#include "huffman.h"
+#include "huffman_histogram.h"
+#include "huffman_errno.h"
+
+/* Most nodes in a tree over the full alphabet */
+#define HUFF_MAX_NODES (2*HUFF_SYMBOLS-1)
+
+/* Range of the limit on the code length, every code length fits in a *
+ * nibble of the code length header.                                  */
+#define HUFF_MIN_CODE_LEN 11
+#define HUFF_MAX_CODE_LEN 15
+
+/* Comparison function to be used by the C library qsort(...) function *
+ * on an array of Symbols.                                             */
+int _symbol_cmp (const void *s1, const void *s2);
+
+/* Build a huffman tree in place over the `n' leaves at the start of    *
+ * `nodes', which must be sorted by increasing weight. The n-1 internal *
+ * nodes are written to nodes[n] to nodes[2n-2], so `nodes' must have   *
+ * room for 2n-1 entries, and the root is the last node written. Nodes  *
+ * are linked by their index in `nodes', HUFF_NO_NODE for none.         *
+ * Runs in linear time and does not allocate any memory.                */
+void huffman_build_tree(Symbol *nodes, unsigned int n);
+
+/* Work out the length of the huffman code for every symbol from its    *
+ * count, with no code longer than `max_len' bits. Symbols which do not *
+ * occur get a length of 0. If only one symbol occurs it gets a 1 bit   *
+ * code.                                                                */
+HUFF_ERR huffman_code_lengths(uint8_t lengths[HUFF_SYMBOLS],
+		const uint64_t counts[HUFF_SYMBOLS], unsigned int max_len);
+
+/* Assign canonical codes to the symbols from their code lengths. Codes *
+ * of the same length are consecutive in symbol order and shorter codes *
+ * precede longer ones, so the lengths alone describe the code.         *
+ * Returns HUFF_CORRUPT if the lengths do not describe a prefix code.   */
+HUFF_ERR huffman_canonical_codes(uint16_t codes[HUFF_SYMBOLS],
+		const uint8_t lengths[HUFF_SYMBOLS]);
+
+#endif /* _HUFFMAN_TREE_H_ */
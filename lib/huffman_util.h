@@ -7,10 +7,15 @@
 
 #include "huffman.h"
 
-/* Print out a linked list of symbols */
-void print_ll(Symbol *s);
+#include <stdint.h>
+
+/* Print out every node of a tree */
+void print_tree(const Symbol *nodes, unsigned int count);
 
 /* Print all the huffman codes from a tree */
-void print_codes_from_tree(Symbol **leaves);
+void print_codes_from_tree(const Symbol *nodes, unsigned int n);
+
+/* Print the code length of every symbol that has a code */
+void print_code_lengths(const uint8_t *lengths);
 
 #endif /*_HUFFMAN_UTIL_H_ */
@@ -1,33 +1,424 @@
 #include "file_stat.h"
 #include "file_stat_error.h"
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
-#define INIT_BUF_SIZE 24;
+#define INIT_BUF_SIZE (64*1024)
+
+void finit_stat(f_stat *stream, FILE *file)
+{
+	stream->file           = file;
+	stream->byte_count     = 0;
+	stream->buffer         = NULL;
+	stream->buffer_size    = 0;
+	stream->buffer_usage   = 0;
+	stream->buffer_ptr     = 0;
+	stream->fully_buffered = false;
+	stream->map            = NULL;
+	stream->map_size       = 0;
+	stream->map_checked    = false;
+	stream->random_access  = false;
+	stream->wbuf           = NULL;
+	stream->wbuf_size      = FSTAT_WBUF_SIZE;
+	stream->wbuf_usage     = 0;
+}
+
+void fmemopen_stat(f_stat *stream, const void *data, size_t size)
+{
+	finit_stat(stream,NULL);
+
+	/* Input is read straight from the caller's memory */
+	if (data != NULL)
+	{
+		stream->map            = (void *)data;
+		stream->map_size       = size;
+		stream->fully_buffered = true;
+
+		/* Counted as a mapped file is, all of it at once */
+		stream->byte_count     = size;
+	}
+	stream->map_checked = true;
+}
+
+/* Map a regular file into memory so that it can be read, and re-read     *
+ * after a rewind_stat, without copying. Streams which cannot be mapped,  *
+ * such as pipes, are left alone and fall back to the stream buffer.      */
+static void _map_stream(f_stat *stream)
+{
+	struct stat st;
+	int fd;
+	void *map;
+
+	stream->map_checked = true;
+
+	if (stream->file == NULL)
+	{
+		return;
+	}
+
+	fd = fileno(stream->file);
+	if (fd < 0 || fstat(fd,&st) != 0 || !S_ISREG(st.st_mode))
+	{
+		/* Input kept in the stream buffer is read straight from the  *
+		 * file descriptor by fview_some_stat, so stdio must not read *
+		 * ahead of it.                                               */
+		setvbuf(stream->file,NULL,_IONBF,0);
+		return;
+	}
+
+	/* Only map from the start of the file, we have not read anything */
+	if (lseek(fd,0,SEEK_CUR) != 0)
+	{
+		return;
+	}
+
+	if (st.st_size > 0)
+	{
+		map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (map == MAP_FAILED)
+		{
+			return;
+		}
+		if (stream->random_access)
+		{
+			posix_madvise(map,st.st_size,POSIX_MADV_RANDOM);
+		}
+		else
+		{
+			/* Both passes over the input read it from start to end */
+			posix_madvise(map,st.st_size,POSIX_MADV_SEQUENTIAL);
+			posix_madvise(map,st.st_size,POSIX_MADV_WILLNEED);
+		}
+
+		stream->map      = map;
+		stream->map_size = st.st_size;
+	}
+
+	/* The whole file is available, reads are served from the mapping */
+	stream->byte_count    += st.st_size;
+	stream->buffer_ptr     = 0;
+	stream->fully_buffered = true;
+}
+
+/* Returns the start of the bytes held in memory for the stream */
+static inline const unsigned char *_data(f_stat *stream)
+{
+	return (stream->map != NULL) ? stream->map : stream->buffer;
+}
+
+/* Returns the number of bytes held in memory for the stream */
+static inline size_t _data_size(f_stat *stream)
+{
+	return (stream->map != NULL) ? stream->map_size : stream->buffer_usage;
+}
+
+/* Make sure that there is room for at least `count' more bytes in the *
+ * stream buffer.                                                      */
+static int _reserve_buffer(f_stat *stream, size_t count)
+{
+	size_t new_buffer_size;
+	void *tmp;
+
+	if (stream->buffer_usage + count <= stream->buffer_size)
+	{
+		return E_SUCCESS;
+	}
+
+	new_buffer_size = stream->buffer_size ? stream->buffer_size : INIT_BUF_SIZE;
+	while (new_buffer_size < stream->buffer_usage + count)
+	{
+		new_buffer_size *= 2;
+	}
+
+	tmp = realloc(stream->buffer,new_buffer_size);
+	if (tmp == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory for stream buffer");
+		return E_OUT_OF_MEMORY;
+	}
+	stream->buffer = tmp;
+	stream->buffer_size = new_buffer_size;
+
+	return E_SUCCESS;
+}
+
+/* Read up to `count' more bytes from a stream which could not be mapped *
+ * into the end of the stream buffer, so they can be replayed after a    *
+ * rewind_stat. Returns the number of bytes added.                       */
+static size_t _fill_buffer(f_stat *stream, size_t count)
+{
+	size_t read_count, want, total = 0;
+
+	while (total < count)
+	{
+		/* Grow the buffer a step at a time so that a large count *
+		 * only costs as much memory as there is input.           */
+		want = count - total;
+		if (want > stream->buffer_size - stream->buffer_usage)
+		{
+			if (want > INIT_BUF_SIZE + stream->buffer_size)
+			{
+				want = INIT_BUF_SIZE + stream->buffer_size;
+			}
+			if (_reserve_buffer(stream,want) != E_SUCCESS)
+			{
+				break;
+			}
+		}
+
+		read_count = fread((unsigned char *)stream->buffer +
+				stream->buffer_usage,1,want,stream->file);
+		total += read_count;
+		stream->byte_count   += read_count;
+		stream->buffer_usage += read_count;
+		if (read_count < want)
+		{
+			/* Mark that we've buffered the entire file */
+			stream->fully_buffered = true;
+			break;
+		}
+	}
+
+	return total;
+}
+
+void frandom_stat(f_stat *stream)
+{
+	if (stream == NULL)
+	{
+		return;
+	}
+
+	stream->random_access = true;
+	if (stream->map != NULL && stream->file != NULL)
+	{
+		posix_madvise(stream->map,stream->map_size,POSIX_MADV_RANDOM);
+	}
+}
+
+int fsetbuf_stat(f_stat *stream, size_t size)
+{
+	if (stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+	if (stream->wbuf != NULL)
+	{
+		/* Too late, the buffer is in use */
+		return E_FAILED_FILE_WRITE;
+	}
+	stream->wbuf_size = size;
+	return E_SUCCESS;
+}
+
+/* Write `len' bytes straight to the file descriptor under the stream, *
+ * retrying until everything has been written.                          */
+static int _write_all(f_stat *stream, const void *ptr, size_t len)
+{
+	const unsigned char *p = ptr;
+	ssize_t n;
+	int fd;
+
+	/* Anything written to the FILE by other means goes first */
+	if (fflush(stream->file) != 0)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+
+	fd = fileno(stream->file);
+	while (len > 0)
+	{
+		n = write(fd,p,len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return E_FAILED_FILE_WRITE;
+		}
+		p   += n;
+		len -= n;
+	}
+	return E_SUCCESS;
+}
+
+/* Write out the contents of the write buffer */
+static int _flush_wbuf(f_stat *stream)
+{
+	int rc;
+
+	if (stream->wbuf_usage == 0)
+	{
+		return E_SUCCESS;
+	}
+	rc = _write_all(stream,stream->wbuf,stream->wbuf_usage);
+	stream->wbuf_usage = 0;
+	return rc;
+}
 
 size_t fwrite_stat(const void *ptr, size_t size, size_t count, f_stat *stream)
 {
-	size_t write_count;
+	size_t len;
 
 	/* Validate input */
 	if (ptr == NULL || stream == NULL)
 	{
 		return E_UNEXPECTED_NULL_POINTER;
 	}
-	
-	write_count = fwrite(ptr,size,count,stream->file);
-	if (ferror(stream->file))
+
+	if (stream->file == NULL)
+	{
+		/* Memory stream, append to the buffer */
+		if (_reserve_buffer(stream,size*count) != E_SUCCESS)
+		{
+			return E_OUT_OF_MEMORY;
+		}
+		memcpy((unsigned char *)stream->buffer + stream->buffer_usage,
+				ptr,size*count);
+		stream->buffer_usage += size*count;
+		stream->byte_count += size*count;
+		return count;
+	}
+
+	len = size*count;
+	if (stream->wbuf == NULL && stream->wbuf_size > 0)
+	{
+		stream->wbuf = malloc(stream->wbuf_size);
+		if (stream->wbuf == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory for write buffer");
+			return E_OUT_OF_MEMORY;
+		}
+	}
+
+	if (stream->wbuf_usage + len > stream->wbuf_size)
+	{
+		if (_flush_wbuf(stream) != E_SUCCESS)
+		{
+			return E_FAILED_FILE_WRITE;
+		}
+
+		/* Large writes go straight out rather than through the buffer */
+		if (len >= stream->wbuf_size)
+		{
+			if (_write_all(stream,ptr,len) != E_SUCCESS)
+			{
+				return E_FAILED_FILE_WRITE;
+			}
+			stream->byte_count += len;
+			return count;
+		}
+	}
+
+	memcpy((unsigned char *)stream->wbuf + stream->wbuf_usage,ptr,len);
+	stream->wbuf_usage += len;
+	stream->byte_count += len;
+
+	return count;
+}
+
+bool fpositioned_stat(f_stat *stream)
+{
+	struct stat st;
+	int fd, flags;
+
+	if (stream == NULL || stream->file == NULL)
+	{
+		return false;
+	}
+
+	fd = fileno(stream->file);
+	if (fd < 0 || fstat(fd,&st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+
+	/* Appending writes ignore the position they are given */
+	flags = fcntl(fd,F_GETFL);
+	if (flags < 0 || (flags & O_APPEND) != 0)
+	{
+		return false;
+	}
+	return lseek(fd,0,SEEK_CUR) >= 0;
+}
+
+int fpwrite_stat(const void *ptr, size_t count, uint64_t offset,
+		f_stat *stream)
+{
+	const unsigned char *p = ptr;
+	ssize_t n;
+	off_t pos;
+	int fd;
+
+	/* Validate input */
+	if (ptr == NULL || stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+	if (stream->file == NULL || stream->wbuf_usage != 0)
 	{
 		return E_FAILED_FILE_WRITE;
-	}		
-	stream->byte_count += write_count*size;
-	
-	return write_count;
+	}
+
+	fd  = fileno(stream->file);
+	pos = lseek(fd,0,SEEK_CUR);
+	if (pos < 0)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+	pos += offset;
+
+	while (count > 0)
+	{
+		n = pwrite(fd,p,count,pos);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return E_FAILED_FILE_WRITE;
+		}
+		p     += n;
+		pos   += n;
+		count -= n;
+	}
+	return E_SUCCESS;
+}
+
+int fskip_stat(f_stat *stream, uint64_t count)
+{
+	if (stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+	if (stream->file == NULL || _flush_wbuf(stream) != E_SUCCESS ||
+			fflush(stream->file) != 0)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+
+	if (lseek(fileno(stream->file),count,SEEK_CUR) < 0)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+	stream->byte_count += count;
+
+	return E_SUCCESS;
 }
 
 int fputc_stat (int character, f_stat *stream)
 {
-	int ret_char;
+	unsigned char c = character;
 
 	/* Validate input */
 	if (stream == NULL)
@@ -35,91 +426,234 @@ int fputc_stat (int character, f_stat *stream)
 		return E_UNEXPECTED_NULL_POINTER;
 	}
 
-	ret_char = fputc(character,stream->file);
-	if (ret_char == EOF)
+	/* Room in the write buffer */
+	if (stream->wbuf != NULL && stream->wbuf_usage < stream->wbuf_size)
 	{
-		return E_FAILED_FILE_WRITE;
+		((unsigned char *)stream->wbuf)[stream->wbuf_usage++] = c;
+		stream->byte_count++;
+		return c;
 	}
-	stream->byte_count++;
 
-	return ret_char;
+	if (fwrite_stat(&c,1,1,stream) != 1)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+	return c;
 }
 
-int fgetc_stat(f_stat *stream)
+size_t fview_stat(const void **ptr, size_t count, f_stat *stream)
 {
-	int char_val;
+	size_t n;
 
+	/* Validate input */
+	if (ptr == NULL || stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+
+	if (!stream->map_checked)
+	{
+		_map_stream(stream);
+	}
+
+	if (count > FVIEW_MAX)
+	{
+		count = FVIEW_MAX;
+	}
+
+	n = _data_size(stream) - stream->buffer_ptr;
+	if (n < count && !stream->fully_buffered)
+	{
+		n += _fill_buffer(stream,count - n);
+	}
+	if (n < count && stream->file != NULL && ferror(stream->file))
+	{
+		/* A failed read also marks the input as fully buffered */
+		return E_FAILED_FILE_READ;
+	}
+	if (n > count)
+	{
+		n = count;
+	}
+
+	*ptr = _data(stream) + stream->buffer_ptr;
+	stream->buffer_ptr += n;
+
+	return n;
+}
+
+bool fbuffered_stat(f_stat *stream)
+{
 	if (stream == NULL)
+	{
+		return false;
+	}
+
+	if (!stream->map_checked)
+	{
+		_map_stream(stream);
+	}
+	return stream->fully_buffered;
+}
+
+size_t fview_some_stat(const void **ptr, size_t count, f_stat *stream)
+{
+	size_t n;
+	ssize_t got;
+	int fd;
+
+	/* Validate input */
+	if (ptr == NULL || stream == NULL)
 	{
 		return E_UNEXPECTED_NULL_POINTER;
 	}
 
-	if (stream->fully_buffered)
+	if (!stream->map_checked)
+	{
+		_map_stream(stream);
+	}
+
+	if (count > FVIEW_MAX)
 	{
-		if (stream->buffer_ptr >= stream->buffer_usage)
+		count = FVIEW_MAX;
+	}
+
+	n = _data_size(stream) - stream->buffer_ptr;
+	if (n == 0 && count > 0 && !stream->fully_buffered &&
+			stream->file != NULL)
+	{
+		fd = fileno(stream->file);
+		if (fd < 0)
 		{
-			char_val = EOF;
+			/* Without a file descriptor wait for all `count' bytes */
+			n = _fill_buffer(stream,count);
 		}
 		else
 		{
-			char_val = ((int*)stream->buffer)[stream->buffer_ptr];
-			stream->buffer_ptr++;
+			if (_reserve_buffer(stream,count) != E_SUCCESS)
+			{
+				return E_OUT_OF_MEMORY;
+			}
+			do
+			{
+				got = read(fd,(unsigned char *)stream->buffer +
+						stream->buffer_usage,count);
+			} while (got < 0 && errno == EINTR);
+			if (got < 0)
+			{
+				return E_FAILED_FILE_READ;
+			}
+			if (got == 0)
+			{
+				stream->fully_buffered = true;
+			}
+			stream->byte_count   += got;
+			stream->buffer_usage += got;
+			n = got;
 		}
 	}
-	else
+	if (n > count)
 	{
-		char_val = fgetc(stream->file);
-		if (ferror(stream->file))
-		{
-			return errno;
-		}
+		n = count;
+	}
+
+	*ptr = _data(stream) + stream->buffer_ptr;
+	stream->buffer_ptr += n;
+
+	return n;
+}
+
+size_t fread_stat(void *ptr, size_t size, size_t count, f_stat *stream)
+{
+	const void *data = NULL;
+	size_t n;
+
+	/* Validate input */
+	if (ptr == NULL || stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+	if (size == 0)
+	{
+		return 0;
 	}
 
-	if (char_val != EOF && stream->fully_buffered == false)
+	n = fview_stat(&data,size*count,stream);
+	if (n > size*count)
 	{
-		stream->byte_count++;
-		if (stream->buffer == NULL)
+		/* Error code from fview_stat */
+		return n;
+	}
+	if (n > 0)
+	{
+		/* An empty input has no data to copy from */
+		memcpy(ptr,data,n);
+	}
+
+	return n/size;
+}
+
+int fgetc_stat(f_stat *stream)
+{
+	if (stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+
+	if (!stream->map_checked)
+	{
+		_map_stream(stream);
+	}
+
+	if (stream->buffer_ptr >= _data_size(stream))
+	{
+		if (stream->fully_buffered || _fill_buffer(stream,1) == 0)
 		{
-			stream->buffer_size = INIT_BUF_SIZE;
-			stream->buffer = calloc(stream->buffer_size,sizeof(int));
-			if (stream->buffer == NULL)
+			if (stream->file != NULL && ferror(stream->file))
 			{
-				/* Out of memory */
-				perror("Unable to allocate memory for stream buffer");
-				return E_OUT_OF_MEMORY;
+				return E_FAILED_FILE_READ;
 			}
+			return EOF;
 		}
-		if (stream->buffer != NULL)
-		{
-			if (stream->buffer_size <= stream->buffer_usage)
-			{
-				int new_buffer_size = stream->buffer_size *2;
-				void *tmp = realloc(stream->buffer,new_buffer_size*sizeof(int));
-				if (tmp)
-				{
-					stream->buffer = tmp;
-					stream->buffer_size = new_buffer_size;
-				}
-				else
-				{
-					/* Out of memory */
-					perror("Unable to allocate memory for stream buffer");
-					return E_OUT_OF_MEMORY;
-				}
-			}
-			((int*)stream->buffer)[stream->buffer_ptr] = char_val;
+	}
 
-			stream->buffer_usage += 1;
-			stream->buffer_ptr = stream->buffer_usage;
-		}
+	return _data(stream)[stream->buffer_ptr++];
+}
+
+int fdiscard_stat(f_stat *stream)
+{
+	size_t n;
+
+	if (stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
 	}
-	else
+
+	if (stream->map == NULL && stream->buffer_ptr > 0)
 	{
-		/* Mark that we've buffered the entire file */
-		stream->fully_buffered = true;
+		n = stream->buffer_usage - stream->buffer_ptr;
+		memmove(stream->buffer,(unsigned char *)stream->buffer +
+				stream->buffer_ptr,n);
+		stream->buffer_usage = n;
+		stream->buffer_ptr   = 0;
 	}
+	return E_SUCCESS;
+}
 
-	return char_val;
+int freset_stat(f_stat *stream)
+{
+	if (stream == NULL)
+	{
+		return E_UNEXPECTED_NULL_POINTER;
+	}
+
+	/* Only memory streams collecting their output can be emptied */
+	if (stream->file == NULL && stream->map == NULL)
+	{
+		stream->buffer_usage = 0;
+		stream->buffer_ptr   = 0;
+	}
+	return E_SUCCESS;
 }
 
 int rewind_stat(f_stat *stream)
@@ -130,7 +664,6 @@ int rewind_stat(f_stat *stream)
 	}
 
 	stream->buffer_ptr = 0;
-	rewind(stream->file);
 	return stream->buffer_ptr;
 }
 
@@ -140,16 +673,51 @@ int fflush_stat(f_stat *stream)
 	{
 		return E_UNEXPECTED_NULL_POINTER;
 	}
+	if (stream->file == NULL)
+	{
+		return E_SUCCESS;
+	}
+	if (_flush_wbuf(stream) != E_SUCCESS)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
 	return fflush(stream->file);
 }
 
 int fclose_stat(f_stat *stream)
 {
+	int rc = E_SUCCESS;
+
 	if (stream == NULL)
 	{
 		return E_UNEXPECTED_NULL_POINTER;
 	}
 
 	free(stream->buffer);
-	return fclose(stream->file);
+	stream->buffer = NULL;
+
+	/* A memory stream does not own the memory it reads from */
+	if (stream->file == NULL)
+	{
+		stream->map = NULL;
+		return E_SUCCESS;
+	}
+
+	if (stream->map != NULL)
+	{
+		munmap(stream->map,stream->map_size);
+		stream->map = NULL;
+	}
+
+	if (stream->wbuf != NULL)
+	{
+		rc = _flush_wbuf(stream);
+		free(stream->wbuf);
+		stream->wbuf = NULL;
+	}
+	if (fclose(stream->file) != 0 || rc != E_SUCCESS)
+	{
+		return E_FAILED_FILE_WRITE;
+	}
+	return E_SUCCESS;
 }
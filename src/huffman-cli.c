@@ -2,37 +2,325 @@
 /* Iestyn Pryce 2012 */
 
 #include "huffman.h"
+#include "huffman_errno.h"
+#include "huffman_format.h"
+#include "huffman_tree.h"
+#include "huffman_pool.h"
 #include "file_stat.h"
 
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Suffix of the files compressed in batch mode */
+#define HUFF_SUFFIX ".huff"
+
+/* Largest file a batch worker reads into its own buffer. Longer files *
+ * are coded through the file streams, so the buffers kept by the       *
+ * workers stay small.                                                  */
+#define BATCH_MAX_BUFFERED (16*1024*1024)
 
 /* Structure to store commandline options */
 struct opts
 {
 	bool statistics;
+	bool stats_json;
 	bool unhuffman;
+	size_t block_size;
+	unsigned int max_code_len;
+	unsigned int threads;
+	unsigned int streams;
+	bool index;
+	bool adaptive;
+	bool context;
+	bool checksum;
+	unsigned int sample;
+	bool range;
+	uint64_t range_offset;
+	uint64_t range_length;
+	const char *codebook;
 	FILE *infile;
 	FILE *outfile;
+	bool batch;		/* Code every file named to a file of its own */
+	bool nul_list;		/* Read more names from STDIN, NUL separated */
+	const char *outdir;
+	const char *suffix;
+	char **files;
+	size_t nfiles;
+	size_t files_size;
 };
 
 /* Usage... */
 void usage(char *argv[]) {
 	printf("%s [-sc",argv[0]);
 #ifndef UNHUFFMAN
-	printf("u");
+	printf("uixa1k");
+#endif
+	printf("] ");
+#ifndef UNHUFFMAN
+	printf("[-b size] [-l bits] [-p percent] ");
 #endif
-	printf("] [file] [outfile]\n");
+	printf("[-T threads] [-r offset:length] [--stats-format=text|json] ");
+	printf("[--codebook file] [file] [outfile]\n");
+	printf("%s [options] [-0] [-o dir] [-S suffix] file|@list ...\n",
+			argv[0]);
 	printf("\n");
 	printf("Options:\n");
-	printf("-s: print compression statistics to STDOUT\n");
+	printf("-s: print compression statistics to STDOUT, with the time\n");
+	printf("    spent in each stage and the memory used\n");
+	printf("--stats-format: print the -s statistics as text or as a JSON\n");
+	printf("    object, implies -s\n");
+	printf("--codebook: code with a codebook made by the codebook tool\n");
+	printf("    rather than a tree of the input's own, for short inputs.\n");
+	printf("    The same codebook is needed to decode\n");
 #ifndef UNHUFFMAN
 	printf("-u: decompress the input file\n");
 #endif
 	printf("-c: output to STDOUT\n");
+#ifndef UNHUFFMAN
+	printf("-b: compress in independent blocks of size bytes (K and M\n");
+	printf("    suffixes allowed), output starts after the first block\n");
+	printf("-l: limit codes to at most bits bits, from 11 to 15\n");
+	printf("-i: code each block as four interleaved streams, which\n");
+	printf("    decode faster\n");
+	printf("-x: end the output with an index of the blocks, so that it\n");
+	printf("    can be read from any offset with -r\n");
+	printf("-1: code each block with several trees, picking the tree\n");
+	printf("    of each byte by the byte before it, for structured text\n");
+	printf("-k: end each block with a checksum of its data, which is\n");
+	printf("    checked when it is decoded\n");
+	printf("-a: code in one pass with a tree updated after every byte,\n");
+	printf("    writing the output as the input arrives\n");
+	printf("-p: build the code from percent of a large file, 1 to 100,\n");
+	printf("    so that it is only read once\n");
+	printf("-T: compress blocks on threads threads, with an index of the\n");
+	printf("    blocks at the end of the output. With -u, decode the blocks\n");
+	printf("    of an indexed file on threads threads\n");
+#else
+	printf("-T: decode the blocks of an indexed file on threads threads\n");
+#endif
+	printf("-r: decode only length bytes from offset onwards of a file\n");
+	printf("    with a block index\n");
+	printf("-o: batch mode, write the output of every file into dir\n");
+	printf("-S: batch mode, name the output of every file by adding\n");
+	printf("    suffix, or by removing it when decompressing. The\n");
+	printf("    default is " HUFF_SUFFIX "\n");
+	printf("-0: batch mode, read more file names from STDIN separated\n");
+	printf("    by NUL characters, as find -print0 writes them\n");
 	printf("-h: this message\n");
 	printf("\nIf no outfile is specifed STDOUT will be used\n");
+	printf("\nIn batch mode every file given is coded, an @list argument\n");
+	printf("naming a file with one file name on each line, @- for STDIN.\n");
+	printf("More than two files given start batch mode as -S does.\n");
+	printf("-T sets the number of files coded at once, and -s prints\n");
+	printf("the statistics of all of the files together\n");
+}
+
+/* Parse a size in bytes with an optional K or M suffix. Returns 0 if *
+ * the size is not valid.                                            */
+size_t parse_size(const char *arg)
+{
+	char *end;
+	unsigned long size = strtoul(arg,&end,10);
+
+	switch (toupper((unsigned char)*end))
+	{
+	case 'K':
+		size *= 1024;
+		end++;
+		break;
+	case 'M':
+		size *= 1024*1024;
+		end++;
+		break;
+	}
+	if (end == arg || *end != '\0')
+	{
+		return 0;
+	}
+	return size;
+}
+
+/* Parse a byte range given as offset:length. Returns false if the range *
+ * is not valid.                                                         */
+bool parse_range(const char *arg, uint64_t *offset, uint64_t *length)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*arg))
+	{
+		return false;
+	}
+	*offset = strtoull(arg,&end,10);
+	if (*end != ':' || !isdigit((unsigned char)end[1]))
+	{
+		return false;
+	}
+	arg = end + 1;
+	*length = strtoull(arg,&end,10);
+	return *end == '\0';
+}
+
+/* Take the long --stats-format and --codebook options out of the      *
+ * arguments, which are otherwise all short options for getopt. Returns *
+ * the new argc.                                                        */
+int parse_long_options(int argc, char *argv[], struct opts *options)
+{
+	const char *prefix = "--stats-format=";
+	const char *format;
+	int i, n = 1;
+
+	for (i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i],"--") == 0)
+		{
+			/* Leave anything after the end of the options alone */
+			while (i < argc)
+			{
+				argv[n++] = argv[i++];
+			}
+			break;
+		}
+		if (strcmp(argv[i],"--codebook") == 0)
+		{
+			if (++i == argc)
+			{
+				fprintf(stderr,"No codebook file given\n");
+				usage(argv);
+				exit(2);
+			}
+			options->codebook = argv[i];
+			continue;
+		}
+		if (strncmp(argv[i],"--codebook=",11) == 0)
+		{
+			options->codebook = argv[i] + 11;
+			continue;
+		}
+		if (strncmp(argv[i],prefix,strlen(prefix)) != 0)
+		{
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		format = argv[i] + strlen(prefix);
+		if (strcmp(format,"json") == 0)
+		{
+			options->stats_json = true;
+		}
+		else if (strcmp(format,"text") == 0)
+		{
+			options->stats_json = false;
+		}
+		else
+		{
+			fprintf(stderr,"Invalid statistics format: %s\n",format);
+			usage(argv);
+			exit(2);
+		}
+		options->statistics = true;
+	}
+	argv[n] = NULL;
+	return n;
+}
+
+/* Add a copy of `name' to the files coded in batch mode */
+void add_file(struct opts *options, const char *name, size_t len)
+{
+	char **files;
+
+	if (options->nfiles == options->files_size)
+	{
+		options->files_size = (options->files_size > 0) ?
+			2*options->files_size : 64;
+		files = realloc(options->files,
+				options->files_size*sizeof(char *));
+		if (files == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			exit(2);
+		}
+		options->files = files;
+	}
+	options->files[options->nfiles] = malloc(len + 1);
+	if (options->files[options->nfiles] == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		exit(2);
+	}
+	memcpy(options->files[options->nfiles],name,len);
+	options->files[options->nfiles++][len] = '\0';
+}
+
+/* Add the file names in `file', separated by `delim', to the files   *
+ * coded in batch mode. Empty names are skipped, as is the carriage    *
+ * return ending a line of a list written on Windows.                  */
+void read_file_list(struct opts *options, FILE *file, int delim)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	while ((len = getdelim(&line,&size,delim,file)) > 0)
+	{
+		if (line[len-1] == delim)
+		{
+			len--;
+		}
+		if (delim == '\n' && len > 0 && line[len-1] == '\r')
+		{
+			len--;
+		}
+		if (len > 0)
+		{
+			add_file(options,line,len);
+		}
+	}
+	free(line);
+}
+
+/* Collect the files coded in batch mode from the arguments, from any *
+ * @list files they name and, with -0, from STDIN.                    */
+void collect_files(struct opts *options, int argc, char *argv[], int index)
+{
+	FILE *list;
+
+	for (; index < argc; index++)
+	{
+		if (*argv[index] != '@')
+		{
+			add_file(options,argv[index],strlen(argv[index]));
+			continue;
+		}
+		if (strcmp(argv[index],"@-") == 0)
+		{
+			read_file_list(options,stdin,'\n');
+			continue;
+		}
+		list = fopen(argv[index] + 1,"r");
+		if (list == NULL)
+		{
+			fprintf(stderr,"Failed to open file: %s\n",
+					argv[index] + 1);
+			exit(2);
+		}
+		read_file_list(options,list,'\n');
+		fclose(list);
+	}
+	if (options->nul_list)
+	{
+		read_file_list(options,stdin,'\0');
+	}
 }
 
 /* Pasrse the command line arguments */
@@ -42,9 +330,21 @@ struct opts optparse(int argc, char *argv[])
 	bool error = false;
 	bool standard_output = false;
 	struct opts options = { .unhuffman  = false, .statistics = false,
-		   		.infile = NULL, .outfile = NULL };
+				.block_size = 0, .max_code_len = 0,
+				.threads = 0, .streams = 0, .index = false,
+				.adaptive = false, .context = false,
+				.checksum = false, .sample = 0,
+				.range = false, .stats_json = false,
+				.codebook = NULL,
+		   		.infile = NULL, .outfile = NULL,
+				.batch = false, .nul_list = false,
+				.outdir = NULL, .suffix = NULL,
+				.files = NULL, .nfiles = 0, .files_size = 0 };
+	struct stat st;
+	int i;
 
-	while ((c = getopt (argc, argv, "csuh")) != -1)
+	argc = parse_long_options(argc,argv,&options);
+	while ((c = getopt (argc, argv, "csuixa1kh0b:l:p:T:r:o:S:")) != -1)
 	{
 		switch (c)
 		{
@@ -58,7 +358,83 @@ struct opts optparse(int argc, char *argv[])
 		case 'u':
 			options.unhuffman = true;
 			break;
+		case 'i':
+			options.streams = HUFB_STREAMS;
+			break;
+		case 'x':
+			options.index = true;
+			break;
+		case 'a':
+			options.adaptive = true;
+			break;
+		case '1':
+			options.context = true;
+			break;
+		case 'k':
+			options.checksum = true;
+			break;
+		case 'p':
+			options.sample = atoi(optarg);
+			if (options.sample < 1 || options.sample > 100)
+			{
+				fprintf(stderr,"Invalid sample percentage: %s\n",
+						optarg);
+				error = true;
+			}
+			break;
+		case 'b':
+			options.block_size = parse_size(optarg);
+			if (options.block_size == 0)
+			{
+				fprintf(stderr,"Invalid block size: %s\n",optarg);
+				error = true;
+			}
+			break;
+		case 'l':
+			options.max_code_len = atoi(optarg);
+			if (options.max_code_len < HUFF_MIN_CODE_LEN ||
+				options.max_code_len > HUFF_MAX_CODE_LEN)
+			{
+				fprintf(stderr,"Invalid code length: %s\n",optarg);
+				error = true;
+			}
+			break;
 #endif			
+		case 'T':
+			options.threads = atoi(optarg);
+			if (options.threads < 1 ||
+				options.threads > HUFF_MAX_THREADS)
+			{
+				fprintf(stderr,"Invalid thread count: %s\n",optarg);
+				error = true;
+			}
+			break;
+		case 'r':
+			options.range = true;
+			if (!parse_range(optarg,&options.range_offset,
+					&options.range_length))
+			{
+				fprintf(stderr,"Invalid range: %s\n",optarg);
+				error = true;
+			}
+			break;
+		case 'o':
+			options.outdir = optarg;
+			options.batch = true;
+			if (stat(optarg,&st) != 0 || !S_ISDIR(st.st_mode))
+			{
+				fprintf(stderr,"Not a directory: %s\n",optarg);
+				error = true;
+			}
+			break;
+		case 'S':
+			options.suffix = optarg;
+			options.batch = true;
+			break;
+		case '0':
+			options.nul_list = true;
+			options.batch = true;
+			break;
 		case 'h':
 			usage(argv);
 			exit(EXIT_SUCCESS);
@@ -75,6 +451,46 @@ struct opts optparse(int argc, char *argv[])
 	}
 	
 	int index = optind;
+	for (i=index; i<argc; i++)
+	{
+		/* A list of files is only read in batch mode */
+		if (*argv[i] == '@')
+		{
+			options.batch = true;
+		}
+	}
+	if (argc - index > 2)
+	{
+		/* More than an input and an output file is a list of files, *
+		 * never coded one into another                              */
+		options.batch = true;
+	}
+	if (options.batch)
+	{
+		if (standard_output || options.range)
+		{
+			fprintf(stderr,"Batch mode cannot write to STDOUT or "
+					"decode a range\n");
+			usage(argv);
+			exit(2);
+		}
+		if (options.outdir == NULL && options.suffix != NULL &&
+				*options.suffix == '\0')
+		{
+			fprintf(stderr,"An empty suffix needs an output "
+					"directory\n");
+			usage(argv);
+			exit(2);
+		}
+		collect_files(&options,argc,argv,index);
+		if (options.nfiles == 0)
+		{
+			fprintf(stderr,"No input file defined\n");
+			usage(argv);
+			exit(2);
+		}
+		return options;
+	}
 	if (index < argc)
 	{
 		if (*argv[index] == '-')
@@ -115,52 +531,654 @@ struct opts optparse(int argc, char *argv[])
 	return options;
 }
 
+/* Print the statistics of a run, as text or as a JSON object. A batch *
+ * gives the number of `files' it coded, and of those which `failed',   *
+ * a single file 0 for both.                                             */
+void print_stats(const huffman_stats *st, uint64_t in_bytes,
+		uint64_t out_bytes, size_t files, size_t failed,
+		bool unhuffman, bool json)
+{
+	static const char *stages[HUFF_STAGES] = {
+		"histogram", "tree", "header", "code", "write"
+	};
+	double ratio = (in_bytes > 0) ? (double)out_bytes/in_bytes : 0;
+	/* Speed is measured on the uncompressed side */
+	uint64_t raw = unhuffman ? st->out_bytes : st->in_bytes;
+	double mbs = (st->seconds > 0) ?
+		(double)raw/(1024*1024)/st->seconds : 0;
+	int i;
+
+	if (json)
+	{
+		printf("{");
+		if (files > 0)
+		{
+			printf("\"files\": %zu, \"failed\": %zu, ",files,failed);
+		}
+		printf("\"input_bytes\": %" PRIu64 ", \"output_bytes\": %"
+				PRIu64 ", \"compression_ratio\": %.4f, ",
+				in_bytes,out_bytes,ratio);
+		printf("\"seconds\": %.6f, \"mb_per_second\": %.2f, ",
+				st->seconds,mbs);
+		printf("\"stage_seconds\": {");
+		for (i=0; i<HUFF_STAGES; i++)
+		{
+			printf("%s\"%s\": %.6f",(i > 0) ? ", " : "",stages[i],
+					st->stage_seconds[i]);
+		}
+		printf("}, \"blocks\": %" PRIu64 ", \"stored_blocks\": %"
+				PRIu64 ", \"run_blocks\": %" PRIu64 ", ",
+				st->blocks,st->stored_blocks,st->run_blocks);
+		printf("\"max_code_len\": %u, ",st->max_code_len);
+		printf("\"counted_bytes\": %" PRIu64 ", ",st->counted_bytes);
+		printf("\"buffer_bytes\": %" PRIu64 ", \"peak_memory\": %"
+				PRIu64 "}\n",st->buffer_bytes,st->peak_memory);
+		return;
+	}
+
+	if (files > 0)
+	{
+		printf("Files: %zu (%zu failed)\n",files,failed);
+	}
+	printf("Input bytes: %" PRIu64 "\n",in_bytes);
+	printf("Output bytes: %" PRIu64 "\n",out_bytes);
+	printf("Compression ratio: %.4f\n",ratio);
+	printf("Time: %.6f s (%.2f MB/s)\n",st->seconds,mbs);
+	for (i=0; i<HUFF_STAGES; i++)
+	{
+		printf("  %-10s %.6f s\n",stages[i],st->stage_seconds[i]);
+	}
+	printf("Blocks: %" PRIu64 "\n",st->blocks);
+	printf("Stored blocks: %" PRIu64 "\n",st->stored_blocks);
+	printf("Run blocks: %" PRIu64 "\n",st->run_blocks);
+	printf("Longest code: %u bits\n",st->max_code_len);
+	if (st->counted_bytes > 0)
+	{
+		/* Less than the whole input for a code built from a sample */
+		printf("Code built from: %" PRIu64 " bytes (%.2f%%)\n",
+				st->counted_bytes,
+				(raw > 0) ? 100.0*st->counted_bytes/raw : 0);
+	}
+	printf("Buffer bytes: %" PRIu64 "\n",st->buffer_bytes);
+	printf("Peak memory: %" PRIu64 " bytes\n",st->peak_memory);
+}
+
+/* Load the codebook in the file `path', exiting if it cannot be read */
+HuffCodebook *load_codebook(const char *path)
+{
+	HuffCodebook *book = NULL;
+	f_stat fp;
+	FILE *file;
+	int rc;
+
+	file = fopen(path,"rb");
+	if (file == NULL)
+	{
+		fprintf(stderr,"Failed to open file: %s\n",path);
+		exit(2);
+	}
+	finit_stat(&fp,file);
+	rc = huffman_codebook_load(&book,&fp);
+	fclose_stat(&fp);
+	if (rc != HUFF_SUCCESS)
+	{
+		fprintf(stderr,"Not a valid codebook: %s\n",path);
+		exit(2);
+	}
+	return book;
+}
+
+/* Code `in' to `out' as the options say, on up to `threads' threads, *
+ * filling in `st'.                                                    */
+int code_stream(f_stat *in, f_stat *out, const struct opts *options,
+		const HuffCodebook *book, unsigned int threads,
+		huffman_stats *st)
+{
+	if (options->unhuffman)
+	{
+		huffman_opts hopts = { .threads = threads,
+				       .stats = st,
+				       .codebook = book };
+		return unhuffman_opt(in,out,&hopts);
+	}
+	else
+	{
+		huffman_opts hopts = { .block_size = options->block_size,
+				       .max_code_len = options->max_code_len,
+				       .threads = threads,
+				       .streams = options->streams,
+				       .index = options->index,
+				       .adaptive = options->adaptive,
+				       .context = options->context,
+				       .checksum = options->checksum,
+				       .sample = options->sample,
+				       .stats = st,
+				       .codebook = book };
+		return huffman_opt(in,out,&hopts);
+	}
+}
+
+/* Explain why coding failed with `rc'. In batch mode the message      *
+ * starts with the name of the file, `path', and every failure gets    *
+ * one, otherwise only those the library does not explain itself.      */
+void print_error(const char *path, int rc, const struct opts *options,
+		const HuffCodebook *book)
+{
+	const char *prefix = (path != NULL) ? path : "";
+	const char *sep = (path != NULL) ? ": " : "";
+
+	if (rc == HUFF_CODEBOOK)
+	{
+		fprintf(stderr,"%s%sFile was coded with a codebook, give the "
+				"same one with --codebook\n",prefix,sep);
+	}
+	else if (rc == HUFF_CHECKSUM)
+	{
+		fprintf(stderr,"%s%sDecoded data does not match its checksum, "
+				"the file is corrupt\n",prefix,sep);
+	}
+	else if (rc == HUFF_INVALIDARG && !options->unhuffman &&
+			options->adaptive)
+	{
+		fprintf(stderr,"%s%sAdaptive coding cannot be used with blocks, "
+				"checksums or a codebook\n",prefix,sep);
+	}
+	else if (rc == HUFF_INVALIDARG && !options->unhuffman &&
+			options->context)
+	{
+		fprintf(stderr,"%s%sContext blocks cannot be used with -i, "
+				"adaptive coding or a codebook\n",prefix,sep);
+	}
+	else if (rc == HUFF_INVALIDARG && !options->unhuffman &&
+			options->sample != 0)
+	{
+		fprintf(stderr,"%s%sA sampled code cannot be used with blocks, "
+				"checksums or a codebook\n",prefix,sep);
+	}
+	else if (rc == HUFF_INVALIDARG && !options->unhuffman && book != NULL)
+	{
+		fprintf(stderr,"%s%sA codebook cannot be used with blocks\n",
+				prefix,sep);
+	}
+	else if (rc == HUFF_INVALIDARG && !options->unhuffman)
+	{
+		fprintf(stderr,"%s%sInvalid block size, use %dK to %dM\n",
+				prefix,sep,HUFB_MIN_BLOCK_SIZE/1024,
+				HUFB_MAX_BLOCK_SIZE/(1024*1024));
+	}
+	else if (path == NULL && rc == HUFF_FAILURE && !options->unhuffman)
+	{
+		/* The decoder reports its own failures */
+		fprintf(stderr,"Failed to compress\n");
+	}
+	else if (path != NULL && rc == HUFF_WRITEFAIL)
+	{
+		fprintf(stderr,"%s%sFailed to write output\n",prefix,sep);
+	}
+	else if (path != NULL && rc != HUFF_SUCCESS)
+	{
+		fprintf(stderr,"%s: Failed to %s\n",path,
+				options->unhuffman ? "decompress" : "compress");
+	}
+}
+
+/* State of one thread of a batch, reused for every file it codes so   *
+ * that a file costs no more than opening, reading and writing it.      */
+struct batch_worker
+{
+	uint8_t *in;		/* Contents of the file being coded */
+	size_t in_size;
+	f_stat out;		/* Memory stream collecting its output */
+	huffman_stats total;	/* Of the files coded */
+	size_t files;
+	size_t failed;
+};
+
+/* A batch of files, handed out to the workers one at a time */
+struct batch
+{
+	const struct opts *options;
+	const HuffCodebook *book;
+	pthread_mutex_t lock;
+	size_t next;		/* Next file to hand out */
+	struct batch_worker *workers;
+};
+
+/* Seconds on the monotonic clock */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Add the statistics of a file to the totals of a batch */
+void add_stats(huffman_stats *total, const huffman_stats *st)
+{
+	int i;
+
+	total->in_bytes  += st->in_bytes;
+	total->out_bytes += st->out_bytes;
+	total->seconds   += st->seconds;
+	for (i=0; i<HUFF_STAGES; i++)
+	{
+		total->stage_seconds[i] += st->stage_seconds[i];
+	}
+	total->blocks += st->blocks;
+	total->stored_blocks += st->stored_blocks;
+	total->run_blocks += st->run_blocks;
+	total->counted_bytes += st->counted_bytes;
+	if (st->max_code_len > total->max_code_len)
+	{
+		total->max_code_len = st->max_code_len;
+	}
+	if (st->peak_memory > total->peak_memory)
+	{
+		total->peak_memory = st->peak_memory;
+	}
+}
+
+/* Work out the name of the file `path' is coded to in batch mode. A   *
+ * compressed file gets the suffix, which is taken off again when it   *
+ * is decompressed. Returns NULL, having said why, for a file which    *
+ * cannot be named.                                                     */
+char *output_name(const char *path, const struct opts *options)
+{
+	const char *suffix = (options->suffix != NULL) ? options->suffix :
+		HUFF_SUFFIX;
+	const char *name = path, *slash;
+	size_t len, slen = strlen(suffix), dlen = 0;
+	bool has_suffix;
+	char *out;
+
+	if (options->outdir != NULL)
+	{
+		slash = strrchr(path,'/');
+		name  = (slash != NULL) ? slash + 1 : path;
+		dlen  = strlen(options->outdir) + 1;
+	}
+	len = strlen(name);
+	has_suffix = slen > 0 && len > slen &&
+		strcmp(name + len - slen,suffix) == 0;
+
+	if (!options->unhuffman && has_suffix)
+	{
+		fprintf(stderr,"%s: Already has the %s suffix, skipped\n",
+				path,suffix);
+		return NULL;
+	}
+	if (options->unhuffman)
+	{
+		/* Decoded into a directory the name can be kept as it is */
+		if (!has_suffix && options->outdir == NULL)
+		{
+			fprintf(stderr,"%s: Does not end in %s, skipped\n",
+					path,suffix);
+			return NULL;
+		}
+		if (has_suffix)
+		{
+			len -= slen;
+		}
+		slen = 0;
+	}
+
+	out = malloc(dlen + len + slen + 1);
+	if (out == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return NULL;
+	}
+	if (dlen > 0)
+	{
+		memcpy(out,options->outdir,dlen - 1);
+		out[dlen - 1] = '/';
+	}
+	memcpy(out + dlen,name,len);
+	memcpy(out + dlen + len,suffix,slen);
+	out[dlen + len + slen] = '\0';
+	return out;
+}
+
+/* Read the `size' bytes of the open file `fd' into the worker's input  *
+ * buffer, which grows to the largest file read. Returns the number of *
+ * bytes read, or -1 on failure.                                        */
+ssize_t read_file(struct batch_worker *w, int fd, size_t size)
+{
+	uint8_t *buf;
+	size_t got = 0;
+	ssize_t n;
+
+	/* An empty file still needs memory to point at */
+	if (w->in == NULL || size > w->in_size)
+	{
+		buf = realloc(w->in,(size > 0) ? size : 1);
+		if (buf == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			return -1;
+		}
+		w->in      = buf;
+		w->in_size = (size > 0) ? size : 1;
+	}
+
+	while (got < size)
+	{
+		n = read(fd,w->in + got,size - got);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			return -1;
+		}
+		if (n == 0)
+		{
+			/* The file has shrunk since it was opened */
+			break;
+		}
+		got += n;
+	}
+	return got;
+}
+
+/* Write the `size' bytes at `data' to a new file at `path' */
+int write_file(const char *path, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	ssize_t n;
+	int fd;
+
+	fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0666);
+	if (fd < 0)
+	{
+		return HUFF_WRITEFAIL;
+	}
+	while (size > 0)
+	{
+		n = write(fd,p,size);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			close(fd);
+			unlink(path);
+			return HUFF_WRITEFAIL;
+		}
+		p    += n;
+		size -= n;
+	}
+	if (close(fd) != 0)
+	{
+		unlink(path);
+		return HUFF_WRITEFAIL;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Code the file `path' with the worker `w'. A file of up to            *
+ * BATCH_MAX_BUFFERED bytes is read into the worker's buffer and coded  *
+ * into its memory stream, whose contents are written out in one go.    *
+ * Longer files are coded through the file streams.                     */
+int batch_file(const struct batch *b, struct batch_worker *w,
+		const char *path)
+{
+	huffman_stats st;
+	struct stat sb;
+	f_stat in, out;
+	FILE *infile, *outfile;
+	char *outpath;
+	ssize_t size;
+	int fd, rc;
+
+	outpath = output_name(path,b->options);
+	if (outpath == NULL)
+	{
+		return HUFF_FAILURE;
+	}
+
+	fd = open(path,O_RDONLY);
+	if (fd < 0 || fstat(fd,&sb) != 0 || !S_ISREG(sb.st_mode))
+	{
+		fprintf(stderr,"%s: Failed to open file\n",path);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		free(outpath);
+		return HUFF_FAILURE;
+	}
+
+	if (sb.st_size <= BATCH_MAX_BUFFERED)
+	{
+		size = read_file(w,fd,sb.st_size);
+		close(fd);
+		if (size < 0)
+		{
+			fprintf(stderr,"%s: Failed to read file\n",path);
+			free(outpath);
+			return HUFF_FAILURE;
+		}
+		fmemopen_stat(&in,w->in,size);
+		freset_stat(&w->out);
+		rc = code_stream(&in,&w->out,b->options,b->book,1,&st);
+		fclose_stat(&in);
+		if (rc == HUFF_SUCCESS)
+		{
+			rc = write_file(outpath,w->out.buffer,
+					w->out.buffer_usage);
+		}
+	}
+	else
+	{
+		infile  = fdopen(fd,"rb");
+		outfile = fopen(outpath,"wb");
+		if (infile == NULL || outfile == NULL)
+		{
+			fprintf(stderr,"%s: Failed to open file\n",
+					(infile == NULL) ? path : outpath);
+			if (infile != NULL)
+			{
+				fclose(infile);
+			}
+			else
+			{
+				close(fd);
+			}
+			if (outfile != NULL)
+			{
+				fclose(outfile);
+				unlink(outpath);
+			}
+			free(outpath);
+			return HUFF_FAILURE;
+		}
+		finit_stat(&in,infile);
+		finit_stat(&out,outfile);
+		rc = code_stream(&in,&out,b->options,b->book,1,&st);
+		fclose_stat(&in);
+		if (fclose_stat(&out) != 0 && rc == HUFF_SUCCESS)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		if (rc != HUFF_SUCCESS)
+		{
+			unlink(outpath);
+		}
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		add_stats(&w->total,&st);
+	}
+	else
+	{
+		print_error(path,rc,b->options,b->book);
+	}
+	free(outpath);
+	return rc;
+}
+
+/* Code files of the batch with one worker until none are left */
+void batch_job(void *arg, size_t job)
+{
+	struct batch *b = arg;
+	struct batch_worker *w = &b->workers[job];
+	size_t i;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->options->nfiles)
+		{
+			break;
+		}
+
+		w->files++;
+		if (batch_file(b,w,b->options->files[i]) != HUFF_SUCCESS)
+		{
+			w->failed++;
+		}
+	}
+}
+
+/* Code every file of the batch on a pool of `options->threads'        *
+ * threads, each with a worker of its own, and print the statistics of *
+ * all of them together. Returns HUFF_FAILURE if any file failed.      */
+int run_batch(const struct opts *options, const HuffCodebook *book)
+{
+	struct batch b = { .options = options, .book = book, .next = 0 };
+	unsigned int threads = (options->threads > 0) ? options->threads : 1;
+	huffman_stats total = { 0 };
+	size_t files = 0, failed = 0;
+	HuffPool *pool;
+	unsigned int i;
+	double start;
+	int rc;
+
+	if (threads > options->nfiles)
+	{
+		threads = options->nfiles;
+	}
+	b.workers = calloc(threads,sizeof(struct batch_worker));
+	if (b.workers == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+	rc = huffman_pool_create(&pool,threads);
+	if (rc != HUFF_SUCCESS)
+	{
+		free(b.workers);
+		return rc;
+	}
+	for (i=0; i<threads; i++)
+	{
+		fmemopen_stat(&b.workers[i].out,NULL,0);
+	}
+	pthread_mutex_init(&b.lock,NULL);
+
+	start = now();
+	huffman_pool_run(pool,batch_job,&b,threads);
+
+	for (i=0; i<threads; i++)
+	{
+		add_stats(&total,&b.workers[i].total);
+		total.buffer_bytes += b.workers[i].in_size +
+			b.workers[i].out.buffer_size;
+		files  += b.workers[i].files;
+		failed += b.workers[i].failed;
+		free(b.workers[i].in);
+		fclose_stat(&b.workers[i].out);
+	}
+	/* Time taken by the batch, not the sum over the files */
+	total.seconds = now() - start;
+
+	pthread_mutex_destroy(&b.lock);
+	huffman_pool_destroy(pool);
+	free(b.workers);
+
+	if (options->statistics == true)
+	{
+		print_stats(&total,total.in_bytes,total.out_bytes,files,failed,
+				options->unhuffman,options->stats_json);
+	}
+	return (failed > 0) ? HUFF_FAILURE : HUFF_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
 	f_stat in;
 	f_stat out;
+	huffman_stats stats = { 0 };
+	HuffCodebook *book = NULL;
+	size_t i;
 	int rc;
 
 	/* Process the input arguments */
 	struct opts options = optparse(argc,argv);
-
-	in.byte_count      = 0;
-	in.fully_buffered  = false;
-	in.buffer          = NULL;
-	in.buffer_size     = 0;
-	in.buffer_usage    = 0;
-	in.buffer_ptr 	   = 0;
-	in.file            = options.infile;
-	out.byte_count     = 0;
-	out.fully_buffered = false;
-	out.buffer         = NULL;
-	out.buffer_size    = 0;
-	out.buffer_usage   = 0;
-	out.buffer_ptr 	   = 0;
-	out.file           = options.outfile;
+	if (options.codebook != NULL)
+	{
+		book = load_codebook(options.codebook);
+	}
 
 #ifdef UNHUFFMAN
 	options.unhuffman = true;
 #endif
 
-	if (options.unhuffman)
+	if (options.batch)
 	{
-		rc = unhuffman(&in,&out);
+		rc = run_batch(&options,book);
+		huffman_codebook_free(book);
+		for (i=0; i<options.nfiles; i++)
+		{
+			free(options.files[i]);
+		}
+		free(options.files);
+		return rc;
+	}
+
+	finit_stat(&in,options.infile);
+	finit_stat(&out,options.outfile);
+
+	if (options.range)
+	{
+		rc = huffman_read_range(&in,&out,options.range_offset,
+				options.range_length);
+		if (rc == HUFF_NOINDEX)
+		{
+			fprintf(stderr,"File has no block index, compress it "
+					"with -x or -T\n");
+		}
 	}
 	else
 	{
-		rc = huffman(&in,&out);
+		rc = code_stream(&in,&out,&options,book,options.threads,&stats);
+		print_error(NULL,rc,&options,book);
 	}
 
-	/* Finally we close the input and output file */
+	/* Finally we close the input and output file, which writes out *
+	 * anything still held in the output buffer                     */
+	huffman_codebook_free(book);
 	fclose_stat(&in);
-	fclose_stat(&out);
+	if (fclose_stat(&out) != 0 && rc == HUFF_SUCCESS)
+	{
+		fprintf(stderr,"Failed to write output\n");
+		rc = HUFF_WRITEFAIL;
+	}
 
 	if (options.statistics == true)
 	{
-		printf("Input bytes: %ld\n",in.byte_count);
-		printf("Output bytes: %ld\n",out.byte_count);
-		double compression_ratio = (double)out.byte_count/in.byte_count;
-		printf("Compression ratio: %.4f\n",compression_ratio);
+		print_stats(&stats,in.byte_count,out.byte_count,0,0,
+				options.unhuffman,options.stats_json);
 	}
 
 	return rc;
@@ -6,6 +6,13 @@
 #include "huffman.h"
 #include "huffman_util.h"
 #include "huffman_errno.h"
+#include "huffman_histogram.h"
+#include "huffman_tree.h"
+#include "huffman_format.h"
+#include "huffman_bits.h"
+#include "huffman_pool.h"
+#include "huffman_adaptive.h"
+#include "huffman_crc.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -14,765 +21,1170 @@
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <assert.h>
 
-/* Structure to build a linked list of bits */
-typedef struct bits
-{
-	bool         bit;
-        struct bits *next;
-} Bits;
+/* Number of bytes read at a time from the input */
+#define STAT_CHUNK_SIZE (64*1024)
 
-/* Structure to build a linked list of symbols and bit codes */
-typedef struct code
-{
-	struct bits   *code;
-	unsigned int   length;
-	unsigned char  symbol;
-	struct code   *next;
-} Code;
+/* Size of the pieces of the input counted for a sampled code */
+#define SAMPLE_PIECE (4*1024)
 
-typedef struct node 
-{
-	char value;
-	struct node *left;
-	struct node *right;
-} Node;
+/* Fewest pieces worth sampling. Shorter inputs have every byte counted */
+#define SAMPLE_MIN_PIECES 64
 
-typedef struct {
-	uint8_t	buf;
-	int	        len;
-} Buffer;
+/* Weight given to a symbol missing from the sample, so that it still *
+ * has a code should it turn up in the rest of the input              */
+#define SAMPLE_MIN_WEIGHT 1
 
-HUFF_ERR  _output_byte(Node **ret_node, Buffer *b, Node *n, Node *top, int stop, FILE *output);
-void _free_tree(Symbol *t);
+/* Number of symbols coded between checks for room in the output buffer */
+#define ENCODE_PIECE (4*1024)
 
-/* Comparison function to be used by the C library qsort(...) function */
-int _symbol_cmp (const void *s1, const void *s2)
-{
-	/* Validate the input */
-	assert(s1 != NULL && s2 != NULL);
+/* Size of the buffer the encoder writes to before passing it to the *
+ * output stream. Has room for a piece of the longest codes.          */
+#define ENCODE_BUF_SIZE (64*1024)
 
-	const Symbol *_s1 = *(Symbol **)s1;
-	const Symbol *_s2 = *(Symbol **)s2;
-	return _s1->weight - _s2->weight;
-}
+/* Largest code length header, every symbol from 0 to 255 in the dense *
+ * layout. The sparse layout is only used when it is smaller.            */
+#define LENGTHS_MAX_SIZE (3+HUFF_SYMBOLS/2)
 
-/* Sort the linked list by swapping the values  *
- * Uses the stdlib qsort algorithm. 		*/
-HUFF_ERR _sort_symbol_list(Symbol **start, Symbol* s)
-{
-	int i;
-	int count = 0;
-	
-	*start = s;
-	
-	/* Count number of elements in the linked list */
-	do
-	{
-		count++;
-	} while ((s=s->next));
-	
-	/* Build an array of pointers to symbols*/
-	Symbol **symbol_list = calloc(count,sizeof(Symbol*));
-	s = *start;
+/* Most a block of up to `bs' bytes codes to: the block header, the    *
+ * stream sizes and code lengths, the longest codes for every byte with *
+ * each stream padded to a byte, the footer, checksum and bit writer    *
+ * slack.                                                               */
+#define BLOCK_CODE_SIZE(bs) (HUFB_BLOCK_HEADER_SIZE + \
+		HUFB_STREAMS_HEADER_SIZE + LENGTHS_MAX_SIZE + \
+		(bs)/8*HUFF_MAX_CODE_LEN + HUFF_MAX_CODE_LEN + HUFB_STREAMS + \
+		1 + HUFB_CRC_SIZE + HUFF_BITS_SLACK)
 
-	for (i=0; i<count; i++)
-	{
-		symbol_list[i] = s;
-		s = s->next;
-	}
+/* Scratch memory to code a block of up to `bs' bytes into, with room  *
+ * after the coded block to gather the bytes between the runs of a     *
+ * HUFB_RUNS block. Allocated once for all of the blocks of a call.    */
+#define BLOCK_WORK_SIZE(bs) (BLOCK_CODE_SIZE(bs) + (bs))
 
-	/* Sort using qsort */
-	qsort(symbol_list, count, sizeof (Symbol*), (void*)_symbol_cmp);
+/* Number of bits which index the first level of the decode table */
+#define DECODE_BITS 11
 
-	/* Rebuild the linked list */
-	*start = symbol_list[0];
-	s = *start;
-	for (i=1; i<count; i++)
-	{
-		s->next = symbol_list[i];
-		s = s->next;
-	}
-	s->next = NULL;
+/* Size of the decode table, the first level followed by room for a    *
+ * second level table for every symbol with a code longer than         *
+ * DECODE_BITS.                                                        */
+#define DECODE_TABLE_SIZE ((1 << DECODE_BITS) + \
+		HUFF_SYMBOLS * (1 << (HUFF_MAX_CODE_LEN - DECODE_BITS)))
 
-	free(symbol_list);
+/* Entries of the decode tables of the codes of a HUFB_CONTEXT block */
+#define CONTEXT_TABLES_SIZE (HUFB_CONTEXT_CODES*DECODE_TABLE_SIZE)
 
-	return HUFF_SUCCESS;
-}
+/* Shortest block worth coding with codes picked by the previous byte, *
+ * shorter blocks do not make up for the codes written ahead of them   */
+#define CONTEXT_MIN_BLOCK (16*1024)
 
-/* Create a linked list of statistics for bytes in the input */
-HUFF_ERR _build_statistics(Symbol **root, f_stat *fp)
-{
-	assert(fp != NULL);
+/* Most rounds of moving the contexts between the codes of a block */
+#define CONTEXT_ROUNDS 6
 
-	Symbol *start, *s;
-	int c;
+/* Shortest run of one byte listed in a HUFB_RUNS block. Runs are found *
+ * by checking windows of half that length, one of which lies wholly in *
+ * any run that long.                                                    */
+#define RUN_MIN_LENGTH 128
+#define RUN_WINDOW (RUN_MIN_LENGTH/2)
 
-	start = calloc(1,sizeof(Symbol));
-	if (start == NULL )
-	{
-		/* Out of memory */
-		perror("Unable to allocate memory");
-		return HUFF_NOMEM;
-	}
+/* Runs must cover at least this fraction of a block for it to be coded *
+ * as a HUFB_RUNS block rather than in the layout asked for alone       */
+#define RUN_MIN_SHARE 16
 
-	start->symbol = fgetc_stat(fp);
-	start->weight++;
+/* Size of the buffer the decoder writes to before passing it to the *
+ * output stream.                                                     */
+#define DECODE_BUF_SIZE (256*1024)
 
-	/* Copy the starting position */
-	s = start;
+/* Huffman code of a symbol, in the low `len' bits of `code' */
+typedef struct huff_code
+{
+	uint16_t code;
+	uint8_t  len;
+} HuffCode;
+
+/* Scratch memory for working out the codes of a HUFB_CONTEXT block.    *
+ * Each previous byte, a context, is given one of `codes' codes, which  *
+ * is built from the counts of all of the contexts given it.            */
+typedef struct huff_context_model
+{
+	uint32_t counts[HUFF_SYMBOLS][HUFF_SYMBOLS];	/* By context */
+	uint64_t code_counts[HUFB_CONTEXT_CODES][HUFF_SYMBOLS];
+	uint8_t  lengths[HUFB_CONTEXT_CODES][HUFF_SYMBOLS];
+	HuffCode table[HUFB_CONTEXT_CODES][HUFF_SYMBOLS];
+	uint8_t  map[HUFF_SYMBOLS];	/* Code of each context */
+	unsigned int codes;
+} ContextModel;
+
+/* Entry of the decode table for the code starting with the bits of its *
+ * index. `len' is the length of the code of `symbol', or 0 if no code  *
+ * starts with those bits. A first level entry for codes longer than    *
+ * DECODE_BITS instead has the offset of a second level table in `sub'  *
+ * and the number of further bits which index it in `len'.              */
+typedef struct huff_decode_entry
+{
+	uint8_t  symbol;
+	uint8_t  len;
+	uint16_t sub;
+} DecodeEntry;
+
+/* A trained code with its encoder and decoder tables, built once when *
+ * the codebook is trained or loaded                                    */
+struct huff_codebook
+{
+	uint32_t    id;
+	uint8_t     lengths[HUFF_SYMBOLS];
+	HuffCode    codes[HUFF_SYMBOLS];
+	DecodeEntry table[DECODE_TABLE_SIZE];
+};
+
+/* Entry of the block index */
+typedef struct hufb_index_entry
+{
+	uint64_t offset;	/* Of the block header from the file header */
+	uint32_t comp_len;	/* Block header and payload */
+	uint32_t raw_len;
+} IndexEntry;
 
-	while((c=fgetc_stat(fp))!=EOF)
-	{
-		while (s->symbol != c && s->next != NULL)
-		{
-			s = s->next;
-		}
-		if (s->symbol != c)
-		{
-			s->next = calloc(1,sizeof(Symbol));
-			if (s->next == NULL)
-			{
-				/* Out of memory */
-				perror("Unable to allocate memory");
-				_free_tree(start);
-				return HUFF_NOMEM;
-			}
-			s=s->next;
-		}
+/* Index of the blocks written so far */
+typedef struct hufb_index
+{
+	IndexEntry *entries;
+	size_t      count;
+	size_t      size;
+} BlockIndex;
 
-		s->symbol = c;
-		s->weight++;
+/* A block coded on a worker thread into its own scratch memory */
+typedef struct block_job
+{
+	const uint8_t *data;
+	size_t         len;
+	uint8_t       *work;	/* Scratch memory the block is coded into */
+	size_t         size;	/* Size of the coded block */
+	huffman_stats  stats;
+	HUFF_ERR       rc;
+} BlockJob;
+
+/* The blocks coded in parallel in one run of the thread pool */
+typedef struct block_batch
+{
+	BlockJob           *jobs;
+	const huffman_opts *opts;
+} BlockBatch;
+
+/* A block decoded on a worker thread into `buf', with the context *
+ * tables kept at `ctx', which is then written to its place        *
+ * `out_offset' bytes into the output.                             */
+typedef struct decode_job
+{
+	const uint8_t *payload;
+	size_t         comp_len;
+	size_t         raw_len;
+	uint64_t       out_offset;
+	uint8_t       *buf;
+	DecodeEntry  **ctx;
+	huffman_stats  stats;
+	HUFF_ERR       rc;
+} DecodeJob;
+
+/* The blocks decoded in parallel in one run of the thread pool */
+typedef struct decode_batch
+{
+	DecodeJob     *jobs;
+	f_stat        *out;
+	bool           positioned;	/* Blocks are written by the threads */
+	huffman_stats *stats;	/* NULL unless statistics are collected */
+} DecodeBatch;
+
+/* Layouts of the code length header */
+enum lengths_layout {
+	LENGTHS_DENSE  = 0,	/* Every symbol from the first to the last  */
+	LENGTHS_SPARSE = 1,	/* Only the symbols with a code             */
+};
+
+/* Compressed file layouts, identified by their magic number */
+enum huff_format {
+	FORMAT_STREAM,	/* "HUFF": one tree and code stream for the input */
+	FORMAT_BLOCKS,	/* "HUFB": independently coded blocks             */
+	FORMAT_CODEBOOK, /* "HUFC": one code stream with a trained code    */
+	FORMAT_ADAPTIVE, /* "HUFA": one pass code updated after each symbol */
+};
+
+/* Seconds on the monotonic clock */
+static inline double _clock(void)
+{
+	struct timespec t;
 
-		s=start;
-	}
-	
-	return _sort_symbol_list(root,start);
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
 }
 
-/* Build a huffman code tree from a linked list of Symbols found in the *
- * input. Returns an array of the leaves of the tree by reference in 	*
- * through the 'leaves' parameter. 					*/
-HUFF_ERR _build_tree(Symbol ***leaves, Symbol *s)
+/* Start timing a stage, when statistics are being collected */
+static inline double _stage_start(const huffman_stats *st)
 {
-	assert (s != NULL);
+	return (st != NULL) ? _clock() : 0;
+}
 
-	Symbol *node = NULL;
-	HUFF_ERR rc = HUFF_SUCCESS;
+/* Add the time since `*t' to `stage' and start timing the next stage */
+static inline void _stage_end(huffman_stats *st, enum huff_stage stage,
+		double *t)
+{
+	double now;
 
-	unsigned int nleaves = UCHAR_MAX+1; /* 2**CHAR_BIT */
-	int n = 0;
-	
-	/* Make sure that we have an extra null terminated byte at the end */
-	*leaves = calloc(nleaves+1,sizeof(Symbol*));
-	if (*leaves == NULL)
+	if (st != NULL)
 	{
-		/* Out of memory */
-		perror("Unable to allocate memory");
-		return HUFF_NOMEM;
+		now = _clock();
+		st->stage_seconds[stage] += now - *t;
+		*t = now;
 	}
-	(*leaves)[nleaves] = NULL;
+}
 
-	/* Run if we only have a single symbol */
-	if (s->next == NULL) {
-		(*leaves)[n] = s;
-	}
+/* Note the longest of the code `lengths' in the statistics */
+static void _note_lengths(huffman_stats *st,
+		const uint8_t lengths[HUFF_SYMBOLS])
+{
+	unsigned int i;
 
-	while (s->next != NULL)
+	for (i=0; st != NULL && i<HUFF_SYMBOLS; i++)
 	{
-		/* Pop the first two symbols in the list and point to *
-		 * them on the left and right of the tree node        */
-		node = calloc(1,sizeof(Symbol));
-		if (node == NULL)
-		{
-			/* Out of memory */
-			return HUFF_NOMEM;
-		}
-		node->left = s;
-
-		if (s->left == NULL && s->right == NULL)
+		if (lengths[i] > st->max_code_len)
 		{
-			(*leaves)[n] = s;
-			n++;
+			st->max_code_len = lengths[i];
 		}
+	}
+}
 
-		s = s->next;
-		node->right = s;
+/* Add the statistics of a block coded on a pool thread to `to' */
+static void _add_stats(huffman_stats *to, const huffman_stats *from)
+{
+	unsigned int i;
 
-		if (s->left == NULL && s->right == NULL)
-		{
-			(*leaves)[n] = s;
-			n++;
-		}
+	if (to == NULL)
+	{
+		return;
+	}
+	for (i=0; i<HUFF_STAGES; i++)
+	{
+		to->stage_seconds[i] += from->stage_seconds[i];
+	}
+	to->blocks += from->blocks;
+	to->stored_blocks += from->stored_blocks;
+	to->run_blocks += from->run_blocks;
+	if (from->max_code_len > to->max_code_len)
+	{
+		to->max_code_len = from->max_code_len;
+	}
+}
 
-		/* Add the new node to the top of the list */
-		node->next = s->next;
+/* Fill in the totals of the statistics at the end of a call which      *
+ * started at `start', with `out_start' bytes already written to `out'. */
+static void _finish_stats(huffman_stats *st, double start, const f_stat *in,
+		const f_stat *out, uint64_t out_start)
+{
+	struct rusage usage;
 
-		/* Make the left/right nodes know who their parent node is */
-		node->left->parent = node->right->parent = node;
+	if (st == NULL)
+	{
+		return;
+	}
+	st->seconds      = _clock() - start;
+	st->in_bytes     = in->byte_count;
+	st->out_bytes    = out->byte_count - out_start;
+	st->buffer_bytes = in->buffer_size + out->buffer_size +
+		(in->wbuf != NULL ? in->wbuf_size : 0) +
+		(out->wbuf != NULL ? out->wbuf_size : 0);
+	if (getrusage(RUSAGE_SELF,&usage) == 0)
+	{
+		/* Kilobytes on Linux */
+		st->peak_memory = (uint64_t)usage.ru_maxrss * 1024;
+	}
+}
 
-		/* Give the nodes a binary code */
-		node->left->code  = false; /* 0 */
-		node->right->code = true;  /* 1 */
+/* Collect statistics for bytes in the input. The bytes are counted into *
+ * a flat histogram which is returned through `counts'.                 */
+HUFF_ERR _build_statistics(uint64_t counts[HUFF_SYMBOLS], f_stat *fp)
+{
+	assert(counts != NULL);
+	assert(fp != NULL);
 
-		/* Calculate the weight of the new node */
-		node->weight = node->left->weight + node->right->weight;
+	const void *chunk;
+	size_t len;
 
-		/* re-sort the linked list so the two least likely nodes are
- 		 *  at the head */
-		rc = _sort_symbol_list(&s,node);
-		if (rc != HUFF_SUCCESS)
+	memset(counts,0,HUFF_SYMBOLS*sizeof(counts[0]));
+	while ((len = fview_stat(&chunk,STAT_CHUNK_SIZE,fp)) > 0)
+	{
+		if (len > STAT_CHUNK_SIZE)
 		{
-			return rc;
+			/* fview_stat returned an error code */
+			return HUFF_FAILURE;
 		}
+		huffman_histogram(counts,chunk,len);
 	}
 
-	/* Return an array of pointers to leaf nodes */
-	return rc;
+	return HUFF_SUCCESS;
 }
 
-/* Based on the leaves in the huffman encoding tree, return a linked list *
- * of codes by reference in the 'codes' parameter, comprising of the 	  *
- * symbol and the binary huffman encoding of the symbol.                  */
-HUFF_ERR _get_codes(Code **codes, Symbol **leaves)
+/* Collect statistics for the bytes of `percent' of the input, counting *
+ * pieces spread evenly across it, and give every symbol not seen a     *
+ * minimum weight so that the code covers the rest of the input. Input  *
+ * which is not all in memory, or too short for SAMPLE_MIN_PIECES       *
+ * pieces, has every byte counted. The number of bytes counted is       *
+ * returned through `counted'.                                          */
+HUFF_ERR _sample_statistics(uint64_t counts[HUFF_SYMBOLS], f_stat *fp,
+		unsigned int percent, uint64_t *counted)
 {
-	assert(leaves != NULL);
-
-	Code*c, *c_prev;
-	Symbol *s;
-	Bits   *b;
-	int n = 0;
+	assert(counts != NULL);
+	assert(fp != NULL);
+	assert(counted != NULL);
 
-	*codes = c = c_prev = NULL;
+	const uint8_t *data;
+	size_t size, stride, offset, piece;
+	unsigned int i;
+	HUFF_ERR rc;
 
-	assert(leaves[n] != NULL);
-	while (leaves[n] != NULL )
+	stride = (size_t)SAMPLE_PIECE * 100 / (percent ? percent : 100);
+	if (percent == 0 || percent >= 100 || !fbuffered_stat(fp))
 	{
-		s = leaves[n];
-		assert(s != NULL);
+		rc = _build_statistics(counts,fp);
+		*counted = fp->byte_count;
+		return rc;
+	}
 
-		c = calloc(1,sizeof(Code));
-		if (c == NULL)
-		{
-			/* Out of memory */
-			perror("Unable to allocate memory");
-			return HUFF_NOMEM;
-		}
-		c->code = NULL;
-		c->length = 0;
-		c->symbol = s->symbol;
+	/* The whole input is viewed without reading it */
+	size = fview_stat((const void **)&data,SIZE_MAX,fp);
+	if (size > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	rewind_stat(fp);
+	if (size / stride < SAMPLE_MIN_PIECES)
+	{
+		rc = _build_statistics(counts,fp);
+		*counted = fp->byte_count;
+		return rc;
+	}
 
-		do 
-		{
-			b = calloc(1,sizeof(Bits));
-			if (b == NULL)
-			{
-				/* Out of memory */
-				perror("Unable to allocate memory");
-				return HUFF_NOMEM;
-			}
-			b->bit = s->code;
-			b->next = c->code;
-			c->code = b;
-			c->length++;
-			if (s->parent != NULL)
-			{
-				s = s->parent;
-			}
-		} while (s->parent != NULL);
+	memset(counts,0,HUFF_SYMBOLS*sizeof(counts[0]));
+	*counted = 0;
+	for (offset=0; offset<size; offset+=stride)
+	{
+		piece = (size - offset < SAMPLE_PIECE) ? size - offset :
+			SAMPLE_PIECE;
+		huffman_histogram(counts,data + offset,piece);
+		*counted += piece;
+	}
 
-		if (*codes == NULL)
-		{
-			*codes = c;
-		}
-		else
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (counts[i] < SAMPLE_MIN_WEIGHT)
 		{
-			c_prev->next = c;
+			counts[i] = SAMPLE_MIN_WEIGHT;
 		}
-
-		c_prev = c;
-		n++;
 	}
-	assert(*codes != NULL);
 
 	return HUFF_SUCCESS;
 }
 
-/* Returns by reference in the parameter 'code' the huffman code for 	*
- * the character 'c' from the 'code_book' linked list of huffman codes. */
-HUFF_ERR _get_char_code(Code **code, unsigned char c, Code *code_book)
+/* Fill in the code table, indexed by symbol, with the canonical code of *
+ * every symbol from the code lengths. Symbols without a code get a     *
+ * length of 0.                                                          */
+HUFF_ERR _get_codes(HuffCode table[HUFF_SYMBOLS],
+		const uint8_t lengths[HUFF_SYMBOLS])
 {
-	assert(code_book != NULL);
+	assert(table != NULL);
+	assert(lengths != NULL);
+
+	uint16_t canonical[HUFF_SYMBOLS];
+	unsigned int i;
+	HUFF_ERR rc;
+
+	rc = huffman_canonical_codes(canonical,lengths);
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
 
-	while (code_book != NULL && code_book->symbol != c)
+	for (i=0; i<HUFF_SYMBOLS; i++)
 	{
-		code_book = code_book->next;
+		table[i].code = canonical[i];
+		table[i].len  = lengths[i];
 	}
 
-	*code = code_book;
 	return HUFF_SUCCESS;
 }
 
-/* Return the bit value of the current bit defined in the buffer */
-bool _get_bit(Buffer *b)
+/* Code `n' symbols from `p' with the bit writer. Three codes of up to 15 *
+ * bits are added to the accumulator between each flush, and the output  *
+ * needs room for n*HUFF_MAX_CODE_LEN/8 bytes plus HUFF_BITS_SLACK.      */
+static inline void _encode_symbols(BitWriter *w, const HuffCode *table,
+		const uint8_t *p, size_t n)
 {
-	assert(b != NULL);
-	uint8_t i = 0x01;
-
-	/* Return the bit that the buffer is currently pointing to */
-	i <<= (CHAR_BIT*sizeof(b->buf) - b->len - 1);
-	i &=  b->buf;
-	i >>= (CHAR_BIT*sizeof(b->buf) - b->len - 1);
+	const uint8_t *end = p + n;
+	const HuffCode *c0, *c1, *c2;
 
-	return (i == 1) ? true : false; 
+	while (end - p >= 3)
+	{
+		c0 = &table[p[0]];
+		c1 = &table[p[1]];
+		c2 = &table[p[2]];
+		bw_put(w,c0->code,c0->len);
+		bw_put(w,c1->code,c1->len);
+		bw_put(w,c2->code,c2->len);
+		bw_flush(w);
+		p += 3;
+	}
+	while (p < end)
+	{
+		bw_put(w,table[*p].code,table[*p].len);
+		bw_flush(w);
+		p++;
+	}
 }
 
+/* Finish a coded stream with the footer, the last byte of data, which  *
+ * has a bit set to mark the last bit of data in the byte before it.    */
+static inline void _write_footer(BitWriter *w)
+{
+	unsigned int bits = bw_finish(w);
+
+	*w->ptr++ = (bits > 0) ? 0x01 << (CHAR_BIT - bits) : 0x01;
+}
 
-/* Read the file in again, using the codebook generated to output the compressed*
- * symbols 									*
- * Output passed by reference in parameter 'codes'. 				*/
-HUFF_ERR _compress_file(Code *codes, f_stat *in_fp, f_stat *out_fp) 
+/* Read the file in again, using the code table generated to output the    *
+ * compressed symbols, followed by the footer. Codes are collected in an   *
+ * output buffer which is written to the output stream when it fills up.  */
+HUFF_ERR _compress_file(const HuffCode *table, f_stat *in_fp, f_stat *out_fp,
+		huffman_stats *st)
 {
-	assert(codes != NULL);
+	assert(table != NULL);
 	assert(in_fp != NULL);
 	assert(out_fp != NULL);
 
-	Code *codes_start = codes;
-	Code *code;
+	const uint8_t *chunk;
+	uint8_t *buf;
+	size_t n, piece, used;
+	double t = _stage_start(st);
+	BitWriter w;
 
-	HUFF_ERR rc = HUFF_SUCCESS;
+	buf = malloc(ENCODE_BUF_SIZE + HUFF_BITS_SLACK);
+	if (buf == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+	bw_init(&w,buf);
 
 	rewind_stat(in_fp);
 
-	int c;
-	uint8_t buf = 0;
-	uint8_t footer = 0x01;
-	int bit_count = 0;
-
 	/* Read every byte in the file */
-	while ((c=fgetc_stat(in_fp)) != EOF)
+	while ((n = fview_stat((const void **)&chunk,STAT_CHUNK_SIZE,in_fp)) > 0)
 	{
-		rc = _get_char_code(&code,c,codes_start);
-		if (rc != HUFF_SUCCESS)
+		if (n > STAT_CHUNK_SIZE)
 		{
-			return rc;
+			/* fview_stat returned an error code */
+			free(buf);
+			return HUFF_FAILURE;
 		}
-
-		assert(code != NULL);
-		Bits *b = code->code;
-
-		while (b != NULL) 
+		while (n > 0)
 		{
-			/* CHAR_BIT - bit_count -1 as we want to shift by a  *
- 			 * maximum of 7 bits to the right and a minimum of 0 */
-			buf |= (b->bit << (CHAR_BIT - bit_count -1));
-			bit_count++;
-			if ( bit_count >= CHAR_BIT ) 
+			piece = (n < ENCODE_PIECE) ? n : ENCODE_PIECE;
+
+			/* Make sure the piece fits in the buffer */
+			used = w.ptr - buf;
+			if (used + piece*HUFF_MAX_CODE_LEN/8 + 1 > ENCODE_BUF_SIZE)
 			{
-				rc = fputc_stat(buf,out_fp);
-				buf = 0;
-				bit_count = 0;
+				_stage_end(st,HUFF_STAGE_CODE,&t);
+				if (fwrite_stat(buf,1,used,out_fp) != used)
+				{
+					free(buf);
+					return HUFF_WRITEFAIL;
+				}
+				_stage_end(st,HUFF_STAGE_WRITE,&t);
+				/* The pending bits stay in the accumulator */
+				w.ptr = buf;
 			}
-			b = b->next;
-		}
-
-		if (bit_count == CHAR_BIT)
-		{
-			rc = fputc_stat(buf,out_fp);
-			fflush_stat(out_fp);
-			buf = 0;
-			bit_count = 0;
-		}			
-	}
 
-	if (bit_count > 0)
-	{
-		fputc_stat(buf,out_fp);
-		/* The footer is the last byte of data, it has a bit set *
-                 * to indicate the last bit of data in the previous byte */
-		footer = 0x01 << (CHAR_BIT - bit_count);
+			_encode_symbols(&w,table,chunk,piece);
+			chunk += piece;
+			n     -= piece;
+		}
 	}
 
-	/* Write out the footer */
-	rc = fputc_stat(footer,out_fp);
-	if (rc != HUFF_SUCCESS)
-	{
-		return rc;
-	}
+	_write_footer(&w);
+	_stage_end(st,HUFF_STAGE_CODE,&t);
 
-	fflush_stat(out_fp);
-	if (rc != HUFF_SUCCESS)
+	used = w.ptr - buf;
+	n = fwrite_stat(buf,1,used,out_fp);
+	free(buf);
+	_stage_end(st,HUFF_STAGE_WRITE,&t);
+	if (n != used)
 	{
-		return rc;
+		return HUFF_WRITEFAIL;
 	}
 
-	/* Make sure that codes is pointing at the first in the linked list */
-	codes = codes_start;
-
-	return rc;
+	return HUFF_SUCCESS;
 }
 
-HUFF_ERR _encode_node(Symbol *s, f_stat *fp, Buffer *b) {
-
-	size_t bufsize = CHAR_BIT*sizeof(b->buf);
+/* Pack the code length of every symbol into `buf', returning the number *
+ * of bytes used. Lengths fit in a nibble and are packed two to a byte,  *
+ * either for every symbol in the range from the first to the last      *
+ * symbol with a code (dense), or as a list of the symbols with a code  *
+ * followed by their lengths (sparse), which ever is smaller. The       *
+ * canonical codes are rebuilt from the lengths by the decoder.         */
+size_t _pack_lengths(uint8_t buf[LENGTHS_MAX_SIZE],
+		const uint8_t lengths[HUFF_SYMBOLS])
+{
+	assert(buf != NULL);
+	assert(lengths != NULL);
 
-	HUFF_ERR rc = HUFF_SUCCESS;
+	uint8_t symbols[HUFF_SYMBOLS];
+	unsigned int first = HUFF_SYMBOLS, last = 0, k = 0, i, size;
 
-	/* We write out the symbol marker followed by the symbol*/
-	if (s->left == NULL || s->right == NULL) 
+	for (i=0; i<HUFF_SYMBOLS; i++)
 	{
-		/* Write out bit=1 */
-		b->buf |= (1 << (bufsize - b->len - 1));
-		b->len++;
-		if (b->len == bufsize) 
+		if (lengths[i] != 0)
 		{
-			fputc_stat(b->buf,fp);
-			b->buf = 0;
-			b->len = 0;
+			if (first == HUFF_SYMBOLS)
+			{
+				first = i;
+			}
+			last = i;
+			symbols[k++] = i;
 		}
-		/* Write out symbol */
-		if (b->len == 0) 
-		{
-			b->buf = s->symbol;
-			fputc_stat(b->buf,fp);
-			b->buf = 0;
-			b->len = 0;
-		} 
-		else 
-		{
-			b->buf |= ( s->symbol >> b->len);
-			fputc_stat(b->buf,fp);
-			/*Note we've not reset the b->len variable! We 	*
- 			 * still want the value.			*/
-			b->buf = 0; 
+	}
 
-			b->buf |= ( s->symbol << (bufsize - b->len) );
-			b->len = b->len;
+	memset(buf,0,LENGTHS_MAX_SIZE);
+	if (k < HUFF_SYMBOLS && 2+k+(k+1)/2 < 3+(last-first+2)/2)
+	{
+		buf[0] = LENGTHS_SPARSE;
+		buf[1] = k;
+		memcpy(buf+2,symbols,k);
+		for (i=0; i<k; i++)
+		{
+			buf[2+k+i/2] |= lengths[symbols[i]] << ((i & 1) ? 4 : 0);
 		}
-	} else {
-	/* We write out the branch marker, bit = 0 */
-		b->buf |= (0 << (bufsize - b->len - 1));
-		b->len++;
-		if (b->len == bufsize) {
-			fputc_stat(b->buf,fp);
-			b->buf = 0;
-			b->len = 0;
+		size = 2+k+(k+1)/2;
+	}
+	else
+	{
+		buf[0] = LENGTHS_DENSE;
+		buf[1] = first;
+		buf[2] = last;
+		for (i=first; i<=last; i++)
+		{
+			buf[3+(i-first)/2] |= lengths[i] << (((i-first) & 1) ? 4 : 0);
 		}
-		/* Go down both branches */
-		_encode_node(s->left, fp, b);
-		_encode_node(s->right,fp, b);
+		size = 3+(last-first+2)/2;
 	}
 
-	return rc;
+	return size;
 }
 
-/* Write the Huffman tree as a series of bits */
-HUFF_ERR _write_tree(Symbol *s, f_stat *fp) {
-	assert(s != NULL);
+/* Write the code lengths packed by _pack_lengths */
+HUFF_ERR _write_lengths(const uint8_t lengths[HUFF_SYMBOLS], f_stat *fp) {
+	assert(lengths != NULL);
 	assert(fp != NULL);
 
-	Buffer b;
-	int rc = 0;
-
-	b.buf = 0;
-	b.len = 0;
+	uint8_t buf[LENGTHS_MAX_SIZE];
+	size_t size;
 
-	rc = _encode_node(s,fp,&b);
-	if (rc != HUFF_SUCCESS)
+	size = _pack_lengths(buf,lengths);
+	if (fwrite_stat(buf,1,size,fp) != size)
 	{
-		return rc;
-	}
-
-	/* Ensure that we clear any trailing bits in the buffer */
-	if (b.len != 0) {
-		rc = fputc_stat(b.buf,fp);
+		return HUFF_WRITEFAIL;
 	}
-	return rc;
+	return HUFF_SUCCESS;
 }
 
 /* Write out the 'magic number' in the first 4 bytes so we can identify the *
  * compressed file has having been written by this program.                 */
 HUFF_ERR _write_header(f_stat *fp) {
 	assert(fp != NULL);
-	const char buf[] = "HUFF";
-	if (fwrite_stat(buf,4,sizeof(char),fp) <= 0)
+	const char buf[] = HUFF_MAGIC;
+	if (fwrite_stat(buf,4,sizeof(char),fp) != sizeof(char))
 	{
 		return HUFF_WRITEFAIL;
 	}
 	return HUFF_SUCCESS;
 }
 
-/* Check that this is file has the correct 'magic number' in the header	*
- * so that we identify it as a file compressed by the huffman encoder.  *
- * Returns HUFF_SUCCESS if the header exists, and HUFF_INVALIDHEADER if *
- * the header is missing. 						*/
-HUFF_ERR _check_header(FILE *fp)
+/* Fill in a block header for a block of type `type' */
+static void _pack_block_header(uint8_t h[HUFB_BLOCK_HEADER_SIZE], int type,
+		size_t raw_len, size_t comp_len)
 {
-	assert(fp != NULL);
-
-	char *c = calloc(5,sizeof(char));
-	if (c == NULL)
-	{
-		/* Out of memory */
-		perror("Unable to allocate memory");
-		return HUFF_NOMEM;
-	}
-	assert(c != NULL);
-	
-	/* Define the expected header */
-	const char header[] = "HUFF";
-	fread(c,4,sizeof(char),fp);
-	c[4] = '\0';
+	h[0] = type;
+	h[1] = 0;
+	huff_put_u16(h+2,0);
+	huff_put_u32(h+4,raw_len);
+	huff_put_u32(h+8,comp_len);
+}
 
-	int rc =  strcmp(c,header);
-	free(c);
+/* Write a block header for a block of type `type' */
+HUFF_ERR _write_block_header(f_stat *fp, int type, size_t raw_len,
+		size_t comp_len)
+{
+	uint8_t h[HUFB_BLOCK_HEADER_SIZE];
 
-	if (rc != HUFF_SUCCESS)
+	_pack_block_header(h,type,raw_len,comp_len);
+	if (fwrite_stat(h,1,sizeof(h),fp) != sizeof(h))
 	{
-		rc = HUFF_INVALIDHEADER;
+		return HUFF_WRITEFAIL;
 	}
+	return HUFF_SUCCESS;
+}
 
-	return rc;
+/* Fill in the file header of a block stream with the flags `flags' */
+static void _pack_file_header(uint8_t h[HUFB_HEADER_SIZE], size_t block_size,
+		uint8_t flags)
+{
+	memcpy(h,HUFB_MAGIC,4);
+	h[4] = HUFB_VERSION;
+	h[5] = flags;
+	huff_put_u16(h+6,0);
+	huff_put_u32(h+8,block_size);
 }
 
-/* Free memory in a symbol tree */
-void _free_tree(Symbol *t)
+/* Write the file header of a block stream with the flags `flags' */
+HUFF_ERR _write_file_header(f_stat *out, size_t block_size, uint8_t flags)
 {
-	assert(t != NULL);
+	uint8_t h[HUFB_HEADER_SIZE];
 
-	if (t->left != NULL) {
-		_free_tree(t->left);
-	}
-	if (t->right != NULL) {
-		_free_tree(t->right);
+	_pack_file_header(h,block_size,flags);
+	if (fwrite_stat(h,1,sizeof(h),out) != sizeof(h))
+	{
+		return HUFF_WRITEFAIL;
 	}
-
-	free(t);
+	return HUFF_SUCCESS;
 }
 
-/* Free Node structure memory */
-void _free_node(Node *n)
+/* Check that this is file has the correct 'magic number' in the header	*
+ * so that we identify it as a file compressed by the huffman encoder.  *
+ * Returns HUFF_SUCCESS if the header exists, and HUFF_INVALIDHEADER if *
+ * the header is missing. The layout that the magic number identifies   *
+ * is returned through `format'.					*/
+HUFF_ERR _check_header(enum huff_format *format, f_stat *fp)
 {
-	assert(n != NULL);
+	assert(format != NULL);
+	assert(fp != NULL);
+
+	char c[5];
 
-	if (n->left != NULL)
+	if (fread_stat(c,sizeof(char),4,fp) != 4)
 	{
-		_free_node(n->left);
+		return HUFF_INVALIDHEADER;
 	}
-	if (n->right != NULL)
+	c[4] = '\0';
+
+	if (strcmp(c,HUFF_MAGIC) == 0)
+	{
+		*format = FORMAT_STREAM;
+	}
+	else if (strcmp(c,HUFB_MAGIC) == 0)
+	{
+		*format = FORMAT_BLOCKS;
+	}
+	else if (strcmp(c,HUFC_MAGIC) == 0)
+	{
+		*format = FORMAT_CODEBOOK;
+	}
+	else if (strcmp(c,HUFA_MAGIC) == 0)
 	{
-		_free_node(n->right);
+		*format = FORMAT_ADAPTIVE;
 	}
-	free(n);
+	else
+	{
+		return HUFF_INVALIDHEADER;
+	}
+
+	return HUFF_SUCCESS;
 }
 
-/* Given the huffman tree, decompress the file to the output */
-HUFF_ERR _output_message(Node *n, FILE *input, FILE *output)
+/* Parse the code lengths packed by _pack_lengths from the start of the *
+ * `size' bytes at `data', returning the number of bytes they take up   *
+ * through `used'.                                                       */
+HUFF_ERR _parse_lengths(uint8_t lengths[HUFF_SYMBOLS], const uint8_t *data,
+		size_t size, size_t *used)
 {
-	/* Define assumptions with assert */
-	assert(n != NULL);
-	assert(input != NULL);
-	assert(output != NULL);
+	assert(lengths != NULL);
+	assert(used != NULL);
 
-	Buffer b;
-	uint8_t last;
-	uint8_t next;
-	HUFF_ERR rc = HUFF_SUCCESS;
-	
-	Node *top = n;
+	unsigned int first, last, k, i;
 
-	fread(&b.buf,1,1,input);
-	fread(&next,1,1,input);
+	memset(lengths,0,HUFF_SYMBOLS);
+	if (size < 2)
+	{
+		return HUFF_CORRUPT;
+	}
 
-	while (fread(&last,1,1,input))
+	if (data[0] == LENGTHS_SPARSE)
 	{
-		b.len = 0;
-		rc = _output_byte(&n,&b,n,top,CHAR_BIT*sizeof(b.buf),output);
-		if (rc != HUFF_SUCCESS)
+		k = data[1];
+		if (size - 2 < k+(k+1)/2)
 		{
-			return rc;
+			return HUFF_CORRUPT;
 		}
-		b.buf = next;
-		next  = last;
-	}
-
-	/* print out the data in the last but one byte using the last byte  *
-         * footer data.							    */
-	b.len = 0;
-	int stop = 1;
-	while ( (next <<= 1) > 0 )
-	{ 
-		stop++;
+		for (i=0; i<k; i++)
+		{
+			lengths[data[2+i]] =
+				(data[2+k+i/2] >> ((i & 1) ? 4 : 0)) & 0x0f;
+		}
+		*used = 2+k+(k+1)/2;
 	}
-
-	/* The stopping bit _cannot be longer than the number of bits in a *
- 	 * a char.							   */
-	assert(stop <= CHAR_BIT);
-
-	rc = _output_byte(&n,&b,n,top,stop,output);
-
-	/* make sure n is back at the top of the tree */
-	n = top;
-	return rc;
-}
-
-/* Output byte in buffer */
-HUFF_ERR  _output_byte(Node **ret_node,Buffer *b, Node *n, Node *top, int stop, FILE *output)
-{
-        bool bit;
-
-        while (b->len < stop)
+	else if (data[0] == LENGTHS_DENSE)
 	{
-                bit = _get_bit(b);
-		if (n->right == NULL && n->left == NULL)
+		if (size < 3 || data[2] < data[1])
 		{
-			fwrite(&n->value,1,sizeof(n->value),output);
-			n=top;
-		} 
-		else
+			return HUFF_CORRUPT;
+		}
+		first = data[1];
+		last  = data[2];
+		if (size - 3 < (last-first+2)/2)
 		{
-                	n = (bit == false) ? n->left : n->right;
-			assert(n != NULL);
-
-                	if (n->right == NULL && n->left == NULL)
-			{
-                        	fwrite(&n->value,1,sizeof(n->value),output);
-                        	n=top;
-                	}
+			return HUFF_CORRUPT;
+		}
+		for (i=first; i<=last; i++)
+		{
+			lengths[i] = (data[3+(i-first)/2] >>
+				(((i-first) & 1) ? 4 : 0)) & 0x0f;
 		}
-                b->len++;
-        }
-	*ret_node = n;
-        return HUFF_SUCCESS;
+		*used = 3+(last-first+2)/2;
+	}
+	else
+	{
+		return HUFF_CORRUPT;
+	}
+
+	return HUFF_SUCCESS;
 }
 
-/* Return entire character from file, starting at current buffer location*/
-HUFF_ERR _get_val(uint8_t *c,Buffer *b, FILE *fp)
+/* Fill in the decode table from the code lengths. Codes of up to     *
+ * DECODE_BITS bits fill every first level entry whose index starts    *
+ * with the code, longer codes are spread in the same way over a second *
+ * level table reached through the entry for their first DECODE_BITS   *
+ * bits. All second level tables are indexed by the same number of     *
+ * bits, enough for the longest code.                                   */
+HUFF_ERR _get_decode_table(DecodeEntry table[DECODE_TABLE_SIZE],
+		const uint8_t lengths[HUFF_SYMBOLS])
 {
-	assert(b != NULL);
-	assert(fp != NULL);
+	assert(table != NULL);
+	assert(lengths != NULL);
 
-	*c = 0;
+	uint16_t codes[HUFF_SYMBOLS];
+	unsigned int i, j, len, max_len = 0, sub_bits, first, count;
+	unsigned int next = 1 << DECODE_BITS;
+	DecodeEntry e, *link;
+	HUFF_ERR rc;
 
-	*c |= (b->buf << b->len );
-	/* get the next byte */
-	fread(&b->buf,1,sizeof(b->buf),fp);
+	rc = huffman_canonical_codes(codes,lengths);
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
 
-	*c |= (b->buf >> (CHAR_BIT*sizeof(b->buf) - b->len));
-	/* note that b->len remains the same as we've moved a whole byte over */
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (lengths[i] > max_len)
+		{
+			max_len = lengths[i];
+		}
+	}
+	sub_bits = (max_len > DECODE_BITS) ? max_len - DECODE_BITS : 0;
+
+	memset(table,0,(1 << DECODE_BITS)*sizeof(DecodeEntry));
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		len = lengths[i];
+		if (len == 0)
+		{
+			continue;
+		}
+		e.symbol = i;
+		e.len    = len;
+		e.sub    = 0;
+
+		if (len <= DECODE_BITS)
+		{
+			first = codes[i] << (DECODE_BITS - len);
+			count = 1 << (DECODE_BITS - len);
+			for (j=0; j<count; j++)
+			{
+				table[first+j] = e;
+			}
+			continue;
+		}
+
+		link = &table[codes[i] >> (len - DECODE_BITS)];
+		if (link->sub == 0)
+		{
+			link->sub = next;
+			link->len = sub_bits;
+			memset(&table[next],0,(1 << sub_bits)*sizeof(DecodeEntry));
+			next += 1 << sub_bits;
+		}
+		first = (codes[i] & ((1 << (len - DECODE_BITS)) - 1))
+			<< (max_len - len);
+		count = 1 << (max_len - len);
+		for (j=0; j<count; j++)
+		{
+			table[link->sub+first+j] = e;
+		}
+	}
 
 	return HUFF_SUCCESS;
 }
 
-HUFF_ERR _get_node(Node **n, Buffer *b, FILE *fp)
+/* Look up the code at the top of the bit reader accumulator `acc' */
+static inline DecodeEntry _decode_entry(const DecodeEntry *table,
+		uint64_t acc)
 {
-	/* Assume no input in NULL */
-	assert(b != NULL);
-	assert(fp != NULL);
+	DecodeEntry e = table[acc >> (64 - DECODE_BITS)];
+
+	if (e.sub != 0)
+	{
+		e = table[e.sub + ((acc << DECODE_BITS) >> (64 - e.len))];
+	}
+	return e;
+}
+
+/* Returns true if three more codes can be decoded from bit `pos' with  *
+ * _decode3 into the room from `o' to `end', so that there are 8 bytes  *
+ * of the `size' to load and the codes end within the first `nbits'.    */
+static inline bool _can_decode3(size_t pos, size_t size, size_t nbits,
+		const uint8_t *o, const uint8_t *end)
+{
+	return end - o >= 3 && (pos >> 3) + 8 <= size &&
+		pos + 3*HUFF_MAX_CODE_LEN <= nbits;
+}
+
+/* Decode three codes of up to 15 bits from a single load of the bits   *
+ * at `data' from bit `*pos' into `out', and move `*pos' past them.     *
+ * Returns false on bits which are not a code.                          */
+static inline bool _decode3(const DecodeEntry *table, const uint8_t *data,
+		size_t *pos, uint8_t *out)
+{
+	uint64_t acc = br_peek(data,*pos);
+	DecodeEntry e0, e1, e2;
+
+	e0  = _decode_entry(table,acc);
+	acc <<= e0.len;
+	e1  = _decode_entry(table,acc);
+	acc <<= e1.len;
+	e2  = _decode_entry(table,acc);
+	if (e0.len == 0 || e1.len == 0 || e2.len == 0)
+	{
+		return false;
+	}
+	out[0] = e0.symbol;
+	out[1] = e1.symbol;
+	out[2] = e2.symbol;
+	*pos += e0.len + e1.len + e2.len;
+
+	return true;
+}
 
-	bool bit = _get_bit(b);
+/* Decode the codes in the first `nbits' bits of the `size' bytes at    *
+ * `data', starting from bit `*pos', into `out' until either `cap'      *
+ * symbols have been decoded or the next code would not end within the *
+ * `nbits'. The number of symbols decoded is returned through `n' and   *
+ * `*pos' is moved past their codes. Returns HUFF_CORRUPT on bits which *
+ * are not a code.                                                      */
+static HUFF_ERR _decode_symbols(const DecodeEntry *table,
+		const uint8_t *data, size_t size, size_t nbits, size_t *pos,
+		uint8_t *out, size_t cap, size_t *n)
+{
+	uint8_t *o = out, *end = out + cap;
+	size_t p = *pos;
+	DecodeEntry e0;
 	HUFF_ERR rc = HUFF_SUCCESS;
 
-	/* If we've not reached the end of the byte, iterate the length *
- 	 * counter, else get the next byte from the file		*/
-	if (b->len < (CHAR_BIT*sizeof(b->buf) - 1))
+	/* Three codes from every load while there are 8 bytes of input *
+	 * left to load.                                                 */
+	while (_can_decode3(p,size,nbits,o,end))
 	{
-		b->len++;
-	} 
-	else
+		if (!_decode3(table,data,&p,o))
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		o += 3;
+	}
+
+	/* One code at a time near the end of the input */
+	while (rc == HUFF_SUCCESS && o < end && p < nbits)
+	{
+		e0 = _decode_entry(table,br_peek_tail(data,size,p));
+		if (e0.len == 0)
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		if (p + e0.len > nbits)
+		{
+			/* Left for the caller to judge, the rest of the code *
+			 * may still be to come                                */
+			break;
+		}
+		*o++ = e0.symbol;
+		p += e0.len;
+	}
+
+	*pos = p;
+	*n   = o - out;
+	return rc;
+}
+
+/* Work out the number of coded bits in the `size' bytes at `data' from *
+ * the footer in the last byte, which has a single bit set to mark the  *
+ * last bit used in the byte before it.                                 */
+HUFF_ERR _stream_bits(size_t *nbits, const uint8_t *data, size_t size)
+{
+	assert(nbits != NULL);
+
+	uint8_t footer;
+	unsigned int stop = 1;
+
+	if (size == 0)
 	{
-		fread(&b->buf,1,1,fp);
-		b->len = 0;
+		/* Missing the footer */
+		return HUFF_CORRUPT;
 	}
-	
-	*n = calloc(1,sizeof(Node));
-	if (n == NULL)
+	footer = data[size-1];
+	if (footer == 0 || (footer & (footer - 1)) != 0)
 	{
-		/* Out of memory*/
-		return HUFF_NOMEM;
+		return HUFF_CORRUPT;
+	}
+	if (size == 1)
+	{
+		/* Only the footer, there was no input to compress */
+		*nbits = 0;
+		return HUFF_SUCCESS;
 	}
-	assert(n != NULL);
 
-	if (bit == true)
+	while ((uint8_t)(footer <<= 1) != 0)
 	{
+		stop++;
+	}
+	*nbits = (size - 2)*CHAR_BIT + stop;
 
-		rc = _get_val((uint8_t*) &((*n)->value),b,fp);
-		if (rc != HUFF_SUCCESS)
+	return HUFF_SUCCESS;
+}
+
+/* Number of bits the symbols counted in `counts' take with the codes of *
+ * `lengths'                                                             */
+static uint64_t _coded_bits(const uint64_t counts[HUFF_SYMBOLS],
+		const uint8_t lengths[HUFF_SYMBOLS])
+{
+	uint64_t bits = 0;
+	unsigned int i;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		bits += counts[i] * lengths[i];
+	}
+	return bits;
+}
+
+/* Returns the only symbol counted in `counts', or -1 if there are none *
+ * or more than one.                                                   */
+static int _single_symbol(const uint64_t counts[HUFF_SYMBOLS])
+{
+	int i, sym = -1;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (counts[i] != 0)
 		{
-			return rc;
+			if (sym >= 0)
+			{
+				return -1;
+			}
+			sym = i;
 		}
-		(*n)->left  = NULL;
-		(*n)->right = NULL;
 	}
-	else
+	return sym;
+}
+
+/* Size of `len' bytes of input written as a block stream of stored     *
+ * blocks, or of run blocks when `run' is set, headers included         */
+static inline uint64_t _stored_size(uint64_t len, bool run)
+{
+	uint64_t blocks = (len + HUFB_BLOCK_SIZE - 1)/HUFB_BLOCK_SIZE;
+
+	return HUFB_HEADER_SIZE + (run ? blocks : len) +
+		HUFB_BLOCK_HEADER_SIZE * (blocks + 1);
+}
+
+/* Write the `len' bytes at `data' as a block stream of stored blocks,  *
+ * or when `run' is set, of run blocks of the one byte they all hold    */
+static HUFF_ERR _store_stream(const uint8_t *data, size_t len, bool run,
+		f_stat *out, huffman_stats *st)
+{
+	double t = _stage_start(st);
+	size_t n, payload;
+	HUFF_ERR rc;
+
+	rc = _write_file_header(out,HUFB_BLOCK_SIZE,0);
+	while (rc == HUFF_SUCCESS && len > 0)
 	{
-		Node *left, *right;
-		rc  = _get_node(&left,b,fp);
-		if (rc != HUFF_SUCCESS)
+		n = (len < HUFB_BLOCK_SIZE) ? len : HUFB_BLOCK_SIZE;
+		payload = run ? 1 : n;
+		rc = _write_block_header(out,run ? HUFB_RUN : HUFB_STORED,n,
+				payload);
+		if (rc == HUFF_SUCCESS &&
+				fwrite_stat(data,1,payload,out) != payload)
 		{
-			free(left);
-			return rc;
+			rc = HUFF_WRITEFAIL;
 		}
-		rc  = _get_node(&right,b,fp);
-		if (rc != HUFF_SUCCESS)
+		if (st != NULL)
 		{
-			free(left);
-			free(right);
-			return rc;
-		}
-		if ( left == NULL || right == NULL) {
-			/* Error has occurred */
-			free(left);
-			free(right);
-			return HUFF_FAILURE;
+			st->blocks++;
+			st->stored_blocks += !run;
+			st->run_blocks    += run;
 		}
-
-		(*n)->value = 0;
-		(*n)->left  = left;
-		(*n)->right = right;
+		data += n;
+		len  -= n;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _write_block_header(out,HUFB_END,0,0);
 	}
+	_stage_end(st,HUFF_STAGE_WRITE,&t);
 	return rc;
 }
 
-HUFF_ERR get_tree(Node **n, FILE *fp)
+/* Write the `len' bytes at `data' as _store_stream does into the      *
+ * _stored_size(len,run) bytes at `out'                                 */
+static void _store_memory(const uint8_t *data, size_t len, bool run,
+		uint8_t *out)
 {
-	assert(fp != NULL);
+	size_t n, payload;
+
+	_pack_file_header(out,HUFB_BLOCK_SIZE,0);
+	out += HUFB_HEADER_SIZE;
+	while (len > 0)
+	{
+		n = (len < HUFB_BLOCK_SIZE) ? len : HUFB_BLOCK_SIZE;
+		payload = run ? 1 : n;
+		_pack_block_header(out,run ? HUFB_RUN : HUFB_STORED,n,payload);
+		memcpy(out + HUFB_BLOCK_HEADER_SIZE,data,payload);
+		out  += HUFB_BLOCK_HEADER_SIZE + payload;
+		data += n;
+		len  -= n;
+	}
+	_pack_block_header(out,HUFB_END,0,0);
+}
+
+/* Work out the code lengths and the code table for the symbol counts  *
+ * in `counts', with no code longer than `max_len' bits.               */
+HUFF_ERR _build_code(HuffCode table[HUFF_SYMBOLS],
+		uint8_t lengths[HUFF_SYMBOLS], const uint64_t counts[HUFF_SYMBOLS],
+		unsigned int max_len, huffman_stats *st)
+{
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	rc = huffman_code_lengths(lengths,counts,max_len);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _get_codes(table,lengths);
+	}
+	_note_lengths(st,lengths);
+	_stage_end(st,HUFF_STAGE_TREE,&t);
 
-	Buffer b;
-	b.buf = 0;
-	b.len = 0;
+#ifdef DEBUG
+	print_code_lengths(lengths);
+#endif /* DEBUG */
 
-	/* read in the first byte */
-	fread(&b.buf,1,1,fp);
-	/* get the node tree */
-	return _get_node(n,&b,fp);
+	return rc;
 }
 
+/* Huffman encodes everything in the input stream, writing the header   *
+ * and code lengths followed by the compressed symbols to the output     *
+ * stream. No code is longer than `max_len' bits. With a `sample'        *
+ * percentage the code is built from that much of the input. Input the  *
+ * code would not make smaller is written as stored blocks instead, and  *
+ * input of one byte repeated as run blocks if they are smaller.         */
+HUFF_ERR _huffman_stream(f_stat *in, f_stat *out, unsigned int max_len,
+		unsigned int sample, huffman_stats *st)
+{
+	uint64_t counts[HUFF_SYMBOLS];
+	uint8_t  lengths[HUFF_SYMBOLS];
+	HuffCode table[HUFF_SYMBOLS];
+	uint8_t  packed[LENGTHS_MAX_SIZE];
+	uint64_t counted, coded;
+	const uint8_t *data;
+	size_t len;
+	double t = _stage_start(st);
 
-/* Return the root node in a Symbol tree */
-HUFF_ERR _get_root(Symbol **tree, Symbol *t) {
-	assert(t != NULL);
+	int rc = HUFF_SUCCESS;
 
-	*tree = t;
-	while ((*tree)->parent != NULL) 
-	{ 
-		*tree=(*tree)->parent; 
+	/* Collect statistics for the 8bit characters in the file */
+	rc = _sample_statistics(counts,in,sample,&counted);
+	_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+	if (st != NULL)
+	{
+		st->counted_bytes = counted;
 	}
-	return HUFF_SUCCESS;
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+	rc = _build_code(table,lengths,counts,max_len,st);
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+
+	/* The statistics have read all of the input into memory */
+	rewind_stat(in);
+	len = fview_stat((const void **)&data,SIZE_MAX,in);
+	if (len > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	rewind_stat(in);
+	coded = _coded_bits(counts,lengths);
+	if (counted != 0 && counted < len)
+	{
+		coded = (double)coded * len / counted;
+	}
+	coded = HUFF_HEADER_SIZE + _pack_lengths(packed,lengths) + coded/8 + 1;
+	if (_single_symbol(counts) >= 0 && _stored_size(len,true) < coded)
+	{
+		return _store_stream(data,len,true,out,st);
+	}
+	if (_stored_size(len,false) < coded)
+	{
+		return _store_stream(data,len,false,out,st);
+	}
+
+	if (_write_header(out) != HUFF_SUCCESS)
+	{
+		return HUFF_WRITEFAIL;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		t = _stage_start(st);
+		rc = _write_lengths(lengths,out);
+		_stage_end(st,HUFF_STAGE_HEADER,&t);
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _compress_file(table,in,out,st);
+	}
+
+	return rc;
 }
 
 /* Performs huffman encoding on an input file stream, and outputs the  *
  * compressed file to the output file stream                           */
 HUFF_ERR huffman(f_stat *in, f_stat *out)
 {
-	Symbol *tree;
-	Symbol **leaves;
-	Code   *codes, *c;
-	Bits   *bits,  *b;
-
 	int rc = HUFF_SUCCESS;
-	int ecode = 0;
 
 	/* Validate the inputs */
 	if (in == NULL || out == NULL)
@@ -780,113 +1192,3640 @@ HUFF_ERR huffman(f_stat *in, f_stat *out)
 		return HUFF_INVALIDARG;
 	}
 
-	/* Collect statistics for the 8bit characters in the file */
-	rc = _build_statistics(&tree,in);
-	if (rc != HUFF_SUCCESS)
+	if (_huffman_stream(in,out,HUFF_MAX_CODE_LEN,0,NULL) != HUFF_SUCCESS)
 	{
-		return rc;
+		rc = HUFF_FAILURE;
+	}
+
+	/* Write out anything left in the output buffer */
+	if (fflush_stat(out) != 0)
+	{
+		rc = HUFF_FAILURE;
+	}
+
+	return rc;
+}
+
+/* Code the `len' bytes at `p', followed by the footer, into the memory *
+ * from `*out' to `end' and move `*out' past them. Pieces are coded     *
+ * straight into the output while it has room for their longest codes  *
+ * and the bit writer slack, and through a small buffer near its end.  *
+ * Returns HUFF_NOSPACE if the output is too small.                     */
+static HUFF_ERR _compress_memory(const HuffCode *table, const uint8_t *p,
+		size_t len, uint8_t **out, uint8_t *end)
+{
+	uint8_t buf[ENCODE_PIECE*HUFF_MAX_CODE_LEN/8 + 2 + HUFF_BITS_SLACK];
+	uint8_t *o;
+	size_t piece, used;
+	BitWriter w;
+
+	bw_init(&w,*out);
+	while (len > 0)
+	{
+		piece = (len < ENCODE_PIECE) ? len : ENCODE_PIECE;
+		if ((size_t)(end - w.ptr) >=
+				piece*HUFF_MAX_CODE_LEN/8 + 1 + HUFF_BITS_SLACK)
+		{
+			_encode_symbols(&w,table,p,piece);
+		}
+		else
+		{
+			/* The pending bits stay in the accumulator */
+			o = w.ptr;
+			w.ptr = buf;
+			_encode_symbols(&w,table,p,piece);
+			used = w.ptr - buf;
+			if (used > (size_t)(end - o))
+			{
+				return HUFF_NOSPACE;
+			}
+			memcpy(o,buf,used);
+			w.ptr = o + used;
+		}
+		p   += piece;
+		len -= piece;
+	}
+
+	o = w.ptr;
+	w.ptr = buf;
+	_write_footer(&w);
+	used = w.ptr - buf;
+	if (used > (size_t)(end - o))
+	{
+		return HUFF_NOSPACE;
+	}
+	memcpy(o,buf,used);
+	*out = o + used;
+
+	return HUFF_SUCCESS;
+}
+
+/* Copy the `len' bytes at `data' as a stored block into the scratch  *
+ * memory at `work', header included, returning the size of the block *
+ * through `size'.                                                      */
+static HUFF_ERR _encode_stored(const uint8_t *data, size_t len,
+		uint8_t *work, size_t *size, huffman_stats *st)
+{
+	double t = _stage_start(st);
+
+	memcpy(work + HUFB_BLOCK_HEADER_SIZE,data,len);
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+
+	*size = HUFB_BLOCK_HEADER_SIZE + len;
+	_pack_block_header(work,HUFB_STORED,len,len);
+	if (st != NULL)
+	{
+		st->stored_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Returns true if a payload of `header' bytes and `bits' coded bits,   *
+ * and at least a byte more for the footer or padding, is no smaller    *
+ * than the `len' bytes it codes.                                       */
+static inline bool _not_smaller(size_t header, uint64_t bits, size_t len)
+{
+	return header + bits/8 + 1 >= len;
+}
+
+/* Code the `len' bytes at `data', counted in `counts', with the code   *
+ * `table' of `lengths' as a single stream block into the scratch       *
+ * memory at `work', header included, returning the size of the block   *
+ * through `size'. A block the code would not make smaller is stored.   */
+static HUFF_ERR _encode_coded1(const uint8_t *data, size_t len,
+		uint8_t *work, size_t *size, const uint64_t counts[HUFF_SYMBOLS],
+		const HuffCode *table, const uint8_t lengths[HUFF_SYMBOLS],
+		huffman_stats *st)
+{
+	uint8_t *o = work + HUFB_BLOCK_HEADER_SIZE;
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	o += _pack_lengths(o,lengths);
+	_stage_end(st,HUFF_STAGE_HEADER,&t);
+	if (_not_smaller(o - work - HUFB_BLOCK_HEADER_SIZE,
+			_coded_bits(counts,lengths),len))
+	{
+		return _encode_stored(data,len,work,size,st);
 	}
-	rc = _build_tree(&leaves,tree);
+
+	rc = _compress_memory(table,data,len,&o,work + BLOCK_CODE_SIZE(len));
+	_stage_end(st,HUFF_STAGE_CODE,&t);
 	if (rc != HUFF_SUCCESS)
 	{
-		/* Free the tree */
-		_free_tree(tree);
-		free(leaves);
 		return rc;
 	}
 
-	rc = _get_codes(&codes,leaves);
-	if (codes == NULL || rc != HUFF_SUCCESS)
+	*size = o - work;
+	_pack_block_header(work,HUFB_HUFFMAN,len,*size - HUFB_BLOCK_HEADER_SIZE);
+	return HUFF_SUCCESS;
+}
+
+/* Compress the `len' bytes at `data' as a single stream block into the *
+ * scratch memory at `work', header included, returning the size of the *
+ * block through `size'.                                                */
+HUFF_ERR _encode_block1(const uint8_t *data, size_t len, uint8_t *work,
+		size_t *size, unsigned int max_len, huffman_stats *st)
+{
+	assert(data != NULL);
+	assert(work != NULL);
+
+	uint64_t counts[HUFF_SYMBOLS];
+	uint8_t  lengths[HUFF_SYMBOLS];
+	HuffCode table[HUFF_SYMBOLS];
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	memset(counts,0,sizeof(counts));
+	huffman_histogram(counts,data,len);
+	_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+	rc = _build_code(table,lengths,counts,max_len,st);
+	if (rc != HUFF_SUCCESS)
 	{
-		/* Free tree */
-		_free_tree(tree);
-		/* Free leaves */
-		free(leaves);
-		/* Return failure */
-		rc = HUFF_FAILURE;
 		return rc;
 	}
 
-#ifdef DEBUG
-	print_codes_from_tree(leaves);
-#endif /* DEBUG */
-
-	/* Assure that we're is pointing at the top of the tree */
-	Symbol *tmp = NULL;
-	rc = _get_root(&tmp,tree);
-	assert(tmp != NULL);
-	tree = tmp;
+	return _encode_coded1(data,len,work,size,counts,table,lengths,st);
+}
 
-	ecode = _write_header(out);
-	if (ecode != HUFF_SUCCESS)
+/* Compress the `len' bytes at `data' as a block of four bitstreams which *
+ * share one code, each coding a quarter of the block, so that they can   *
+ * be decoded side by side. The streams are coded one after another into  *
+ * the scratch memory at `work' and the sizes of the first three follow   *
+ * the block header. The size of the block is returned through `size',   *
+ * and a block the code would not make smaller is stored.                 */
+HUFF_ERR _encode_block4(const uint8_t *data, size_t len, uint8_t *work,
+		size_t *size, unsigned int max_len, huffman_stats *st)
+{
+	assert(data != NULL);
+	assert(work != NULL);
+
+	uint64_t counts[HUFF_SYMBOLS];
+	uint8_t  lengths[HUFF_SYMBOLS];
+	HuffCode table[HUFF_SYMBOLS];
+	uint8_t *sizes = work + HUFB_BLOCK_HEADER_SIZE;
+	size_t   seg = (len + HUFB_STREAMS - 1)/HUFB_STREAMS;
+	size_t   first, last, k;
+	uint8_t *start;
+	double t = _stage_start(st);
+	BitWriter w;
+	HUFF_ERR rc;
+
+	memset(counts,0,sizeof(counts));
+	huffman_histogram(counts,data,len);
+	_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+	rc = _build_code(table,lengths,counts,max_len,st);
+	if (rc != HUFF_SUCCESS)
 	{
-		rc = HUFF_FAILURE;
+		return rc;
 	}
 
-	ecode = _write_tree(tree,out);
-	if (ecode != 0)
+	t = _stage_start(st);
+	w.ptr = sizes + HUFB_STREAMS_HEADER_SIZE;
+	w.ptr += _pack_lengths(w.ptr,lengths);
+	_stage_end(st,HUFF_STAGE_HEADER,&t);
+	if (_not_smaller(w.ptr - sizes,_coded_bits(counts,lengths),len))
 	{
-		rc = HUFF_FAILURE;
+		return _encode_stored(data,len,work,size,st);
 	}
-	
-	if (_compress_file(codes,in,out) != HUFF_SUCCESS)
+
+	/* Each stream starts on the byte after the last one ends */
+	for (k=0; k<HUFB_STREAMS; k++)
 	{
-		rc = HUFF_FAILURE;
+		first = (k*seg < len) ? k*seg : len;
+		last  = (first + seg < len) ? first + seg : len;
+		start = w.ptr;
+		bw_init(&w,start);
+		_encode_symbols(&w,table,data+first,last-first);
+		bw_finish(&w);
+		if (k < HUFB_STREAMS-1)
+		{
+			huff_put_u32(sizes+4*k,w.ptr - start);
+		}
 	}
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+
+	*size = w.ptr - work;
+	_pack_block_header(work,HUFB_HUFFMAN4,len,
+			*size - HUFB_BLOCK_HEADER_SIZE);
+	return HUFF_SUCCESS;
+}
 
-	/* Start freeing allocated memory */
-	rc = _get_root(&tmp,tree);
-	tree = tmp;
-	_free_tree(tree);
-	free(leaves);
+/* Work out the code lengths of each code of the context model from    *
+ * the counts of the contexts given it, skipping codes with none.       */
+static HUFF_ERR _context_lengths(ContextModel *m, unsigned int max_len)
+{
+	unsigned int c, k, s;
+	HUFF_ERR rc = HUFF_SUCCESS;
 
-	while(codes != NULL)
+	memset(m->code_counts,0,sizeof(m->code_counts));
+	for (c=0; c<HUFF_SYMBOLS; c++)
 	{
-		c = codes;
-		codes = codes->next;
-		/* Free the individually malloc'd `bits' */
-		bits = c->code;
-		while (bits != NULL)
+		for (s=0; s<HUFF_SYMBOLS; s++)
 		{
-			b = bits;
-			bits = bits->next;
-			free(b);
+			m->code_counts[m->map[c]][s] += m->counts[c][s];
 		}
-		free(c);
 	}
-	/* End freeing of allocated memory */
-	
+	memset(m->lengths,0,sizeof(m->lengths));
+	for (k=0; k<m->codes && rc == HUFF_SUCCESS; k++)
+	{
+		rc = huffman_code_lengths(m->lengths[k],m->code_counts[k],
+				max_len);
+	}
 	return rc;
 }
 
-/* Perform a decompression on the huffman encoded `in' file. */
-HUFF_ERR unhuffman(f_stat *in, f_stat *out)
+/* Bits taken by the codes of the contexts `c' with the code `k' of the *
+ * model, a symbol without a code costing one bit more than the longest *
+ * code could.                                                          */
+static uint64_t _context_cost(const ContextModel *m, unsigned int c,
+		unsigned int k)
 {
-	Node *n;
-	HUFF_ERR rc = HUFF_SUCCESS;
+	uint64_t bits = 0;
+	unsigned int s, len;
 
-	/* Validate the inputs are not null */
-	if (in == NULL || out == NULL)
+	for (s=0; s<HUFF_SYMBOLS; s++)
 	{
-		return HUFF_INVALIDARG;
+		if (m->counts[c][s] != 0)
+		{
+			len = m->lengths[k][s];
+			bits += (uint64_t)m->counts[c][s] *
+				(len ? len : HUFF_MAX_CODE_LEN + 1);
+		}
 	}
+	return bits;
+}
 
-	/* Validate that the input file was encoded by this huffman encoder */
-	if (_check_header(in->file) != 0)
+/* Group the contexts of the model, which has its counts, into at most  *
+ * HUFB_CONTEXT_CODES codes. The most frequent contexts start a code of *
+ * their own, then each context is moved to the code which codes it in  *
+ * the fewest bits and the codes are rebuilt, until none move. Codes    *
+ * left without a context are dropped and the rest numbered in order.   */
+static HUFF_ERR _cluster_contexts(ContextModel *m, unsigned int max_len)
+{
+	uint64_t total[HUFF_SYMBOLS], bits, best_bits;
+	uint8_t renumber[HUFB_CONTEXT_CODES];
+	bool seeded[HUFF_SYMBOLS] = { false }, moved = true;
+	unsigned int c, k, s, best, round;
+	HUFF_ERR rc;
+
+	for (c=0; c<HUFF_SYMBOLS; c++)
 	{
-		fprintf(stderr,"File not encoded by huffman\n");
-		return HUFF_FAILURE;
+		total[c] = 0;
+		for (s=0; s<HUFF_SYMBOLS; s++)
+		{
+			total[c] += m->counts[c][s];
+		}
 	}
 
-	rc = get_tree(&n,in->file);
-	if (rc == HUFF_SUCCESS)
+	/* Every context starts with code 0 and the most frequent move to *
+	 * codes of their own                                             */
+	memset(m->map,0,sizeof(m->map));
+	for (m->codes=0; m->codes<HUFB_CONTEXT_CODES; m->codes++)
+	{
+		best = HUFF_SYMBOLS;
+		for (c=0; c<HUFF_SYMBOLS; c++)
+		{
+			if (!seeded[c] && total[c] > 0 &&
+				(best == HUFF_SYMBOLS || total[c] > total[best]))
+			{
+				best = c;
+			}
+		}
+		if (best == HUFF_SYMBOLS)
+		{
+			break;
+		}
+		seeded[best] = true;
+		m->map[best] = m->codes;
+	}
+	if (m->codes == 0)
 	{
-		rc = _output_message(n,in->file,out->file);
+		m->codes = 1;
 	}
 
-	/* Free node tree */
-	_free_node(n);
+	for (round=0; ; round++)
+	{
+		rc = _context_lengths(m,max_len);
+		if (rc != HUFF_SUCCESS || !moved || round == CONTEXT_ROUNDS)
+		{
+			break;
+		}
 
-	return rc;
-}
+		moved = false;
+		for (c=0; c<HUFF_SYMBOLS; c++)
+		{
+			if (total[c] == 0)
+			{
+				continue;
+			}
+			best = m->map[c];
+			best_bits = _context_cost(m,c,best);
+			for (k=0; k<m->codes; k++)
+			{
+				bits = _context_cost(m,c,k);
+				if (bits < best_bits)
+				{
+					best = k;
+					best_bits = bits;
+				}
+			}
+			moved |= best != m->map[c];
+			m->map[c] = best;
+		}
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
 
+	/* Drop the codes which lost all of their contexts */
+	memset(renumber,0,sizeof(renumber));
+	for (k=0, s=0; k<m->codes; k++)
+	{
+		for (c=0; c<HUFF_SYMBOLS; c++)
+		{
+			if (m->map[c] == k && total[c] > 0)
+			{
+				break;
+			}
+		}
+		if (c < HUFF_SYMBOLS)
+		{
+			renumber[k] = s++;
+		}
+	}
+	for (c=0; c<HUFF_SYMBOLS; c++)
+	{
+		m->map[c] = (total[c] > 0) ? renumber[m->map[c]] : 0;
+	}
+	if (s != m->codes)
+	{
+		m->codes = s;
+		rc = _context_lengths(m,max_len);
+	}
+	return rc;
+}
+
+/* Code `n' symbols from `p', which follow the byte `prev', with the code *
+ * of the context model picked by the byte before each one. As for       *
+ * _encode_symbols three codes are added between each flush.             */
+static inline void _encode_symbols_ctx(BitWriter *w, const ContextModel *m,
+		const uint8_t *p, size_t n, uint8_t prev)
+{
+	const uint8_t *end = p + n;
+	const HuffCode *c0, *c1, *c2;
+
+	while (end - p >= 3)
+	{
+		c0 = &m->table[m->map[prev]][p[0]];
+		c1 = &m->table[m->map[p[0]]][p[1]];
+		c2 = &m->table[m->map[p[1]]][p[2]];
+		bw_put(w,c0->code,c0->len);
+		bw_put(w,c1->code,c1->len);
+		bw_put(w,c2->code,c2->len);
+		bw_flush(w);
+		prev = p[2];
+		p += 3;
+	}
+	while (p < end)
+	{
+		c0 = &m->table[m->map[prev]][*p];
+		bw_put(w,c0->code,c0->len);
+		bw_flush(w);
+		prev = *p++;
+	}
+}
+
+/* Compress the `len' bytes at `data' as a HUFB_CONTEXT block into the   *
+ * scratch memory at `work', with the size of the block returned through *
+ * `size'. The contexts are grouped into codes and the exact size of the *
+ * block worked out from their lengths, and when that is no smaller than *
+ * a single stream block with one code the block is coded as one. A      *
+ * block no code would make smaller is stored.                           */
+HUFF_ERR _encode_block_ctx(const uint8_t *data, size_t len, uint8_t *work,
+		size_t *size, unsigned int max_len, huffman_stats *st)
+{
+	assert(data != NULL);
+	assert(work != NULL);
+
+	uint64_t counts[HUFF_SYMBOLS];
+	uint8_t  lengths[HUFF_SYMBOLS];
+	HuffCode table[HUFF_SYMBOLS];
+	uint8_t  packed[LENGTHS_MAX_SIZE];
+	uint64_t bits0 = 0, bits = 0;
+	size_t   header0, header, i;
+	uint8_t *o = work + HUFB_BLOCK_HEADER_SIZE;
+	unsigned int c, k, s;
+	ContextModel *m;
+	double t = _stage_start(st);
+	BitWriter w;
+	HUFF_ERR rc;
+
+	m = calloc(1,sizeof(ContextModel));
+	if (m == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	huffman_histogram_order1(m->counts,data,len);
+	memset(counts,0,sizeof(counts));
+	for (c=0; c<HUFF_SYMBOLS; c++)
+	{
+		for (s=0; s<HUFF_SYMBOLS; s++)
+		{
+			counts[s] += m->counts[c][s];
+		}
+	}
+	_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+
+	rc = _build_code(table,lengths,counts,max_len,st);
+	t = _stage_start(st);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _cluster_contexts(m,max_len);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		free(m);
+		return rc;
+	}
+
+	/* Both blocks end with the coded stream and the footer */
+	header0 = _pack_lengths(packed,lengths);
+	header  = 1 + HUFB_CONTEXT_MAP_SIZE;
+	for (k=0; k<m->codes; k++)
+	{
+		header += _pack_lengths(packed,m->lengths[k]);
+		_note_lengths(st,m->lengths[k]);
+	}
+	for (s=0; s<HUFF_SYMBOLS; s++)
+	{
+		bits0 += counts[s] * lengths[s];
+		for (c=0; c<HUFF_SYMBOLS; c++)
+		{
+			bits += (uint64_t)m->counts[c][s] * m->lengths[m->map[c]][s];
+		}
+	}
+	_stage_end(st,HUFF_STAGE_TREE,&t);
+	if (8*header + bits >= 8*header0 + bits0)
+	{
+		free(m);
+		return _encode_coded1(data,len,work,size,counts,table,lengths,
+				st);
+	}
+	if (_not_smaller(header,bits,len))
+	{
+		free(m);
+		return _encode_stored(data,len,work,size,st);
+	}
+
+	/* Smaller than the single stream block, so it fits where that would */
+	for (k=0; k<m->codes; k++)
+	{
+		_get_codes(m->table[k],m->lengths[k]);
+	}
+	*o++ = m->codes;
+	for (i=0; i<HUFB_CONTEXT_MAP_SIZE; i++)
+	{
+		*o++ = m->map[2*i] | m->map[2*i+1] << 4;
+	}
+	for (k=0; k<m->codes; k++)
+	{
+		o += _pack_lengths(o,m->lengths[k]);
+	}
+	_stage_end(st,HUFF_STAGE_HEADER,&t);
+
+	bw_init(&w,o);
+	_encode_symbols_ctx(&w,m,data,len,0);
+	_write_footer(&w);
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+	free(m);
+
+	*size = w.ptr - work;
+	_pack_block_header(work,HUFB_CONTEXT,len,
+			*size - HUFB_BLOCK_HEADER_SIZE);
+	return HUFF_SUCCESS;
+}
+
+/* Returns true if the `len' bytes at `data' are all the same */
+static inline bool _one_byte(const uint8_t *data, size_t len)
+{
+	return len == 0 || memcmp(data,data+1,len-1) == 0;
+}
+
+/* Find the runs of RUN_MIN_LENGTH or more of one byte in the `len'     *
+ * bytes at `data', writing each to `out' in the layout of the list of a *
+ * HUFB_RUNS block. Returns the number of runs found, with the number of *
+ * bytes they cover returned through `run_bytes'.                        */
+static size_t _find_runs(const uint8_t *data, size_t len, uint8_t *out,
+		size_t *run_bytes)
+{
+	size_t i, start, end, last = 0, n = 0;
+
+	*run_bytes = 0;
+	for (i=0; len >= RUN_WINDOW && i <= len - RUN_WINDOW; i+=RUN_WINDOW)
+	{
+		/* Most windows differ at the ends */
+		if (data[i] != data[i+RUN_WINDOW-1] ||
+				!_one_byte(data+i,RUN_WINDOW))
+		{
+			continue;
+		}
+
+		start = i;
+		while (start > last && data[start-1] == data[i])
+		{
+			start--;
+		}
+		end = i + RUN_WINDOW;
+		while (end < len && data[end] == data[i])
+		{
+			end++;
+		}
+		if (end - start < RUN_MIN_LENGTH)
+		{
+			continue;
+		}
+
+		huff_put_u32(out,start - last);
+		huff_put_u32(out+4,end - start);
+		out[8] = data[i];
+		out += HUFB_RUN_SIZE;
+		*run_bytes += end - start;
+		last = end;
+		n++;
+
+		/* Carry on from the end of the run */
+		i = end - RUN_WINDOW;
+	}
+	return n;
+}
+
+/* Write the `len' bytes at `data', all the same byte, as a run block   *
+ * into the scratch memory at `work', header included, returning the    *
+ * size of the block through `size'.                                    */
+static HUFF_ERR _encode_run(const uint8_t *data, size_t len, uint8_t *work,
+		size_t *size, huffman_stats *st)
+{
+	work[HUFB_BLOCK_HEADER_SIZE] = data[0];
+	*size = HUFB_BLOCK_HEADER_SIZE + 1;
+	_pack_block_header(work,HUFB_RUN,len,1);
+	if (st != NULL)
+	{
+		st->run_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Compress the `len' bytes at `data' as a block in the layout chosen  *
+ * by `opts', the first layout `len' is long enough for, into the        *
+ * scratch memory at `work', with the size of the block returned through *
+ * `size'. Blocks too short to be worth splitting are a single stream.   */
+static HUFF_ERR _encode_layout(const uint8_t *data, size_t len,
+		uint8_t *work, size_t *size, const huffman_opts *opts,
+		huffman_stats *st)
+{
+	if (opts->streams == HUFB_STREAMS && len >= HUFB_MIN_BLOCK_SIZE)
+	{
+		return _encode_block4(data,len,work,size,opts->max_code_len,st);
+	}
+	if (opts->context && len >= CONTEXT_MIN_BLOCK)
+	{
+		return _encode_block_ctx(data,len,work,size,opts->max_code_len,
+				st);
+	}
+	return _encode_block1(data,len,work,size,opts->max_code_len,st);
+}
+
+/* Compress the `len' bytes at `data' as a HUFB_RUNS block into the      *
+ * scratch memory at `work', where _find_runs has already listed the     *
+ * `nruns' runs, covering `run_bytes' bytes, after the block header and  *
+ * run count. The bytes between the runs are gathered at the end of the  *
+ * scratch memory and coded as a block of their own in the layout chosen *
+ * by `opts', following the runs. The size of the block is returned      *
+ * through `size'.                                                       */
+static HUFF_ERR _encode_block_runs(const uint8_t *data, size_t len,
+		uint8_t *work, size_t *size, size_t nruns, size_t run_bytes,
+		const huffman_opts *opts, huffman_stats *st)
+{
+	uint8_t *runs = work + HUFB_BLOCK_HEADER_SIZE + 4;
+	uint8_t *o = runs + nruns*HUFB_RUN_SIZE;
+	uint8_t *gather = work + BLOCK_WORK_SIZE(len) - (len - run_bytes);
+	const uint8_t *p = data;
+	size_t i, gap, inner = 0;
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	huff_put_u32(work + HUFB_BLOCK_HEADER_SIZE,nruns);
+	if (run_bytes < len)
+	{
+		for (i=0; i<=nruns; i++)
+		{
+			gap = (i < nruns) ? huff_get_u32(runs + i*HUFB_RUN_SIZE) :
+				(size_t)(data + len - p);
+			memcpy(gather,p,gap);
+			gather += gap;
+			p += gap + ((i < nruns) ?
+				huff_get_u32(runs + i*HUFB_RUN_SIZE + 4) : 0);
+		}
+		_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+
+		/* Each run is longer than its place in the list, so the *
+		 * block coded after the list ends before the gathered   *
+		 * bytes start                                           */
+		gather -= len - run_bytes;
+		rc = _encode_layout(gather,len - run_bytes,o,&inner,opts,st);
+		if (rc != HUFF_SUCCESS)
+		{
+			return rc;
+		}
+	}
+
+	*size = o + inner - work;
+	_pack_block_header(work,HUFB_RUNS,len,*size - HUFB_BLOCK_HEADER_SIZE);
+	if (st != NULL)
+	{
+		st->run_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Compress the `len' bytes at `data' as a single block, with the block *
+ * layout chosen by `opts', into the BLOCK_WORK_SIZE(len) bytes of      *
+ * scratch memory at `work'. The size of the coded block, header        *
+ * included, is returned through `size'. Blocks too short to be worth   *
+ * splitting are always coded as a single stream. A block of one byte    *
+ * repeated is a run block, and one with enough long runs in it lists    *
+ * them and codes only the bytes between them, in the layout chosen by   *
+ * `opts'. With `opts->checksum' the checksum of the block is taken      *
+ * while it is still in the cache from looking for runs, and added to    *
+ * the end of the block.                                                 */
+HUFF_ERR _encode_block(const uint8_t *data, size_t len, uint8_t *work,
+		size_t *size, const huffman_opts *opts, huffman_stats *st)
+{
+	size_t nruns, run_bytes;
+	uint32_t crc = 0;
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	if (st != NULL)
+	{
+		st->blocks++;
+	}
+
+	nruns = _find_runs(data,len,work + HUFB_BLOCK_HEADER_SIZE + 4,
+			&run_bytes);
+	_stage_end(st,HUFF_STAGE_HISTOGRAM,&t);
+	if (opts->checksum)
+	{
+		crc = huffman_crc32c(0,data,len);
+		_stage_end(st,HUFF_STAGE_CODE,&t);
+	}
+
+	if ((nruns == 1 && run_bytes == len) ||
+			(len > 0 && len < RUN_MIN_LENGTH && _one_byte(data,len)))
+	{
+		rc = _encode_run(data,len,work,size,st);
+	}
+	else if (nruns > 0 && run_bytes >= len/RUN_MIN_SHARE)
+	{
+		rc = _encode_block_runs(data,len,work,size,nruns,run_bytes,
+				opts,st);
+	}
+	else
+	{
+		rc = _encode_layout(data,len,work,size,opts,st);
+	}
+
+	if (rc == HUFF_SUCCESS && opts->checksum)
+	{
+		huff_put_u32(work + *size,crc);
+		*size += HUFB_CRC_SIZE;
+		work[1] |= HUFB_BLOCK_CRC;
+		huff_put_u32(work+8,*size - HUFB_BLOCK_HEADER_SIZE);
+	}
+	return rc;
+}
+
+/* Write a block coded into `work' by _encode_block to `out' */
+static HUFF_ERR _write_block(const uint8_t *work, size_t size, f_stat *out,
+		huffman_stats *st)
+{
+	double t = _stage_start(st);
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (fwrite_stat(work,1,size,out) != size)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+	_stage_end(st,HUFF_STAGE_WRITE,&t);
+	return rc;
+}
+
+/* Add a block to the end of the block index */
+HUFF_ERR _index_add(BlockIndex *index, uint64_t offset, size_t comp_len,
+		size_t raw_len)
+{
+	assert(index != NULL);
+
+	IndexEntry *tmp;
+	size_t size;
+
+	if (index->count == index->size)
+	{
+		size = index->size ? 2*index->size : 64;
+		tmp = realloc(index->entries,size*sizeof(IndexEntry));
+		if (tmp == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			return HUFF_NOMEM;
+		}
+		index->entries = tmp;
+		index->size    = size;
+	}
+
+	index->entries[index->count].offset   = offset;
+	index->entries[index->count].comp_len = comp_len;
+	index->entries[index->count].raw_len  = raw_len;
+	index->count++;
+
+	return HUFF_SUCCESS;
+}
+
+/* Write the block index followed by the trailer which locates it. The  *
+ * index starts `offset' bytes from the start of the file header.       */
+HUFF_ERR _write_index(const BlockIndex *index, uint64_t offset, f_stat *out)
+{
+	assert(index != NULL);
+
+	uint8_t e[HUFB_INDEX_ENTRY_SIZE];
+	uint8_t t[HUFB_TRAILER_SIZE];
+	size_t i;
+
+	for (i=0; i<index->count; i++)
+	{
+		huff_put_u64(e,index->entries[i].offset);
+		huff_put_u32(e+8,index->entries[i].comp_len);
+		huff_put_u32(e+12,index->entries[i].raw_len);
+		if (fwrite_stat(e,1,sizeof(e),out) != sizeof(e))
+		{
+			return HUFF_WRITEFAIL;
+		}
+	}
+
+	huff_put_u64(t,offset);
+	huff_put_u32(t+8,index->count);
+	memcpy(t+12,HUFI_MAGIC,4);
+	if (fwrite_stat(t,1,sizeof(t),out) != sizeof(t))
+	{
+		return HUFF_WRITEFAIL;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Huffman encodes the input as a stream of independently coded blocks of *
+ * `opts->block_size' bytes. Only one block of input is held in memory   *
+ * at a time and each block is written out as soon as it has been coded. *
+ * With `opts->index' set the stream ends with a block index.            */
+HUFF_ERR _huffman_blocks(f_stat *in, f_stat *out, const huffman_opts *opts)
+{
+	size_t block_size = opts->block_size;
+	BlockIndex index = { NULL, 0, 0 };
+	const void *data;
+	uint8_t *work;
+	size_t n, size;
+	uint64_t start = out->byte_count, offset;
+	HUFF_ERR rc;
+
+	work = malloc(BLOCK_WORK_SIZE(block_size));
+	if (work == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	rc = _write_file_header(out,block_size,
+			opts->index ? HUFB_FLAG_INDEX : 0);
+
+	while (rc == HUFF_SUCCESS && (n = fview_stat(&data,block_size,in)) > 0)
+	{
+		if (n > block_size)
+		{
+			/* fview_stat returned an error code */
+			rc = HUFF_FAILURE;
+			break;
+		}
+
+		offset = out->byte_count - start;
+		rc = _encode_block(data,n,work,&size,opts,opts->stats);
+		if (rc == HUFF_SUCCESS)
+		{
+			rc = _write_block(work,size,out,opts->stats);
+		}
+		if (rc == HUFF_SUCCESS && opts->index)
+		{
+			rc = _index_add(&index,offset,size,n);
+		}
+
+		/* The block is no longer needed once it has been written */
+		fdiscard_stat(in);
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _write_block_header(out,HUFB_END,0,0);
+	}
+	if (rc == HUFF_SUCCESS && opts->index)
+	{
+		rc = _write_index(&index,out->byte_count - start,out);
+	}
+	if (rc == HUFF_SUCCESS && fflush_stat(out) != 0)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+
+	free(index.entries);
+	free(work);
+	return rc;
+}
+
+/* Code one block of a batch, run on a pool thread */
+static void _encode_block_job(void *arg, size_t i)
+{
+	BlockBatch *batch = arg;
+	BlockJob *job = &batch->jobs[i];
+
+	job->rc = _encode_block(job->data,job->len,job->work,&job->size,
+			batch->opts,batch->opts->stats ? &job->stats : NULL);
+}
+
+/* Huffman encodes the input as a block stream like _huffman_blocks, with *
+ * the blocks coded on `opts->threads' threads. The input is read in     *
+ * batches of two blocks per thread, the blocks of a batch are coded in  *
+ * parallel and then written out in order. The stream ends with a block  *
+ * index.                                                                 */
+HUFF_ERR _huffman_blocks_parallel(f_stat *in, f_stat *out,
+		const huffman_opts *opts)
+{
+	size_t block_size = opts->block_size;
+	unsigned int threads = opts->threads;
+	BlockBatch batch;
+	BlockIndex index = { NULL, 0, 0 };
+	BlockJob *job;
+	HuffPool *pool = NULL;
+	const uint8_t *data;
+	uint8_t *work;
+	size_t batch_size = 2*(size_t)threads*block_size;
+	size_t n, len, count, i;
+	uint64_t start = out->byte_count;
+	double t;
+	HUFF_ERR rc;
+
+	/* Every job of a batch has its own scratch memory, kept for the *
+	 * blocks of the following batches                               */
+	batch.opts = opts;
+	batch.jobs = calloc(2*threads,sizeof(BlockJob));
+	work = malloc(2*(size_t)threads*BLOCK_WORK_SIZE(block_size));
+	if (batch.jobs == NULL || work == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(batch.jobs);
+		free(work);
+		return HUFF_NOMEM;
+	}
+	for (i=0; i<2*(size_t)threads; i++)
+	{
+		batch.jobs[i].work = work + i*BLOCK_WORK_SIZE(block_size);
+	}
+
+	rc = huffman_pool_create(&pool,threads);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _write_file_header(out,block_size,HUFB_FLAG_INDEX);
+	}
+
+	while (rc == HUFF_SUCCESS &&
+			(n = fview_stat((const void **)&data,batch_size,in)) > 0)
+	{
+		if (n > batch_size)
+		{
+			/* fview_stat returned an error code */
+			rc = HUFF_FAILURE;
+			break;
+		}
+
+		for (count=0; n>0; count++)
+		{
+			len = (n < block_size) ? n : block_size;
+			batch.jobs[count].data = data;
+			batch.jobs[count].len  = len;
+			memset(&batch.jobs[count].stats,0,sizeof(huffman_stats));
+			data += len;
+			n    -= len;
+		}
+
+		huffman_pool_run(pool,_encode_block_job,&batch,count);
+
+		t = _stage_start(opts->stats);
+		for (i=0; i<count; i++)
+		{
+			job = &batch.jobs[i];
+			_add_stats(opts->stats,&job->stats);
+			if (rc == HUFF_SUCCESS)
+			{
+				rc = job->rc;
+			}
+			if (rc == HUFF_SUCCESS)
+			{
+				rc = _index_add(&index,out->byte_count - start,
+						job->size,job->len);
+			}
+			if (rc == HUFF_SUCCESS && fwrite_stat(job->work,1,
+					job->size,out) != job->size)
+			{
+				rc = HUFF_WRITEFAIL;
+			}
+		}
+		_stage_end(opts->stats,HUFF_STAGE_WRITE,&t);
+
+		/* The batch is no longer needed once it has been written */
+		fdiscard_stat(in);
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _write_block_header(out,HUFB_END,0,0);
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _write_index(&index,out->byte_count - start,out);
+	}
+	if (rc == HUFF_SUCCESS && fflush_stat(out) != 0)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+
+	huffman_pool_destroy(pool);
+	free(index.entries);
+	free(batch.jobs);
+	free(work);
+
+	return rc;
+}
+
+/* Code everything in `in' with `book' as a codebook message to `out' */
+HUFF_ERR _huffman_codebook(f_stat *in, f_stat *out, const HuffCodebook *book,
+		huffman_stats *st)
+{
+	uint8_t h[HUFC_HEADER_SIZE];
+	HUFF_ERR rc;
+
+	memcpy(h,HUFC_MAGIC,4);
+	huff_put_u32(h+4,book->id);
+	if (fwrite_stat(h,1,sizeof(h),out) != sizeof(h))
+	{
+		return HUFF_WRITEFAIL;
+	}
+
+	_note_lengths(st,book->lengths);
+	rc = _compress_file(book->codes,in,out,st);
+	if (rc == HUFF_SUCCESS && st != NULL)
+	{
+		st->blocks = 1;
+	}
+	return rc;
+}
+
+/* Code the input with the adaptive coder in one pass, each piece of    *
+ * input being coded and written out as soon as it has been read, so    *
+ * memory use does not grow with the input. Input which arrives a       *
+ * little at a time, such as from a pipe, is followed by a flush so     *
+ * that the decoder can give all of it out straight away.                */
+HUFF_ERR _huffman_adaptive(f_stat *in, f_stat *out, huffman_stats *st)
+{
+	const uint8_t *chunk;
+	HuffAdaptive *a;
+	uint8_t *buf;
+	size_t n, got, piece, size;
+	double t = _stage_start(st);
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (fwrite_stat(HUFA_MAGIC,1,4,out) != 4)
+	{
+		return HUFF_WRITEFAIL;
+	}
+
+	a   = malloc(sizeof(HuffAdaptive));
+	buf = malloc(HUFA_ENCODE_BOUND(ENCODE_PIECE));
+	if (a == NULL || buf == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(a);
+		free(buf);
+		return HUFF_NOMEM;
+	}
+	huffman_adaptive_init(a);
+
+	while (rc == HUFF_SUCCESS &&
+		(n = fview_some_stat((const void **)&chunk,STAT_CHUNK_SIZE,in)) > 0)
+	{
+		if (n > STAT_CHUNK_SIZE)
+		{
+			/* fview_some_stat returned an error code */
+			rc = HUFF_FAILURE;
+			break;
+		}
+		got = n;
+		while (rc == HUFF_SUCCESS && n > 0)
+		{
+			piece = (n < ENCODE_PIECE) ? n : ENCODE_PIECE;
+			size  = huffman_adaptive_encode(a,chunk,piece,buf);
+			_stage_end(st,HUFF_STAGE_CODE,&t);
+			if (fwrite_stat(buf,1,size,out) != size)
+			{
+				rc = HUFF_WRITEFAIL;
+			}
+			_stage_end(st,HUFF_STAGE_WRITE,&t);
+			chunk += piece;
+			n     -= piece;
+		}
+		if (rc == HUFF_SUCCESS && !in->fully_buffered &&
+				got < STAT_CHUNK_SIZE)
+		{
+			/* No more input was ready, give out what there is */
+			size = huffman_adaptive_mark(a,HUFA_FLUSH,buf);
+			if (fwrite_stat(buf,1,size,out) != size ||
+					fflush_stat(out) != 0)
+			{
+				rc = HUFF_WRITEFAIL;
+			}
+			_stage_end(st,HUFF_STAGE_WRITE,&t);
+		}
+		fdiscard_stat(in);
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		size = huffman_adaptive_mark(a,HUFA_END,buf);
+		if (fwrite_stat(buf,1,size,out) != size)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		_stage_end(st,HUFF_STAGE_WRITE,&t);
+	}
+	if (st != NULL)
+	{
+		st->max_code_len = a->max_len;
+	}
+
+	free(buf);
+	free(a);
+	return rc;
+}
+
+/* Copy the encoder settings `opts' to `o' with the defaults filled in, *
+ * and check them. The block size is left for the caller.                */
+HUFF_ERR _fill_opts(huffman_opts *o, const huffman_opts *opts)
+{
+	*o = *opts;
+	if (o->max_code_len == 0)
+	{
+		o->max_code_len = HUFF_MAX_CODE_LEN;
+	}
+	if (o->streams == 0)
+	{
+		o->streams = 1;
+	}
+	if (o->max_code_len < HUFF_MIN_CODE_LEN ||
+			o->max_code_len > HUFF_MAX_CODE_LEN ||
+			o->threads > HUFF_MAX_THREADS ||
+			(o->streams != 1 && o->streams != HUFB_STREAMS))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* Context blocks are coded as one stream, with codes of their own */
+	if (o->context && (o->streams != 1 || o->codebook != NULL ||
+			o->adaptive))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* An adaptive stream has no blocks to end with a checksum */
+	if (o->checksum && o->adaptive)
+	{
+		return HUFF_INVALIDARG;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Performs huffman encoding on the input with the settings in `opts' */
+HUFF_ERR huffman_opt(f_stat *in, f_stat *out, const huffman_opts *opts)
+{
+	huffman_opts o;
+	uint64_t out_start;
+	double start;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (in == NULL || out == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (opts == NULL)
+	{
+		return huffman(in,out);
+	}
+
+	if (_fill_opts(&o,opts) != HUFF_SUCCESS)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* The adaptive coder codes the input as one stream as it is read */
+	if (o.adaptive && (o.block_size != 0 || o.threads > 1 ||
+			o.streams > 1 || o.index || o.codebook != NULL))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* A sampled code is built for the input as one stream */
+	if (o.sample > 100 || (o.sample != 0 && (o.block_size != 0 ||
+			o.threads > 1 || o.streams > 1 || o.index ||
+			o.codebook != NULL || o.adaptive || o.context ||
+			o.checksum)))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* Threads, interleaved streams, the index, contexts and checksums *
+	 * need blocks to work on                                          */
+	if (o.block_size == 0 && (o.threads > 1 || o.streams > 1 || o.index ||
+			o.context || o.checksum))
+	{
+		o.block_size = HUFB_BLOCK_SIZE;
+	}
+
+	if (o.block_size != 0 && (o.block_size < HUFB_MIN_BLOCK_SIZE ||
+			o.block_size > HUFB_MAX_BLOCK_SIZE))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* A codebook message is a single stream */
+	if (o.codebook != NULL && o.block_size != 0)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (o.stats != NULL)
+	{
+		memset(o.stats,0,sizeof(huffman_stats));
+	}
+	start = _stage_start(o.stats);
+	out_start = out->byte_count;
+
+	if (o.codebook != NULL)
+	{
+		rc = _huffman_codebook(in,out,o.codebook,o.stats);
+	}
+	else if (o.adaptive)
+	{
+		rc = _huffman_adaptive(in,out,o.stats);
+		if (rc == HUFF_SUCCESS && fflush_stat(out) != 0)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+	}
+	else if (o.block_size == 0)
+	{
+		if (_huffman_stream(in,out,o.max_code_len,
+					o.sample,o.stats) != HUFF_SUCCESS ||
+				fflush_stat(out) != 0)
+		{
+			return HUFF_FAILURE;
+		}
+		rc = HUFF_SUCCESS;
+	}
+	else if (o.threads > 1)
+	{
+		rc = _huffman_blocks_parallel(in,out,&o);
+	}
+	else
+	{
+		rc = _huffman_blocks(in,out,&o);
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		if (o.stats != NULL && o.block_size == 0 &&
+				o.stats->blocks == 0)
+		{
+			o.stats->blocks = 1;
+		}
+		_finish_stats(o.stats,start,in,out,out_start);
+	}
+	return rc;
+}
+
+/* Read the code lengths at the start of the `*size' bytes at `*data'  *
+ * into the decode table, and move `*data' and `*size' on to the coded  *
+ * symbols which follow them, to the end of the input. The number of    *
+ * coded bits in them is returned through `nbits'.                      */
+HUFF_ERR _read_code(DecodeEntry table[DECODE_TABLE_SIZE],
+		const uint8_t **data, size_t *size, size_t *nbits, huffman_stats *st)
+{
+	uint8_t lengths[HUFF_SYMBOLS];
+	double t = _stage_start(st);
+	size_t used;
+	HUFF_ERR rc;
+
+	rc = _parse_lengths(lengths,*data,*size,&used);
+	_stage_end(st,HUFF_STAGE_HEADER,&t);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _get_decode_table(table,lengths);
+		_note_lengths(st,lengths);
+		_stage_end(st,HUFF_STAGE_TREE,&t);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+
+	*data += used;
+	*size -= used;
+	return _stream_bits(nbits,*data,*size);
+}
+
+/* Decode the `nbits' bits of codes in the `size' bytes at `data' with  *
+ * `table' to `out'.                                                     */
+HUFF_ERR _decode_coded(const DecodeEntry *table, const uint8_t *data,
+		size_t size, size_t nbits, f_stat *out, huffman_stats *st)
+{
+	uint8_t *buf;
+	size_t pos = 0, n;
+	double t;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	buf = malloc(DECODE_BUF_SIZE);
+	if (buf == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	t = _stage_start(st);
+	while (pos < nbits)
+	{
+		rc = _decode_symbols(table,data,size,nbits,&pos,buf,
+				DECODE_BUF_SIZE,&n);
+		if (rc == HUFF_SUCCESS && n == 0)
+		{
+			/* The last code runs past the end of the stream */
+			rc = HUFF_CORRUPT;
+		}
+		_stage_end(st,HUFF_STAGE_CODE,&t);
+		if (fwrite_stat(buf,1,n,out) != n)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		_stage_end(st,HUFF_STAGE_WRITE,&t);
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+	}
+	free(buf);
+
+	return rc;
+}
+
+/* Decode the code lengths and the symbols coded with them from `in' to *
+ * `out'. The coded symbols run to the end of the input, which is viewed *
+ * as a whole so that codes can be decoded straight from memory.         */
+HUFF_ERR _unhuffman_stream(f_stat *in, f_stat *out, huffman_stats *st)
+{
+	DecodeEntry table[DECODE_TABLE_SIZE];
+	const uint8_t *data;
+	size_t size, nbits;
+	HUFF_ERR rc;
+
+	size = fview_stat((const void **)&data,SIZE_MAX,in);
+	if (size > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	rc = _read_code(table,&data,&size,&nbits,st);
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+	return _decode_coded(table,data,size,nbits,out,st);
+}
+
+/* Decode a message coded with `book', the magic number has already    *
+ * been read, from `in' to `out'.                                        */
+HUFF_ERR _unhuffman_codebook(f_stat *in, f_stat *out, const HuffCodebook *book,
+		huffman_stats *st)
+{
+	const uint8_t *data;
+	size_t size, nbits;
+	HUFF_ERR rc;
+
+	size = fview_stat((const void **)&data,SIZE_MAX,in);
+	if (size > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	if (book == NULL || size < HUFC_HEADER_SIZE - 4 ||
+			huff_get_u32(data) != book->id)
+	{
+		return HUFF_CODEBOOK;
+	}
+	data += HUFC_HEADER_SIZE - 4;
+	size -= HUFC_HEADER_SIZE - 4;
+
+	rc = _stream_bits(&nbits,data,size);
+	if (rc == HUFF_SUCCESS)
+	{
+		_note_lengths(st,book->lengths);
+		rc = _decode_coded(book->table,data,size,nbits,out,st);
+	}
+	return rc;
+}
+
+/* Decode an adaptive stream, the magic number has already been read,   *
+ * from `in' to `out' as the input arrives. When the input does not come *
+ * from memory the output is flushed after every piece of input, so a    *
+ * stream which is still being written is decoded as far as it goes.    */
+HUFF_ERR _unhuffman_adaptive(f_stat *in, f_stat *out, huffman_stats *st)
+{
+	const uint8_t *chunk;
+	HuffAdaptive *a;
+	uint8_t *buf;
+	size_t n, used, written;
+	double t;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	a   = malloc(sizeof(HuffAdaptive));
+	buf = malloc(DECODE_BUF_SIZE);
+	if (a == NULL || buf == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(a);
+		free(buf);
+		return HUFF_NOMEM;
+	}
+	huffman_adaptive_init(a);
+
+	t = _stage_start(st);
+	while (rc == HUFF_SUCCESS && !a->done)
+	{
+		n = fview_some_stat((const void **)&chunk,STAT_CHUNK_SIZE,in);
+		if (n == 0)
+		{
+			/* The input ends before the end of the stream */
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		if (n > STAT_CHUNK_SIZE)
+		{
+			/* fview_some_stat returned an error code */
+			rc = HUFF_FAILURE;
+			break;
+		}
+
+		/* Carry on while the output fills up, as the last symbols of *
+		 * the input may still be waiting to be written              */
+		do
+		{
+			rc = huffman_adaptive_decode(a,chunk,n,&used,buf,
+					DECODE_BUF_SIZE,&written);
+			chunk += used;
+			n     -= used;
+			_stage_end(st,HUFF_STAGE_CODE,&t);
+			if (fwrite_stat(buf,1,written,out) != written)
+			{
+				rc = HUFF_WRITEFAIL;
+			}
+			_stage_end(st,HUFF_STAGE_WRITE,&t);
+		} while (rc == HUFF_SUCCESS && !a->done &&
+				(n > 0 || written == DECODE_BUF_SIZE));
+
+		if (rc == HUFF_SUCCESS && !in->fully_buffered &&
+				fflush_stat(out) != 0)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		fdiscard_stat(in);
+	}
+	if (st != NULL)
+	{
+		st->max_code_len = a->max_len;
+	}
+
+	free(buf);
+	free(a);
+	return rc;
+}
+
+/* Decode the `comp_len' byte payload of a single stream block into the *
+ * `raw_len' bytes at `out'. The payload must decode to exactly          *
+ * `raw_len' bytes.                                                      */
+HUFF_ERR _decode_block1(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, huffman_stats *st)
+{
+	DecodeEntry table[DECODE_TABLE_SIZE];
+	const uint8_t *data = payload;
+	size_t size = comp_len, nbits, pos = 0, n = 0;
+	double t;
+	HUFF_ERR rc;
+
+	rc = _read_code(table,&data,&size,&nbits,st);
+	if (rc == HUFF_SUCCESS)
+	{
+		t = _stage_start(st);
+		rc = _decode_symbols(table,data,size,nbits,&pos,out,raw_len,&n);
+		_stage_end(st,HUFF_STAGE_CODE,&t);
+	}
+	if (rc == HUFF_SUCCESS && (n != raw_len || pos != nbits))
+	{
+		rc = HUFF_CORRUPT;
+	}
+
+	return rc;
+}
+
+/* Decode the `comp_len' byte payload of a block of four bitstreams into *
+ * the `raw_len' bytes at `out'. Three codes are decoded from each of the *
+ * streams in turn, so the lookups of one stream can go ahead while those *
+ * of another wait, and each stream is finished on its own at the end.   */
+HUFF_ERR _decode_block4(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, huffman_stats *st)
+{
+	DecodeEntry table[DECODE_TABLE_SIZE];
+	uint8_t lengths[HUFF_SYMBOLS];
+	const uint8_t *data, *s[HUFB_STREAMS];
+	uint8_t *o[HUFB_STREAMS], *end[HUFB_STREAMS];
+	size_t size, ssize[HUFB_STREAMS], pos[HUFB_STREAMS];
+	size_t seg = (raw_len + HUFB_STREAMS - 1)/HUFB_STREAMS;
+	size_t total = 0, first, used, n, k;
+	double t = _stage_start(st);
+	HUFF_ERR rc;
+
+	if (comp_len < HUFB_STREAMS_HEADER_SIZE)
+	{
+		return HUFF_CORRUPT;
+	}
+	data = payload + HUFB_STREAMS_HEADER_SIZE;
+	size = comp_len - HUFB_STREAMS_HEADER_SIZE;
+	rc = _parse_lengths(lengths,data,size,&used);
+	_stage_end(st,HUFF_STAGE_HEADER,&t);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _get_decode_table(table,lengths);
+		_note_lengths(st,lengths);
+		_stage_end(st,HUFF_STAGE_TREE,&t);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+	data += used;
+	size -= used;
+
+	for (k=0; k<HUFB_STREAMS; k++)
+	{
+		ssize[k] = (k < HUFB_STREAMS-1) ? huff_get_u32(payload+4*k) :
+			size - total;
+		if (ssize[k] > size - total)
+		{
+			return HUFF_CORRUPT;
+		}
+		s[k]   = data + total;
+		total += ssize[k];
+
+		first  = (k*seg < raw_len) ? k*seg : raw_len;
+		o[k]   = out + first;
+		end[k] = out + ((first + seg < raw_len) ? first + seg : raw_len);
+		pos[k] = 0;
+	}
+
+	while (_can_decode3(pos[0],ssize[0],8*ssize[0],o[0],end[0]) &&
+			_can_decode3(pos[1],ssize[1],8*ssize[1],o[1],end[1]) &&
+			_can_decode3(pos[2],ssize[2],8*ssize[2],o[2],end[2]) &&
+			_can_decode3(pos[3],ssize[3],8*ssize[3],o[3],end[3]))
+	{
+		if (!_decode3(table,s[0],&pos[0],o[0]) ||
+				!_decode3(table,s[1],&pos[1],o[1]) ||
+				!_decode3(table,s[2],&pos[2],o[2]) ||
+				!_decode3(table,s[3],&pos[3],o[3]))
+		{
+			return HUFF_CORRUPT;
+		}
+		o[0] += 3;
+		o[1] += 3;
+		o[2] += 3;
+		o[3] += 3;
+	}
+
+	/* Every stream is padded to a whole byte */
+	for (k=0; k<HUFB_STREAMS; k++)
+	{
+		rc = _decode_symbols(table,s[k],ssize[k],8*ssize[k],&pos[k],o[k],
+				end[k] - o[k],&n);
+		if (rc != HUFF_SUCCESS)
+		{
+			return rc;
+		}
+		if (n != (size_t)(end[k] - o[k]) || 8*ssize[k] - pos[k] >= 8)
+		{
+			return HUFF_CORRUPT;
+		}
+	}
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+
+	return HUFF_SUCCESS;
+}
+
+/* Decode the `comp_len' byte payload of a HUFB_CONTEXT block into the  *
+ * `raw_len' bytes at `out'. Each code is looked up in the decode table *
+ * of the code picked by the symbol before it, and three codes are      *
+ * decoded from each load of the input as for a single stream block.    *
+ * The tables are built in the CONTEXT_TABLES_SIZE entries at `*ctx',   *
+ * which are allocated for the first context block when `*ctx' is NULL  *
+ * and kept for the next, for the caller to free.                       */
+HUFF_ERR _decode_block_ctx(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, DecodeEntry **ctx,
+		huffman_stats *st)
+{
+	const DecodeEntry *table[HUFF_SYMBOLS];
+	DecodeEntry *tables, e0, e1, e2;
+	uint8_t lengths[HUFF_SYMBOLS], map[HUFF_SYMBOLS];
+	const uint8_t *data = payload;
+	uint8_t *o = out, *end = out + raw_len, prev = 0;
+	size_t size = comp_len, nbits, used, p = 0;
+	unsigned int codes, c, k;
+	uint64_t acc;
+	double t = _stage_start(st);
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (size < 1 + HUFB_CONTEXT_MAP_SIZE || data[0] == 0 ||
+			data[0] > HUFB_CONTEXT_CODES)
+	{
+		return HUFF_CORRUPT;
+	}
+	codes = data[0];
+	for (c=0; c<HUFF_SYMBOLS; c++)
+	{
+		map[c] = (data[1+c/2] >> ((c & 1) ? 4 : 0)) & 0x0f;
+		if (map[c] >= codes)
+		{
+			return HUFF_CORRUPT;
+		}
+	}
+	data += 1 + HUFB_CONTEXT_MAP_SIZE;
+	size -= 1 + HUFB_CONTEXT_MAP_SIZE;
+
+	if (*ctx == NULL)
+	{
+		*ctx = malloc(CONTEXT_TABLES_SIZE*sizeof(DecodeEntry));
+		if (*ctx == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			return HUFF_NOMEM;
+		}
+	}
+	tables = *ctx;
+	for (k=0; k<codes && rc == HUFF_SUCCESS; k++)
+	{
+		rc = _parse_lengths(lengths,data,size,&used);
+		_stage_end(st,HUFF_STAGE_HEADER,&t);
+		if (rc == HUFF_SUCCESS)
+		{
+			rc = _get_decode_table(tables + k*DECODE_TABLE_SIZE,
+					lengths);
+			_note_lengths(st,lengths);
+			_stage_end(st,HUFF_STAGE_TREE,&t);
+			data += used;
+			size -= used;
+		}
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _stream_bits(&nbits,data,size);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+	for (c=0; c<HUFF_SYMBOLS; c++)
+	{
+		table[c] = tables + map[c]*DECODE_TABLE_SIZE;
+	}
+
+	while (_can_decode3(p,size,nbits,o,end))
+	{
+		acc = br_peek(data,p);
+		e0  = _decode_entry(table[prev],acc);
+		acc <<= e0.len;
+		e1  = _decode_entry(table[e0.symbol],acc);
+		acc <<= e1.len;
+		e2  = _decode_entry(table[e1.symbol],acc);
+		if (e0.len == 0 || e1.len == 0 || e2.len == 0)
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		o[0] = e0.symbol;
+		o[1] = e1.symbol;
+		o[2] = e2.symbol;
+		prev = e2.symbol;
+		p += e0.len + e1.len + e2.len;
+		o += 3;
+	}
+
+	/* One code at a time near the end of the input */
+	while (rc == HUFF_SUCCESS && o < end && p < nbits)
+	{
+		e0 = _decode_entry(table[prev],br_peek_tail(data,size,p));
+		if (e0.len == 0 || p + e0.len > nbits)
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		*o++ = prev = e0.symbol;
+		p += e0.len;
+	}
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+
+	if (rc == HUFF_SUCCESS && (o != end || p != nbits))
+	{
+		rc = HUFF_CORRUPT;
+	}
+	return rc;
+}
+
+/* Copy the payload of a stored block, which is the `raw_len' bytes of *
+ * the block as they are, into `out'.                                  */
+HUFF_ERR _decode_stored(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, huffman_stats *st)
+{
+	double t = _stage_start(st);
+
+	if (comp_len != raw_len)
+	{
+		return HUFF_CORRUPT;
+	}
+	memcpy(out,payload,raw_len);
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+	if (st != NULL)
+	{
+		st->stored_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Decode the `comp_len' byte payload of a block of one of the layouts *
+ * of _encode_layout, or a stored block, of type `type' into the       *
+ * `raw_len' bytes at `out', with the context tables at `*ctx'.        */
+HUFF_ERR _decode_layout(int type, const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, DecodeEntry **ctx,
+		huffman_stats *st)
+{
+	switch (type)
+	{
+	case HUFB_HUFFMAN:
+		return _decode_block1(payload,comp_len,out,raw_len,st);
+	case HUFB_HUFFMAN4:
+		return _decode_block4(payload,comp_len,out,raw_len,st);
+	case HUFB_CONTEXT:
+		return _decode_block_ctx(payload,comp_len,out,raw_len,ctx,st);
+	case HUFB_STORED:
+		return _decode_stored(payload,comp_len,out,raw_len,st);
+	default:
+		return HUFF_CORRUPT;
+	}
+}
+
+/* Fill `out' with the `raw_len' bytes of a run block */
+HUFF_ERR _decode_run(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, huffman_stats *st)
+{
+	double t = _stage_start(st);
+
+	if (comp_len != 1)
+	{
+		return HUFF_CORRUPT;
+	}
+	memset(out,payload[0],raw_len);
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+	if (st != NULL)
+	{
+		st->run_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Decode the `comp_len' byte payload of a HUFB_RUNS block into the     *
+ * `raw_len' bytes at `out'. The block of the bytes between the runs is *
+ * decoded to the end of `out' and they are then moved down into place, *
+ * with each run filled in as they go past it, which never writes over  *
+ * bytes not yet moved. The context tables are at `*ctx'.               */
+HUFF_ERR _decode_block_runs(const uint8_t *payload, size_t comp_len,
+		uint8_t *out, size_t raw_len, DecodeEntry **ctx,
+		huffman_stats *st)
+{
+	const uint8_t *runs = payload + 4, *r;
+	size_t nruns, total = 0, run_bytes = 0, gap, run, i;
+	uint8_t *o, *p;
+	double t;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (comp_len < 4)
+	{
+		return HUFF_CORRUPT;
+	}
+	nruns = huff_get_u32(payload);
+	if (nruns == 0 || nruns > (comp_len - 4)/HUFB_RUN_SIZE)
+	{
+		return HUFF_CORRUPT;
+	}
+	for (i=0, r=runs; i<nruns; i++, r+=HUFB_RUN_SIZE)
+	{
+		gap = huff_get_u32(r);
+		run = huff_get_u32(r+4);
+		if (run == 0 || gap > raw_len - total ||
+				run > raw_len - total - gap)
+		{
+			return HUFF_CORRUPT;
+		}
+		total     += gap + run;
+		run_bytes += run;
+	}
+
+	/* The block is left out when there is nothing between the runs */
+	comp_len -= 4 + nruns*HUFB_RUN_SIZE;
+	if (run_bytes == raw_len)
+	{
+		rc = (comp_len == 0) ? HUFF_SUCCESS : HUFF_CORRUPT;
+	}
+	else if (comp_len < HUFB_BLOCK_HEADER_SIZE || r[1] != 0 ||
+			huff_get_u32(r+4) != raw_len - run_bytes ||
+			huff_get_u32(r+8) != comp_len - HUFB_BLOCK_HEADER_SIZE)
+	{
+		rc = HUFF_CORRUPT;
+	}
+	else
+	{
+		rc = _decode_layout(r[0],r + HUFB_BLOCK_HEADER_SIZE,
+				comp_len - HUFB_BLOCK_HEADER_SIZE,out + run_bytes,
+				raw_len - run_bytes,ctx,st);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+
+	t = _stage_start(st);
+	o = out;
+	p = out + run_bytes;
+	for (i=0, r=runs; i<nruns; i++, r+=HUFB_RUN_SIZE)
+	{
+		gap = huff_get_u32(r);
+		run = huff_get_u32(r+4);
+		memmove(o,p,gap);
+		o += gap;
+		p += gap;
+		memset(o,r[8],run);
+		o += run;
+	}
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+	if (st != NULL)
+	{
+		st->run_blocks++;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Check the `raw_len' bytes at `data' against the checksum at the end *
+ * of the `comp_len' byte payload of a block with HUFB_BLOCK_CRC set     */
+static HUFF_ERR _check_crc(const uint8_t *payload, size_t comp_len,
+		const uint8_t *data, size_t raw_len, huffman_stats *st)
+{
+	double t = _stage_start(st);
+	uint32_t crc = huffman_crc32c(0,data,raw_len);
+
+	_stage_end(st,HUFF_STAGE_CODE,&t);
+	if (crc != huff_get_u32(payload + comp_len - HUFB_CRC_SIZE))
+	{
+		return HUFF_CHECKSUM;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Decode the payload of the block with the block header `h' into `out',  *
+ * checking it against its checksum when it has one. The decode tables of *
+ * context blocks are kept at `*ctx', as for _decode_block_ctx.           */
+HUFF_ERR _decode_block(const uint8_t h[HUFB_BLOCK_HEADER_SIZE],
+		const uint8_t *payload, size_t comp_len, uint8_t *out,
+		size_t raw_len, DecodeEntry **ctx, huffman_stats *st)
+{
+	size_t len = comp_len;
+	HUFF_ERR rc;
+
+	if (st != NULL)
+	{
+		st->blocks++;
+	}
+	if ((h[1] & ~HUFB_BLOCK_CRC) != 0 ||
+			((h[1] & HUFB_BLOCK_CRC) && comp_len < HUFB_CRC_SIZE))
+	{
+		return HUFF_CORRUPT;
+	}
+	if (h[1] & HUFB_BLOCK_CRC)
+	{
+		len -= HUFB_CRC_SIZE;
+	}
+
+	switch (h[0])
+	{
+	case HUFB_RUN:
+		rc = _decode_run(payload,len,out,raw_len,st);
+		break;
+	case HUFB_RUNS:
+		rc = _decode_block_runs(payload,len,out,raw_len,ctx,st);
+		break;
+	default:
+		rc = _decode_layout(h[0],payload,len,out,raw_len,ctx,st);
+		break;
+	}
+
+	if (rc == HUFF_SUCCESS && (h[1] & HUFB_BLOCK_CRC))
+	{
+		rc = _check_crc(payload,comp_len,out,raw_len,st);
+	}
+	return rc;
+}
+
+/* Check the rest of a block stream file header after the magic number, *
+ * returning the block size through `block_size'.                        */
+HUFF_ERR _check_file_header(size_t *block_size, const uint8_t *h)
+{
+	*block_size = huff_get_u32(h+8);
+	if (h[4] != HUFB_VERSION || (h[5] & ~HUFB_FLAG_INDEX) != 0 ||
+			*block_size < HUFB_MIN_BLOCK_SIZE ||
+			*block_size > HUFB_MAX_BLOCK_SIZE)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+	return HUFF_SUCCESS;
+}
+
+/* Decode a block stream, the magic number has already been read. Each  *
+ * block is decoded and written out as soon as it has been read.         */
+HUFF_ERR _unhuffman_blocks(f_stat *in, f_stat *out, huffman_stats *st)
+{
+	uint8_t h[HUFB_HEADER_SIZE];
+	const void *payload;
+	uint8_t *buf;
+	DecodeEntry *ctx = NULL;
+	size_t block_size, raw_len, comp_len;
+	double t;
+	HUFF_ERR rc;
+
+	/* Rest of the file header, after the magic number */
+	if (fread_stat(h+4,1,sizeof(h)-4,in) != sizeof(h)-4 ||
+			_check_file_header(&block_size,h) != HUFF_SUCCESS)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+
+	buf = malloc(block_size);
+	if (buf == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	while (true)
+	{
+		if (fread_stat(h,1,HUFB_BLOCK_HEADER_SIZE,in) !=
+				HUFB_BLOCK_HEADER_SIZE)
+		{
+			/* Truncated stream */
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		if (h[0] == HUFB_END)
+		{
+			rc = HUFF_SUCCESS;
+			break;
+		}
+
+		raw_len  = huff_get_u32(h+4);
+		comp_len = huff_get_u32(h+8);
+		if (raw_len == 0 || raw_len > block_size ||
+				fview_stat(&payload,comp_len,in) != comp_len)
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+
+		/* A stored block is written out straight from the input */
+		if (h[0] == HUFB_STORED && (h[1] == 0 ? comp_len == raw_len :
+				h[1] == HUFB_BLOCK_CRC &&
+				comp_len == raw_len + HUFB_CRC_SIZE))
+		{
+			if (st != NULL)
+			{
+				st->blocks++;
+				st->stored_blocks++;
+			}
+			rc = (h[1] == 0) ? HUFF_SUCCESS :
+				_check_crc(payload,comp_len,payload,raw_len,st);
+		}
+		else
+		{
+			rc = _decode_block(h,payload,comp_len,buf,raw_len,&ctx,st);
+			payload = buf;
+		}
+		t = _stage_start(st);
+		if (rc == HUFF_SUCCESS &&
+				fwrite_stat(payload,1,raw_len,out) != raw_len)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		_stage_end(st,HUFF_STAGE_WRITE,&t);
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+
+		fdiscard_stat(in);
+	}
+
+	free(ctx);
+	free(buf);
+	return rc;
+}
+
+/* Read the block index at the end of the `size' byte block stream at   *
+ * `data' into a list of decode jobs returned through `jobs', with the  *
+ * number of blocks returned through `count'. The block headers are not *
+ * read until the blocks are decoded, so that finding one block in a    *
+ * large stream does not touch the rest of it.                          */
+HUFF_ERR _read_index(DecodeJob **jobs, size_t *count, const uint8_t *data,
+		size_t size, size_t block_size)
+{
+	const uint8_t *t, *e;
+	uint64_t index_offset, offset, out_offset = 0;
+	size_t n, i, comp_len, raw_len;
+
+	if (size < HUFB_HEADER_SIZE + HUFB_TRAILER_SIZE)
+	{
+		return HUFF_CORRUPT;
+	}
+	t = data + size - HUFB_TRAILER_SIZE;
+	index_offset = huff_get_u64(t);
+	n = huff_get_u32(t+8);
+	if (memcmp(t+12,HUFI_MAGIC,4) != 0 || index_offset < HUFB_HEADER_SIZE ||
+			index_offset > size - HUFB_TRAILER_SIZE ||
+			(size - HUFB_TRAILER_SIZE - index_offset) !=
+			n*HUFB_INDEX_ENTRY_SIZE)
+	{
+		return HUFF_CORRUPT;
+	}
+
+	*jobs = calloc(n ? n : 1,sizeof(DecodeJob));
+	if (*jobs == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	for (i=0; i<n; i++)
+	{
+		e = data + index_offset + i*HUFB_INDEX_ENTRY_SIZE;
+		offset   = huff_get_u64(e);
+		comp_len = huff_get_u32(e+8);
+		raw_len  = huff_get_u32(e+12);
+		if (offset < HUFB_HEADER_SIZE || offset > index_offset ||
+				comp_len < HUFB_BLOCK_HEADER_SIZE ||
+				comp_len > index_offset - offset ||
+				raw_len == 0 || raw_len > block_size)
+		{
+			return HUFF_CORRUPT;
+		}
+
+		(*jobs)[i].payload    = data + offset + HUFB_BLOCK_HEADER_SIZE;
+		(*jobs)[i].comp_len   = comp_len - HUFB_BLOCK_HEADER_SIZE;
+		(*jobs)[i].raw_len    = raw_len;
+		(*jobs)[i].out_offset = out_offset;
+		out_offset += raw_len;
+	}
+
+	*count = n;
+	return HUFF_SUCCESS;
+}
+
+/* Decode the block of a job read from the index into `out', with the *
+ * context tables at `*ctx', after checking the block header against  *
+ * the index entry.                                                   */
+HUFF_ERR _decode_job(const DecodeJob *job, uint8_t *out, DecodeEntry **ctx,
+		huffman_stats *st)
+{
+	const uint8_t *h = job->payload - HUFB_BLOCK_HEADER_SIZE;
+
+	if (huff_get_u32(h+4) != job->raw_len ||
+			huff_get_u32(h+8) != job->comp_len)
+	{
+		return HUFF_CORRUPT;
+	}
+	return _decode_block(h,job->payload,job->comp_len,out,job->raw_len,
+			ctx,st);
+}
+
+/* Decode one block of a batch, run on a pool thread */
+static void _decode_block_job(void *arg, size_t i)
+{
+	DecodeBatch *batch = arg;
+	DecodeJob *job = &batch->jobs[i];
+	huffman_stats *st = (batch->stats != NULL) ? &job->stats : NULL;
+	double t;
+
+	if (st != NULL)
+	{
+		memset(st,0,sizeof(huffman_stats));
+	}
+	job->rc = _decode_job(job,job->buf,job->ctx,st);
+
+	if (batch->positioned)
+	{
+		t = _stage_start(st);
+		if (job->rc == HUFF_SUCCESS && fpwrite_stat(job->buf,job->raw_len,
+				job->out_offset,batch->out) != 0)
+		{
+			job->rc = HUFF_WRITEFAIL;
+		}
+		_stage_end(st,HUFF_STAGE_WRITE,&t);
+	}
+}
+
+/* Decode the `count' blocks in `jobs' on the pool, in batches of two *
+ * blocks per thread decoded into buffers, and context tables, which  *
+ * are reused for every batch. An output file is filled in by the     *
+ * threads with every block written straight to its place. Any other  *
+ * output is written out in order after each batch.                   */
+HUFF_ERR _decode_jobs(HuffPool *pool, DecodeJob *jobs, size_t count,
+		size_t block_size, unsigned int threads, f_stat *out,
+		huffman_stats *st)
+{
+	DecodeBatch batch = { jobs, out, false, st };
+	uint8_t *bufs = NULL;
+	DecodeEntry **ctxs;
+	size_t batch_blocks = 2*(size_t)threads, first, n, i;
+	uint64_t total = 0;
+	double t;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	bufs = malloc(batch_blocks*block_size);
+	ctxs = calloc(batch_blocks,sizeof(DecodeEntry *));
+	if (bufs == NULL || ctxs == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(bufs);
+		free(ctxs);
+		return HUFF_NOMEM;
+	}
+	batch.positioned = fpositioned_stat(out) && fflush_stat(out) == 0;
+
+	for (first=0; rc == HUFF_SUCCESS && first<count; first+=n)
+	{
+		n = (count - first < batch_blocks) ? count - first : batch_blocks;
+		for (i=0; i<n; i++)
+		{
+			jobs[first+i].buf = bufs + i*block_size;
+			jobs[first+i].ctx = &ctxs[i];
+		}
+
+		batch.jobs = jobs + first;
+		huffman_pool_run(pool,_decode_block_job,&batch,n);
+
+		t = _stage_start(st);
+		for (i=first; rc == HUFF_SUCCESS && i<first+n; i++)
+		{
+			_add_stats(st,&jobs[i].stats);
+			rc = jobs[i].rc;
+			total += jobs[i].raw_len;
+			if (rc == HUFF_SUCCESS && !batch.positioned &&
+					fwrite_stat(jobs[i].buf,1,jobs[i].raw_len,out) !=
+					jobs[i].raw_len)
+			{
+				rc = HUFF_WRITEFAIL;
+			}
+		}
+		_stage_end(st,HUFF_STAGE_WRITE,&t);
+	}
+
+	/* Move the output past the blocks the threads wrote */
+	if (rc == HUFF_SUCCESS && batch.positioned &&
+			fskip_stat(out,total) != 0)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+
+	for (i=0; i<batch_blocks; i++)
+	{
+		free(ctxs[i]);
+	}
+	free(ctxs);
+	free(bufs);
+	return rc;
+}
+
+/* View the whole of a block stream, the magic number has already been *
+ * read, through `data' from the start of the magic number so that the  *
+ * offsets in the index can be used directly. The size of the stream    *
+ * and the block size from its checked file header are returned through *
+ * `size' and `block_size'.                                             */
+HUFF_ERR _view_blocks(const uint8_t **data, size_t *size, size_t *block_size,
+		f_stat *in)
+{
+	*size = fview_stat((const void **)data,SIZE_MAX,in);
+	if (*size > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	if (*size < HUFB_HEADER_SIZE - 4)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+
+	/* The magic number was read from the same view */
+	*data -= 4;
+	*size += 4;
+	return _check_file_header(block_size,*data);
+}
+
+/* Decode a block stream on `threads' threads, the magic number has     *
+ * already been read. The blocks are found through the block index, so  *
+ * the whole stream is viewed in memory. Streams without an index are    *
+ * decoded one block after another.                                      */
+HUFF_ERR _unhuffman_blocks_parallel(f_stat *in, f_stat *out,
+		unsigned int threads, huffman_stats *st)
+{
+	const uint8_t *data;
+	DecodeJob *jobs = NULL;
+	HuffPool *pool = NULL;
+	f_stat view;
+	size_t size, block_size, count = 0;
+	HUFF_ERR rc;
+
+	rc = _view_blocks(&data,&size,&block_size,in);
+	if (rc == HUFF_SUCCESS && (data[5] & HUFB_FLAG_INDEX) == 0)
+	{
+		/* No index, decode the blocks one after another */
+		fmemopen_stat(&view,data+4,size-4);
+		rc = _unhuffman_blocks(&view,out,st);
+		fclose_stat(&view);
+		return rc;
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _read_index(&jobs,&count,data,size,block_size);
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = huffman_pool_create(&pool,threads);
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _decode_jobs(pool,jobs,count,block_size,threads,out,st);
+	}
+
+	huffman_pool_destroy(pool);
+	free(jobs);
+
+	return rc;
+}
+
+/* Find the block holding uncompressed byte `offset' in the `count'      *
+ * blocks of `jobs', or `count' if it is past the end of the last block. */
+static size_t _find_block(const DecodeJob *jobs, size_t count,
+		uint64_t offset)
+{
+	size_t lo = 0, hi = count, mid;
+
+	/* First block which starts after `offset' */
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo)/2;
+		if (jobs[mid].out_offset <= offset)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo == 0 || offset - jobs[lo-1].out_offset >= jobs[lo-1].raw_len)
+	{
+		return count;
+	}
+	return lo - 1;
+}
+
+/* Decode the uncompressed bytes from `offset' to `offset'+`length' of an *
+ * indexed block stream, decoding only the blocks which hold them.        */
+HUFF_ERR huffman_read_range(f_stat *in, f_stat *out, uint64_t offset,
+		uint64_t length)
+{
+	enum huff_format format;
+	const uint8_t *data;
+	DecodeJob *jobs = NULL;
+	uint8_t *buf = NULL;
+	DecodeEntry *ctx = NULL;
+	size_t size, block_size, count = 0, i, lo, hi;
+	uint64_t end;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (in == NULL || out == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* Only the index and a few blocks are read */
+	frandom_stat(in);
+
+	rc = _check_header(&format,in);
+	if (rc == HUFF_SUCCESS && format != FORMAT_BLOCKS)
+	{
+		rc = HUFF_NOINDEX;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _view_blocks(&data,&size,&block_size,in);
+	}
+	if (rc == HUFF_SUCCESS && (data[5] & HUFB_FLAG_INDEX) == 0)
+	{
+		rc = HUFF_NOINDEX;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _read_index(&jobs,&count,data,size,block_size);
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		buf = malloc(block_size);
+		if (buf == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			rc = HUFF_NOMEM;
+		}
+	}
+
+	end = (length > UINT64_MAX - offset) ? UINT64_MAX : offset + length;
+	for (i = (rc == HUFF_SUCCESS) ? _find_block(jobs,count,offset) : count;
+			i<count && jobs[i].out_offset < end; i++)
+	{
+		rc = _decode_job(&jobs[i],buf,&ctx,NULL);
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+
+		/* The part of the block inside the range */
+		lo = (offset > jobs[i].out_offset) ?
+			offset - jobs[i].out_offset : 0;
+		hi = (end - jobs[i].out_offset < jobs[i].raw_len) ?
+			end - jobs[i].out_offset : jobs[i].raw_len;
+		if (fwrite_stat(buf+lo,1,hi-lo,out) != hi-lo)
+		{
+			rc = HUFF_WRITEFAIL;
+			break;
+		}
+	}
+
+	if (rc == HUFF_SUCCESS && fflush_stat(out) != 0)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+
+	free(ctx);
+	free(buf);
+	free(jobs);
+	return rc;
+}
+
+/* Perform a decompression on the huffman encoded `in' file. */
+HUFF_ERR unhuffman(f_stat *in, f_stat *out)
+{
+	return unhuffman_opt(in,out,NULL);
+}
+
+/* Perform a decompression on the huffman encoded `in' file with the   *
+ * settings in `opts'.                                                 */
+HUFF_ERR unhuffman_opt(f_stat *in, f_stat *out, const huffman_opts *opts)
+{
+	enum huff_format format;
+	huffman_stats *st = (opts != NULL) ? opts->stats : NULL;
+	uint64_t out_start;
+	double start;
+	HUFF_ERR rc;
+
+	/* Validate the inputs are not null */
+	if (in == NULL || out == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (st != NULL)
+	{
+		memset(st,0,sizeof(huffman_stats));
+	}
+	start = _stage_start(st);
+	out_start = out->byte_count;
+
+	/* Validate that the input file was encoded by this huffman encoder */
+	if (_check_header(&format,in) != HUFF_SUCCESS)
+	{
+		fprintf(stderr,"File not encoded by huffman\n");
+		return HUFF_FAILURE;
+	}
+
+	if (format == FORMAT_BLOCKS && opts != NULL && opts->threads > 1 &&
+			in->map != NULL)
+	{
+		/* Only input already in memory is decoded in parallel */
+		rc = (opts->threads > HUFF_MAX_THREADS) ? HUFF_INVALIDARG :
+			_unhuffman_blocks_parallel(in,out,opts->threads,st);
+	}
+	else if (format == FORMAT_BLOCKS)
+	{
+		rc = _unhuffman_blocks(in,out,st);
+	}
+	else if (format == FORMAT_CODEBOOK)
+	{
+		rc = _unhuffman_codebook(in,out,
+				(opts != NULL) ? opts->codebook : NULL,st);
+		if (st != NULL)
+		{
+			st->blocks = 1;
+		}
+	}
+	else if (format == FORMAT_ADAPTIVE)
+	{
+		rc = _unhuffman_adaptive(in,out,st);
+		if (st != NULL)
+		{
+			st->blocks = 1;
+		}
+	}
+	else
+	{
+		rc = _unhuffman_stream(in,out,st);
+		if (st != NULL)
+		{
+			st->blocks = 1;
+		}
+	}
+
+	/* Write out anything left in the output buffer */
+	if (fflush_stat(out) != 0 && rc == HUFF_SUCCESS)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		_finish_stats(st,start,in,out,out_start);
+	}
+	return rc;
+}
+
+
+/* The worst case is every symbol taking the longest code */
+size_t huffman_compress_bound(size_t len)
+{
+	return 4 + LENGTHS_MAX_SIZE + len/8*HUFF_MAX_CODE_LEN +
+		((len%8)*HUFF_MAX_CODE_LEN + 7)/8 + 1;
+}
+
+/* Huffman encodes a buffer into a buffer, giving the same output as   *
+ * huffman() without going through a stream.                          */
+HUFF_ERR huffman_compress_buffer(const void *src, size_t src_len,
+		void *dst, size_t dst_cap, size_t *dst_len)
+{
+	uint64_t counts[HUFF_SYMBOLS];
+	uint8_t  lengths[HUFF_SYMBOLS];
+	HuffCode table[HUFF_SYMBOLS];
+	uint8_t  header[4 + LENGTHS_MAX_SIZE];
+	uint8_t *o = dst;
+	uint64_t coded;
+	size_t size;
+	bool run;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if ((src == NULL && src_len > 0) || dst == NULL || dst_len == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	memset(counts,0,sizeof(counts));
+	huffman_histogram(counts,src,src_len);
+	rc = _build_code(table,lengths,counts,HUFF_MAX_CODE_LEN,NULL);
+	if (rc != HUFF_SUCCESS)
+	{
+		return rc;
+	}
+
+	memcpy(header,HUFF_MAGIC,4);
+	size = 4 + _pack_lengths(header+4,lengths);
+
+	/* As huffman() does, input of one byte repeated is written as runs *
+	 * and input the code would not shrink is stored                     */
+	coded = size + _coded_bits(counts,lengths)/8 + 1;
+	run = _single_symbol(counts) >= 0 &&
+		_stored_size(src_len,true) < coded;
+	if (run || _stored_size(src_len,false) < coded)
+	{
+		if (_stored_size(src_len,run) > dst_cap)
+		{
+			return HUFF_NOSPACE;
+		}
+		_store_memory(src,src_len,run,dst);
+		*dst_len = _stored_size(src_len,run);
+		return HUFF_SUCCESS;
+	}
+	if (size > dst_cap)
+	{
+		return HUFF_NOSPACE;
+	}
+	memcpy(o,header,size);
+	o += size;
+
+	rc = _compress_memory(table,src,src_len,&o,(uint8_t *)dst + dst_cap);
+	if (rc == HUFF_SUCCESS)
+	{
+		*dst_len = o - (uint8_t *)dst;
+	}
+	return rc;
+}
+
+/* Decode the block stream of `size' bytes at `data', from its file    *
+ * header on, straight into the `cap' bytes at `out'. The number of    *
+ * bytes decoded is returned through `len'. The index is not needed.   *
+ * Context blocks are decoded with the tables at `ctx', or with tables *
+ * allocated once for the whole stream if it is NULL.                  */
+static HUFF_ERR _decompress_blocks(const uint8_t *data, size_t size,
+		uint8_t *out, size_t cap, size_t *len, DecodeEntry *ctx)
+{
+	DecodeEntry *tables = ctx;
+	size_t block_size, raw_len, comp_len, n = 0;
+	int type;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (size < HUFB_HEADER_SIZE ||
+			_check_file_header(&block_size,data) != HUFF_SUCCESS)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+	data += HUFB_HEADER_SIZE;
+	size -= HUFB_HEADER_SIZE;
+
+	while (true)
+	{
+		if (size < HUFB_BLOCK_HEADER_SIZE)
+		{
+			/* Truncated stream */
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		type = data[0];
+		if (type == HUFB_END)
+		{
+			break;
+		}
+
+		raw_len  = huff_get_u32(data+4);
+		comp_len = huff_get_u32(data+8);
+		data += HUFB_BLOCK_HEADER_SIZE;
+		size -= HUFB_BLOCK_HEADER_SIZE;
+		if (raw_len == 0 || raw_len > block_size || comp_len > size)
+		{
+			rc = HUFF_CORRUPT;
+			break;
+		}
+		if (raw_len > cap - n)
+		{
+			rc = HUFF_NOSPACE;
+			break;
+		}
+
+		rc = _decode_block(data - HUFB_BLOCK_HEADER_SIZE,data,comp_len,
+				out+n,raw_len,&tables,NULL);
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+		n    += raw_len;
+		data += comp_len;
+		size -= comp_len;
+	}
+
+	if (tables != ctx)
+	{
+		free(tables);
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		*len = n;
+	}
+	return rc;
+}
+
+/* Decode the adaptive stream in the `size' bytes at `data', after the  *
+ * magic number, into the `cap' bytes at `out'.                         */
+static HUFF_ERR _decompress_adaptive(const uint8_t *data, size_t size,
+		uint8_t *out, size_t cap, size_t *len)
+{
+	HuffAdaptive a;
+	size_t used, n, more;
+	uint8_t spare;
+	HUFF_ERR rc;
+
+	huffman_adaptive_init(&a);
+	rc = huffman_adaptive_decode(&a,data,size,&used,out,cap,&n);
+	if (rc == HUFF_SUCCESS && !a.done)
+	{
+		/* Stopped short of the end escape, for want of room if there *
+		 * is another byte to come                                     */
+		rc = huffman_adaptive_decode(&a,data+used,size-used,&used,
+				&spare,1,&more);
+		rc = (rc == HUFF_SUCCESS && more > 0) ? HUFF_NOSPACE :
+			HUFF_CORRUPT;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		*len = n;
+	}
+	return rc;
+}
+
+/* Huffman decodes a buffer into a buffer. Every layout written by the *
+ * encoder but a codebook message is accepted, and decoded straight    *
+ * into the output. The decode tables of context blocks are built in   *
+ * `scratch' when it is given.                                         */
+HUFF_ERR huffman_decompress_buffer_scratch(const void *src, size_t src_len,
+		void *dst, size_t dst_cap, size_t *dst_len, void *scratch,
+		size_t scratch_size)
+{
+	DecodeEntry table[DECODE_TABLE_SIZE];
+	const uint8_t *data = src;
+	size_t size, nbits, pos = 0, n;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (src == NULL || dst == NULL || dst_len == NULL ||
+			(scratch != NULL && scratch_size <
+			CONTEXT_TABLES_SIZE*sizeof(DecodeEntry)))
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (src_len >= 4 && memcmp(data,HUFB_MAGIC,4) == 0)
+	{
+		return _decompress_blocks(data,src_len,dst,dst_cap,dst_len,
+				scratch);
+	}
+	if (src_len >= 4 && memcmp(data,HUFC_MAGIC,4) == 0)
+	{
+		return HUFF_CODEBOOK;
+	}
+	if (src_len >= 4 && memcmp(data,HUFA_MAGIC,4) == 0)
+	{
+		return _decompress_adaptive(data+4,src_len-4,dst,dst_cap,dst_len);
+	}
+	if (src_len < 4 || memcmp(data,HUFF_MAGIC,4) != 0)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+
+	data += 4;
+	size  = src_len - 4;
+	rc = _read_code(table,&data,&size,&nbits,NULL);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _decode_symbols(table,data,size,nbits,&pos,dst,dst_cap,&n);
+	}
+	if (rc == HUFF_SUCCESS && pos < nbits)
+	{
+		rc = (n < dst_cap) ? HUFF_CORRUPT : HUFF_NOSPACE;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		*dst_len = n;
+	}
+	return rc;
+}
+
+/* Huffman decodes a buffer into a buffer, allocating the tables of any *
+ * context blocks once for the call.                                    */
+HUFF_ERR huffman_decompress_buffer(const void *src, size_t src_len,
+		void *dst, size_t dst_cap, size_t *dst_len)
+{
+	return huffman_decompress_buffer_scratch(src,src_len,dst,dst_cap,
+			dst_len,NULL,0);
+}
+
+/* Identify a code by the FNV-1a hash of its code lengths */
+static uint32_t _codebook_id(const uint8_t lengths[HUFF_SYMBOLS])
+{
+	uint32_t h = 2166136261u;
+	unsigned int i;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		h = (h ^ lengths[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Build the tables of a codebook from its code lengths, every symbol *
+ * needs a code so that any message can be coded.                     */
+static HUFF_ERR _codebook_tables(HuffCodebook *book)
+{
+	unsigned int i;
+	HUFF_ERR rc;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (book->lengths[i] == 0)
+		{
+			return HUFF_CORRUPT;
+		}
+	}
+	rc = _get_codes(book->codes,book->lengths);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _get_decode_table(book->table,book->lengths);
+	}
+	book->id = _codebook_id(book->lengths);
+	return rc;
+}
+
+HUFF_ERR huffman_codebook_train(HuffCodebook **book,
+		const uint64_t counts[HUFF_SYMBOLS], unsigned int max_len)
+{
+	uint64_t c[HUFF_SYMBOLS];
+	HuffCodebook *b;
+	unsigned int i;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (book == NULL || counts == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	/* Symbols missing from the sample still get a code */
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		c[i] = (counts[i] < UINT64_MAX) ? counts[i] + 1 : counts[i];
+	}
+
+	b = malloc(sizeof(HuffCodebook));
+	if (b == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	rc = huffman_code_lengths(b->lengths,c,
+			max_len ? max_len : HUFF_MAX_CODE_LEN);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _codebook_tables(b);
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		free(b);
+		return rc;
+	}
+
+	*book = b;
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR huffman_codebook_save(const HuffCodebook *book, f_stat *out)
+{
+	uint8_t h[HUFD_HEADER_SIZE + LENGTHS_MAX_SIZE];
+	size_t size;
+
+	/* Validate the inputs */
+	if (book == NULL || out == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	memcpy(h,HUFD_MAGIC,4);
+	h[4] = HUFD_VERSION;
+	h[5] = 0;
+	huff_put_u16(h+6,0);
+	huff_put_u32(h+8,book->id);
+	size = HUFD_HEADER_SIZE + _pack_lengths(h+HUFD_HEADER_SIZE,book->lengths);
+
+	if (fwrite_stat(h,1,size,out) != size || fflush_stat(out) != 0)
+	{
+		return HUFF_WRITEFAIL;
+	}
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR huffman_codebook_load(HuffCodebook **book, f_stat *in)
+{
+	const uint8_t *data;
+	HuffCodebook *b;
+	size_t size, used;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (book == NULL || in == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	size = fview_stat((const void **)&data,SIZE_MAX,in);
+	if (size > FVIEW_MAX)
+	{
+		/* fview_stat returned an error code */
+		return HUFF_FAILURE;
+	}
+	if (size < HUFD_HEADER_SIZE || memcmp(data,HUFD_MAGIC,4) != 0 ||
+			data[4] != HUFD_VERSION)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+
+	b = malloc(sizeof(HuffCodebook));
+	if (b == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	rc = _parse_lengths(b->lengths,data+HUFD_HEADER_SIZE,
+			size-HUFD_HEADER_SIZE,&used);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _codebook_tables(b);
+	}
+	if (rc == HUFF_SUCCESS && (used != size-HUFD_HEADER_SIZE ||
+			b->id != huff_get_u32(data+8)))
+	{
+		rc = HUFF_CORRUPT;
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		free(b);
+		return rc;
+	}
+
+	*book = b;
+	return HUFF_SUCCESS;
+}
+
+uint32_t huffman_codebook_id(const HuffCodebook *book)
+{
+	assert(book != NULL);
+
+	return book->id;
+}
+
+unsigned int huffman_codebook_length(const HuffCodebook *book,
+		unsigned int symbol)
+{
+	assert(book != NULL);
+	assert(symbol < HUFF_SYMBOLS);
+
+	return book->lengths[symbol];
+}
+
+void huffman_codebook_free(HuffCodebook *book)
+{
+	free(book);
+}
+
+HUFF_ERR huffman_codebook_compress(const HuffCodebook *book, const void *src,
+		size_t src_len, void *dst, size_t dst_cap, size_t *dst_len)
+{
+	uint8_t *o = dst;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (book == NULL || (src == NULL && src_len > 0) || dst == NULL ||
+			dst_len == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (dst_cap < HUFC_HEADER_SIZE)
+	{
+		return HUFF_NOSPACE;
+	}
+	memcpy(o,HUFC_MAGIC,4);
+	huff_put_u32(o+4,book->id);
+	o += HUFC_HEADER_SIZE;
+
+	rc = _compress_memory(book->codes,src,src_len,&o,
+			(uint8_t *)dst + dst_cap);
+	if (rc == HUFF_SUCCESS)
+	{
+		*dst_len = o - (uint8_t *)dst;
+	}
+	return rc;
+}
+
+HUFF_ERR huffman_codebook_decompress(const HuffCodebook *book,
+		const void *src, size_t src_len, void *dst, size_t dst_cap,
+		size_t *dst_len)
+{
+	const uint8_t *data = src;
+	size_t nbits, pos = 0, n;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (book == NULL || src == NULL || dst == NULL || dst_len == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	if (src_len < HUFC_HEADER_SIZE || memcmp(data,HUFC_MAGIC,4) != 0)
+	{
+		return HUFF_INVALIDHEADER;
+	}
+	if (huff_get_u32(data+4) != book->id)
+	{
+		return HUFF_CODEBOOK;
+	}
+
+	data    += HUFC_HEADER_SIZE;
+	src_len -= HUFC_HEADER_SIZE;
+	rc = _stream_bits(&nbits,data,src_len);
+	if (rc == HUFF_SUCCESS)
+	{
+		rc = _decode_symbols(book->table,data,src_len,nbits,&pos,dst,
+				dst_cap,&n);
+	}
+	if (rc == HUFF_SUCCESS && pos < nbits)
+	{
+		rc = (n < dst_cap) ? HUFF_CORRUPT : HUFF_NOSPACE;
+	}
+	if (rc == HUFF_SUCCESS)
+	{
+		*dst_len = n;
+	}
+	return rc;
+}
+
+/* Size of the input buffer of a stream decoder, which grows to hold a *
+ * whole block when the blocks are larger.                             */
+#define STREAM_BUF_SIZE (64*1024)
+
+/* Longest code length header the decoder accepts, the sparse layout  *
+ * with every symbol, though the encoder never writes one this long.  */
+#define LENGTHS_MAX_READ (2+HUFF_SYMBOLS+HUFF_SYMBOLS/2)
+
+/* Bytes at the end of the input a stream decoder holds back from the  *
+ * codes of a single stream until the end of the input: the footer and *
+ * the byte whose last bit it marks. Both are more than any one code.  */
+#define STREAM_HOLD 2
+
+/* Largest block payload a stream decoder accepts, room for the longest *
+ * code for every byte of the block plus the headers.                  */
+#define STREAM_PAYLOAD_MAX(block_size) (2*(size_t)(block_size) + 1024)
+
+/* Progress of a stream encoder or decoder */
+enum stream_state {
+	STREAM_MAGIC,		/* Decoder waiting for the magic number */
+	STREAM_FILE_HEADER,	/* Rest of a block stream file header */
+	STREAM_BLOCK,		/* Blocks being coded or decoded */
+	STREAM_LENGTHS,		/* Code lengths of a single stream */
+	STREAM_CODES,		/* Codes of a single stream */
+	STREAM_ADAPTIVE,	/* Codes of an adaptive stream */
+	STREAM_END,		/* End of the stream reached */
+};
+
+/* State of an incremental encoder or decoder. The encoder collects the *
+ * input in `block' and codes it into `coded' a block at a time, or     *
+ * codes it into `coded' as it is pushed when adaptive. The decoder     *
+ * collects the input in `in', and decodes each block into `block' or   *
+ * the codes of a single or adaptive stream straight to the caller.     */
+struct huff_stream
+{
+	bool              decoder;
+	enum stream_state state;
+	HUFF_ERR          rc;		/* First error, returned from then on */
+	bool              flush;	/* Code the input collected so far */
+	bool              finish;	/* No more input to come */
+	huffman_opts      opts;		/* Encoder settings */
+	uint8_t          *block;
+	size_t            block_size;
+	size_t            block_len;
+	size_t            block_pos;	/* Decoded bytes already pulled */
+	uint8_t          *work;		/* Scratch memory to code a block in */
+	f_stat            coded;	/* Coded output waiting to be pulled */
+	size_t            coded_pos;
+	uint64_t          offset;	/* Bytes of output coded so far */
+	BlockIndex        index;
+	uint8_t          *in;
+	size_t            in_size;
+	size_t            in_start;	/* First byte not yet decoded */
+	size_t            in_len;
+	size_t            in_bit;	/* Bits of that byte already decoded */
+	DecodeEntry       table[DECODE_TABLE_SIZE];
+	DecodeEntry      *ctx;		/* Tables of context blocks */
+	HuffAdaptive     *adaptive;	/* Coder of an adaptive stream */
+	bool              unflushed;	/* Adaptive input since the last flush */
+};
+
+/* Finish starting the adaptive encoder `s', which is freed if the    *
+ * settings cannot be used.                                            */
+static HUFF_ERR _stream_init_adaptive(HuffStream **stream, HuffStream *s)
+{
+	if (s->opts.block_size != 0 || s->opts.streams > 1 || s->opts.index ||
+			s->opts.codebook != NULL)
+	{
+		free(s);
+		return HUFF_INVALIDARG;
+	}
+	s->state = STREAM_ADAPTIVE;
+
+	s->adaptive = malloc(sizeof(HuffAdaptive));
+	s->work     = malloc(HUFA_ENCODE_BOUND(ENCODE_PIECE));
+	if (s->adaptive == NULL || s->work == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		huffman_stream_end(s);
+		return HUFF_NOMEM;
+	}
+	huffman_adaptive_init(s->adaptive);
+
+	fmemopen_stat(&s->coded,NULL,0);
+	if (fwrite_stat(HUFA_MAGIC,1,4,&s->coded) != 4)
+	{
+		huffman_stream_end(s);
+		return HUFF_NOMEM;
+	}
+
+	*stream = s;
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR huffman_stream_init(HuffStream **stream, const huffman_opts *opts)
+{
+	huffman_opts defaults = { 0 };
+	HuffStream *s;
+	HUFF_ERR rc;
+
+	/* Validate the inputs */
+	if (stream == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	s = calloc(1,sizeof(HuffStream));
+	if (s == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+
+	rc = _fill_opts(&s->opts,(opts != NULL) ? opts : &defaults);
+	if (rc == HUFF_SUCCESS && s->opts.stats != NULL)
+	{
+		memset(s->opts.stats,0,sizeof(huffman_stats));
+	}
+	if (rc == HUFF_SUCCESS && s->opts.adaptive)
+	{
+		return _stream_init_adaptive(stream,s);
+	}
+	if (s->opts.block_size == 0)
+	{
+		s->opts.block_size = HUFB_BLOCK_SIZE;
+	}
+	if (rc != HUFF_SUCCESS || s->opts.codebook != NULL ||
+			s->opts.block_size < HUFB_MIN_BLOCK_SIZE ||
+			s->opts.block_size > HUFB_MAX_BLOCK_SIZE)
+	{
+		free(s);
+		return HUFF_INVALIDARG;
+	}
+	s->state      = STREAM_BLOCK;
+	s->block_size = s->opts.block_size;
+
+	s->block = malloc(s->block_size);
+	s->work  = malloc(BLOCK_WORK_SIZE(s->block_size));
+	if (s->block == NULL || s->work == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(s->block);
+		free(s->work);
+		free(s);
+		return HUFF_NOMEM;
+	}
+
+	fmemopen_stat(&s->coded,NULL,0);
+	rc = _write_file_header(&s->coded,s->block_size,
+			s->opts.index ? HUFB_FLAG_INDEX : 0);
+	s->offset = s->coded.buffer_usage;
+	if (rc != HUFF_SUCCESS)
+	{
+		huffman_stream_end(s);
+		return rc;
+	}
+
+	*stream = s;
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR unhuffman_stream_init(HuffStream **stream)
+{
+	HuffStream *s;
+
+	/* Validate the inputs */
+	if (stream == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	s = calloc(1,sizeof(HuffStream));
+	if (s == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+	s->decoder = true;
+	s->state   = STREAM_MAGIC;
+	fmemopen_stat(&s->coded,NULL,0);
+
+	s->in = malloc(STREAM_BUF_SIZE);
+	if (s->in == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		huffman_stream_end(s);
+		return HUFF_NOMEM;
+	}
+	s->in_size = STREAM_BUF_SIZE;
+
+	*stream = s;
+	return HUFF_SUCCESS;
+}
+
+/* Once the coded output has all been pulled, code the input collected  *
+ * so far as a block if the block is full or a flush asked for it, or   *
+ * end the stream after the last block.                                 */
+static HUFF_ERR _stream_encode(HuffStream *s)
+{
+	size_t size;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	if (s->coded_pos < s->coded.buffer_usage || s->state == STREAM_END)
+	{
+		return HUFF_SUCCESS;
+	}
+	/* The buffer of the coded output is kept for the next block */
+	freset_stat(&s->coded);
+	s->coded_pos = 0;
+
+	if (s->adaptive != NULL)
+	{
+		/* The input has been coded as it was pushed */
+		if (s->finish || s->flush)
+		{
+			size = huffman_adaptive_mark(s->adaptive,
+					s->finish ? HUFA_END : HUFA_FLUSH,s->work);
+			if (fwrite_stat(s->work,1,size,&s->coded) != size)
+			{
+				rc = HUFF_NOMEM;
+			}
+			s->state = s->finish ? STREAM_END : s->state;
+			s->flush = false;
+			s->unflushed = false;
+		}
+		return rc;
+	}
+
+	if (s->block_len == s->block_size ||
+			((s->flush || s->finish) && s->block_len > 0))
+	{
+		rc = _encode_block(s->block,s->block_len,s->work,&size,&s->opts,
+				s->opts.stats);
+		if (rc == HUFF_SUCCESS)
+		{
+			rc = _write_block(s->work,size,&s->coded,s->opts.stats);
+		}
+		if (rc == HUFF_SUCCESS && s->opts.index)
+		{
+			rc = _index_add(&s->index,s->offset,
+					s->coded.buffer_usage,s->block_len);
+		}
+		s->block_len = 0;
+	}
+	else if (s->finish)
+	{
+		rc = _write_block_header(&s->coded,HUFB_END,0,0);
+		if (rc == HUFF_SUCCESS && s->opts.index)
+		{
+			rc = _write_index(&s->index,
+					s->offset + HUFB_BLOCK_HEADER_SIZE,&s->coded);
+		}
+		s->state = STREAM_END;
+	}
+	s->offset += s->coded.buffer_usage;
+
+	if (s->block_len == 0)
+	{
+		s->flush = false;
+	}
+	return rc;
+}
+
+/* Move the input not yet decoded to the start of the input buffer */
+static void _stream_compact(HuffStream *s)
+{
+	if (s->in_start > 0)
+	{
+		memmove(s->in,s->in + s->in_start,s->in_len - s->in_start);
+		s->in_len  -= s->in_start;
+		s->in_start = 0;
+	}
+}
+
+/* Nothing more can be decoded until more input arrives, which is an   *
+ * error once the input has finished.                                  */
+static HUFF_ERR _stream_wait(HuffStream *s, bool *progress)
+{
+	*progress = false;
+	return s->finish ? HUFF_CORRUPT : HUFF_SUCCESS;
+}
+
+/* Take one step through the input of a stream decoder, writing up to   *
+ * `cap' bytes to `out'. The number of bytes written is returned through *
+ * `n', and `progress' is set to false when nothing more can be done     *
+ * without more input.                                                   */
+static HUFF_ERR _stream_decode(HuffStream *s, uint8_t *out, size_t cap,
+		size_t *n, bool *progress)
+{
+	uint8_t lengths[HUFF_SYMBOLS];
+	const uint8_t *data = s->in + s->in_start;
+	size_t avail = s->in_len - s->in_start;
+	size_t raw_len, comp_len, used, nbits, pos;
+	uint8_t *tmp;
+	HUFF_ERR rc;
+
+	*n = 0;
+	*progress = true;
+
+	switch (s->state)
+	{
+	case STREAM_MAGIC:
+		if (avail < 4)
+		{
+			return _stream_wait(s,progress);
+		}
+		if (memcmp(data,HUFB_MAGIC,4) == 0)
+		{
+			s->state = STREAM_FILE_HEADER;
+		}
+		else if (memcmp(data,HUFF_MAGIC,4) == 0)
+		{
+			s->in_start += 4;
+			s->state = STREAM_LENGTHS;
+		}
+		else if (memcmp(data,HUFC_MAGIC,4) == 0)
+		{
+			/* The stream decoder takes no codebook */
+			return HUFF_CODEBOOK;
+		}
+		else if (memcmp(data,HUFA_MAGIC,4) == 0)
+		{
+			s->adaptive = malloc(sizeof(HuffAdaptive));
+			if (s->adaptive == NULL)
+			{
+				/* Out of memory */
+				perror("Unable to allocate memory");
+				return HUFF_NOMEM;
+			}
+			huffman_adaptive_init(s->adaptive);
+			s->in_start += 4;
+			s->state = STREAM_ADAPTIVE;
+		}
+		else
+		{
+			return HUFF_INVALIDHEADER;
+		}
+		return HUFF_SUCCESS;
+
+	case STREAM_FILE_HEADER:
+		if (avail < HUFB_HEADER_SIZE)
+		{
+			return _stream_wait(s,progress);
+		}
+		if (_check_file_header(&s->block_size,data) != HUFF_SUCCESS)
+		{
+			return HUFF_INVALIDHEADER;
+		}
+		s->block = malloc(s->block_size);
+		if (s->block == NULL)
+		{
+			/* Out of memory */
+			perror("Unable to allocate memory");
+			return HUFF_NOMEM;
+		}
+		s->in_start += HUFB_HEADER_SIZE;
+		s->state = STREAM_BLOCK;
+		return HUFF_SUCCESS;
+
+	case STREAM_BLOCK:
+		if (s->block_pos < s->block_len)
+		{
+			*n = s->block_len - s->block_pos;
+			if (*n > cap)
+			{
+				*n = cap;
+			}
+			memcpy(out,s->block + s->block_pos,*n);
+			s->block_pos += *n;
+			return HUFF_SUCCESS;
+		}
+		if (avail < HUFB_BLOCK_HEADER_SIZE)
+		{
+			return _stream_wait(s,progress);
+		}
+		if (data[0] == HUFB_END)
+		{
+			/* Any index after the end block is not needed */
+			s->in_start += HUFB_BLOCK_HEADER_SIZE;
+			s->state = STREAM_END;
+			return HUFF_SUCCESS;
+		}
+
+		raw_len  = huff_get_u32(data+4);
+		comp_len = huff_get_u32(data+8);
+		if (raw_len == 0 || raw_len > s->block_size ||
+				comp_len > STREAM_PAYLOAD_MAX(s->block_size))
+		{
+			return HUFF_CORRUPT;
+		}
+		if (avail - HUFB_BLOCK_HEADER_SIZE < comp_len)
+		{
+			/* Make room for the whole block */
+			_stream_compact(s);
+			if (s->in_size < HUFB_BLOCK_HEADER_SIZE + comp_len)
+			{
+				tmp = realloc(s->in,HUFB_BLOCK_HEADER_SIZE + comp_len);
+				if (tmp == NULL)
+				{
+					/* Out of memory */
+					perror("Unable to allocate memory");
+					return HUFF_NOMEM;
+				}
+				s->in      = tmp;
+				s->in_size = HUFB_BLOCK_HEADER_SIZE + comp_len;
+			}
+			return _stream_wait(s,progress);
+		}
+
+		rc = _decode_block(data,data + HUFB_BLOCK_HEADER_SIZE,
+				comp_len,s->block,raw_len,&s->ctx,NULL);
+		if (rc != HUFF_SUCCESS)
+		{
+			return rc;
+		}
+		s->in_start += HUFB_BLOCK_HEADER_SIZE + comp_len;
+		s->block_len = raw_len;
+		s->block_pos = 0;
+		return HUFF_SUCCESS;
+
+	case STREAM_LENGTHS:
+		rc = _parse_lengths(lengths,data,avail,&used);
+		if (rc != HUFF_SUCCESS)
+		{
+			/* Possibly only part of the lengths so far */
+			return (avail < LENGTHS_MAX_READ) ?
+				_stream_wait(s,progress) : rc;
+		}
+		rc = _get_decode_table(s->table,lengths);
+		if (rc != HUFF_SUCCESS)
+		{
+			return rc;
+		}
+		s->in_start += used;
+		s->in_bit = 0;
+		s->state = STREAM_CODES;
+		return HUFF_SUCCESS;
+
+	case STREAM_CODES:
+		/* Until the end of the input is known only the codes which *
+		 * end before the bytes held back can be decoded            */
+		if (s->finish)
+		{
+			rc = _stream_bits(&nbits,data,avail);
+			if (rc != HUFF_SUCCESS)
+			{
+				return rc;
+			}
+		}
+		else
+		{
+			nbits = (avail > STREAM_HOLD) ?
+				(avail - STREAM_HOLD)*CHAR_BIT : 0;
+		}
+
+		pos = s->in_bit;
+		if (s->finish && pos >= nbits)
+		{
+			if (pos > nbits)
+			{
+				return HUFF_CORRUPT;
+			}
+			s->in_start = s->in_len;
+			s->state = STREAM_END;
+			return HUFF_SUCCESS;
+		}
+		if (pos >= nbits)
+		{
+			return _stream_wait(s,progress);
+		}
+
+		rc = _decode_symbols(s->table,data,avail,nbits,&pos,out,cap,n);
+		s->in_start += pos >> 3;
+		s->in_bit    = pos & 7;
+		if (rc == HUFF_SUCCESS && *n == 0)
+		{
+			/* The next code runs into the bytes held back */
+			return _stream_wait(s,progress);
+		}
+		return rc;
+
+	case STREAM_ADAPTIVE:
+		rc = huffman_adaptive_decode(s->adaptive,data,avail,&used,
+				out,cap,n);
+		s->in_start += used;
+		if (rc != HUFF_SUCCESS)
+		{
+			return rc;
+		}
+		if (s->adaptive->done)
+		{
+			/* Anything after the end of the stream is skipped */
+			s->in_start = s->in_len;
+			s->state = STREAM_END;
+		}
+		else if (used == 0 && *n == 0)
+		{
+			return _stream_wait(s,progress);
+		}
+		return HUFF_SUCCESS;
+
+	case STREAM_END:
+	default:
+		*progress = false;
+		return HUFF_SUCCESS;
+	}
+}
+
+HUFF_ERR huffman_stream_push(HuffStream *s, const void *data, size_t len,
+		size_t *used)
+{
+	const uint8_t *p = data;
+	size_t n, size;
+
+	/* Validate the inputs */
+	if (s == NULL || (data == NULL && len > 0) || used == NULL || s->finish)
+	{
+		return HUFF_INVALIDARG;
+	}
+	*used = 0;
+	if (s->rc != HUFF_SUCCESS)
+	{
+		return s->rc;
+	}
+
+	if (s->decoder)
+	{
+		if (s->state == STREAM_END)
+		{
+			/* Anything after the end of the stream is skipped */
+			*used = len;
+			return HUFF_SUCCESS;
+		}
+		if (s->in_size - s->in_len < len)
+		{
+			_stream_compact(s);
+		}
+		n = s->in_size - s->in_len;
+		*used = (len < n) ? len : n;
+		memcpy(s->in + s->in_len,p,*used);
+		s->in_len += *used;
+		return HUFF_SUCCESS;
+	}
+
+	if (s->adaptive != NULL)
+	{
+		/* Code the input straight away, while less than a buffer of *
+		 * coded output is waiting to be pulled                      */
+		while (len > 0 && s->state == STREAM_ADAPTIVE &&
+			s->coded.buffer_usage - s->coded_pos < STREAM_BUF_SIZE)
+		{
+			if (s->coded_pos == s->coded.buffer_usage)
+			{
+				freset_stat(&s->coded);
+				s->coded_pos = 0;
+			}
+			n = (len < ENCODE_PIECE) ? len : ENCODE_PIECE;
+			size = huffman_adaptive_encode(s->adaptive,p,n,s->work);
+			if (fwrite_stat(s->work,1,size,&s->coded) != size)
+			{
+				s->rc = HUFF_NOMEM;
+				return s->rc;
+			}
+			s->unflushed = true;
+			p     += n;
+			len   -= n;
+			*used += n;
+		}
+		if (s->opts.stats != NULL)
+		{
+			s->opts.stats->in_bytes += *used;
+		}
+		return HUFF_SUCCESS;
+	}
+
+	/* Fill the block, coding it once it is full if there is room for *
+	 * the coded output                                                */
+	while (len > 0)
+	{
+		if (s->block_len == s->block_size)
+		{
+			if (s->coded_pos < s->coded.buffer_usage)
+			{
+				break;
+			}
+			s->rc = _stream_encode(s);
+			if (s->rc != HUFF_SUCCESS)
+			{
+				return s->rc;
+			}
+			continue;
+		}
+		n = s->block_size - s->block_len;
+		if (n > len)
+		{
+			n = len;
+		}
+		memcpy(s->block + s->block_len,p,n);
+		s->block_len += n;
+		p     += n;
+		len   -= n;
+		*used += n;
+	}
+	if (s->opts.stats != NULL)
+	{
+		s->opts.stats->in_bytes += *used;
+	}
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR huffman_stream_pull(HuffStream *s, void *buf, size_t cap,
+		size_t *len)
+{
+	uint8_t *out = buf;
+	size_t n;
+	bool progress = true;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	/* Validate the inputs */
+	if (s == NULL || (buf == NULL && cap > 0) || len == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+	*len = 0;
+	if (s->rc != HUFF_SUCCESS)
+	{
+		return s->rc;
+	}
+
+	while (rc == HUFF_SUCCESS && progress && *len < cap)
+	{
+		if (s->decoder)
+		{
+			rc = _stream_decode(s,out + *len,cap - *len,&n,&progress);
+		}
+		else if (s->coded_pos < s->coded.buffer_usage)
+		{
+			n = s->coded.buffer_usage - s->coded_pos;
+			if (n > cap - *len)
+			{
+				n = cap - *len;
+			}
+			memcpy(out + *len,(uint8_t *)s->coded.buffer + s->coded_pos,n);
+			s->coded_pos += n;
+		}
+		else
+		{
+			n = 0;
+			rc = _stream_encode(s);
+			progress = s->coded_pos < s->coded.buffer_usage;
+		}
+		*len += n;
+	}
+	if (!s->decoder && s->opts.stats != NULL)
+	{
+		s->opts.stats->out_bytes += *len;
+	}
+
+	s->rc = rc;
+	return rc;
+}
+
+HUFF_ERR huffman_stream_flush(HuffStream *s)
+{
+	/* Validate the inputs */
+	if (s == NULL || s->decoder)
+	{
+		return HUFF_INVALIDARG;
+	}
+	s->flush = s->block_len > 0 || s->unflushed;
+	return s->rc;
+}
+
+HUFF_ERR huffman_stream_finish(HuffStream *s)
+{
+	/* Validate the inputs */
+	if (s == NULL)
+	{
+		return HUFF_INVALIDARG;
+	}
+	s->finish = true;
+	return s->rc;
+}
+
+bool huffman_stream_done(const HuffStream *s)
+{
+	if (s == NULL || s->state != STREAM_END)
+	{
+		return false;
+	}
+	return s->decoder ? s->block_pos == s->block_len :
+		s->coded_pos == s->coded.buffer_usage;
+}
+
+void huffman_stream_end(HuffStream *s)
+{
+	if (s == NULL)
+	{
+		return;
+	}
+	fclose_stat(&s->coded);
+	free(s->adaptive);
+	free(s->index.entries);
+	free(s->block);
+	free(s->work);
+	free(s->in);
+	free(s->ctx);
+	free(s);
+}
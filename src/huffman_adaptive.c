@@ -0,0 +1,329 @@
+/* Implements the adaptive huffman coder declared in huffman_adaptive.h
+ *
+ * After a symbol has been coded the weights of its leaf and of every node
+ * above it go up by one. Before a node's weight goes up it is swapped with
+ * the highest numbered node of the same weight, unless that is its parent,
+ * which keeps the nodes in order of weight, and so keeps the tree a
+ * huffman tree for the counts so far. A swap exchanges the subtrees hung
+ * from two node numbers, leaving the numbers where they are.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman_adaptive.h"
+
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+/* Number of the root node */
+#define HUFA_ROOT (HUFA_NODES-1)
+
+void huffman_adaptive_init(HuffAdaptive *a)
+{
+	assert(a != NULL);
+
+	memset(a,0,sizeof(HuffAdaptive));
+	memset(a->leaf,0xff,sizeof(a->leaf));
+
+	/* The tree starts as the escape leaf alone */
+	a->escape = HUFA_ROOT;
+	a->node   = HUFA_ROOT;
+	a->parent[HUFA_ROOT]   = HUFF_NO_NODE;
+	a->child[HUFA_ROOT][0] = HUFF_NO_NODE;
+	a->child[HUFA_ROOT][1] = HUFF_NO_NODE;
+}
+
+/* Point the children of node `n', or the leaf table for a leaf, back  *
+ * at `n' after a swap has moved them there.                           */
+static inline void _adopt(HuffAdaptive *a, unsigned int n)
+{
+	if (a->child[n][0] != HUFF_NO_NODE)
+	{
+		a->parent[a->child[n][0]] = n;
+		a->parent[a->child[n][1]] = n;
+	}
+	else if (n != a->escape)
+	{
+		a->leaf[a->symbol[n]] = n;
+	}
+}
+
+/* Exchange the subtrees hung from nodes `x' and `y' */
+static inline void _swap(HuffAdaptive *a, unsigned int x, unsigned int y)
+{
+	uint16_t left  = a->child[x][0];
+	uint16_t right = a->child[x][1];
+	uint16_t sym   = a->symbol[x];
+
+	a->child[x][0] = a->child[y][0];
+	a->child[x][1] = a->child[y][1];
+	a->symbol[x]   = a->symbol[y];
+	a->child[y][0] = left;
+	a->child[y][1] = right;
+	a->symbol[y]   = sym;
+
+	_adopt(a,x);
+	_adopt(a,y);
+}
+
+/* Count one more of `sym', giving it a leaf split off the escape leaf  *
+ * the first time it is seen.                                          */
+static void _update(HuffAdaptive *a, unsigned int sym)
+{
+	unsigned int q = a->leaf[sym], e, leader;
+
+	if (q == HUFF_NO_NODE)
+	{
+		/* The escape leaf becomes the parent of a new escape leaf *
+		 * and of the leaf for the symbol                          */
+		e = a->escape;
+		a->child[e][0] = e - 2;
+		a->child[e][1] = e - 1;
+		a->parent[e-2] = e;
+		a->parent[e-1] = e;
+		a->child[e-2][0] = a->child[e-2][1] = HUFF_NO_NODE;
+		a->child[e-1][0] = a->child[e-1][1] = HUFF_NO_NODE;
+		a->symbol[e-1] = sym;
+		a->leaf[sym]   = e - 1;
+		a->escape      = e - 2;
+		q = e - 1;
+	}
+
+	for (;;)
+	{
+		/* Highest numbered node with the same weight */
+		leader = q;
+		while (leader < HUFA_ROOT && a->weight[leader+1] == a->weight[q])
+		{
+			leader++;
+		}
+		if (leader != q && leader != a->parent[q])
+		{
+			_swap(a,q,leader);
+			q = leader;
+		}
+		a->weight[q]++;
+		if (q == HUFA_ROOT)
+		{
+			break;
+		}
+		q = a->parent[q];
+	}
+}
+
+/* Append the `len' low bits of `bits', up to 64 */
+static inline void _put_bits(BitWriter *w, uint64_t bits, unsigned int len)
+{
+	if (len > 32)
+	{
+		bw_put(w,bits >> 32,len - 32);
+		bw_flush(w);
+		bits &= 0xffffffff;
+		len = 32;
+	}
+	if (len > 0)
+	{
+		bw_put(w,bits,len);
+		bw_flush(w);
+	}
+}
+
+/* Write the code of the node `node', the path to it from the root.    *
+ * Returns the length of the code.                                     */
+static inline unsigned int _put_code(HuffAdaptive *a, BitWriter *w,
+		unsigned int node)
+{
+	uint64_t low = 0, high = 0;
+	unsigned int len = 0, p;
+
+	/* The path is followed from the leaf up, last bit first */
+	while (node != HUFA_ROOT)
+	{
+		p = a->parent[node];
+		if (a->child[p][1] == node)
+		{
+			if (len < 64)
+			{
+				low  |= (uint64_t)1 << len;
+			}
+			else
+			{
+				high |= (uint64_t)1 << (len - 64);
+			}
+		}
+		len++;
+		node = p;
+	}
+
+	if (len > 64)
+	{
+		_put_bits(w,high,len - 64);
+	}
+	_put_bits(w,low,(len > 64) ? 64 : len);
+	return len;
+}
+
+/* Write the escape followed by `value' */
+static inline void _put_escape(HuffAdaptive *a, BitWriter *w,
+		unsigned int value)
+{
+	unsigned int len = _put_code(a,w,a->escape) + HUFA_RAW_BITS;
+
+	bw_put(w,value,HUFA_RAW_BITS);
+	bw_flush(w);
+	if (len > a->max_len)
+	{
+		a->max_len = len;
+	}
+}
+
+size_t huffman_adaptive_encode(HuffAdaptive *a, const uint8_t *in,
+		size_t len, uint8_t *out)
+{
+	assert(a != NULL);
+	assert(in != NULL || len == 0);
+	assert(out != NULL);
+
+	BitWriter w = { .acc = a->acc, .count = a->count, .ptr = out };
+	unsigned int n;
+	size_t i;
+
+	for (i=0; i<len; i++)
+	{
+		if (a->leaf[in[i]] == HUFF_NO_NODE)
+		{
+			_put_escape(a,&w,in[i]);
+		}
+		else
+		{
+			n = _put_code(a,&w,a->leaf[in[i]]);
+			if (n > a->max_len)
+			{
+				a->max_len = n;
+			}
+		}
+		_update(a,in[i]);
+	}
+
+	a->acc   = w.acc;
+	a->count = w.count;
+	return w.ptr - out;
+}
+
+size_t huffman_adaptive_mark(HuffAdaptive *a, unsigned int mark,
+		uint8_t *out)
+{
+	assert(a != NULL);
+	assert(mark == HUFA_FLUSH || mark == HUFA_END);
+	assert(out != NULL);
+
+	BitWriter w = { .acc = a->acc, .count = a->count, .ptr = out };
+
+	_put_escape(a,&w,mark);
+	bw_finish(&w);
+
+	a->acc   = 0;
+	a->count = 0;
+	return w.ptr - out;
+}
+
+HUFF_ERR huffman_adaptive_decode(HuffAdaptive *a, const uint8_t *in,
+		size_t len, size_t *used, uint8_t *out, size_t cap,
+		size_t *written)
+{
+	assert(a != NULL);
+	assert(in != NULL || len == 0);
+	assert(used != NULL);
+	assert(out != NULL || cap == 0);
+	assert(written != NULL);
+
+	unsigned int node = a->node, bit, value;
+	size_t i = 0, o = 0;
+	HUFF_ERR rc = HUFF_SUCCESS;
+
+	while (!a->done)
+	{
+		if (node == a->escape && a->raw_bits == HUFA_RAW_BITS)
+		{
+			value = a->raw;
+			if (value < HUFF_SYMBOLS && o == cap)
+			{
+				break;
+			}
+			if (a->depth + HUFA_RAW_BITS > a->max_len)
+			{
+				a->max_len = a->depth + HUFA_RAW_BITS;
+			}
+			a->raw      = 0;
+			a->raw_bits = 0;
+			a->depth    = 0;
+			node = HUFA_ROOT;
+
+			if (value < HUFF_SYMBOLS && a->leaf[value] == HUFF_NO_NODE)
+			{
+				out[o++] = value;
+				_update(a,value);
+			}
+			else if (value == HUFA_FLUSH)
+			{
+				/* The rest of the byte is padding */
+				a->bits = 0;
+			}
+			else if (value == HUFA_END)
+			{
+				a->bits = 0;
+				a->done = true;
+			}
+			else
+			{
+				/* An escape for a symbol already seen */
+				rc = HUFF_CORRUPT;
+				break;
+			}
+			continue;
+		}
+		if (node != a->escape && a->child[node][0] == HUFF_NO_NODE)
+		{
+			if (o == cap)
+			{
+				break;
+			}
+			if (a->depth > a->max_len)
+			{
+				a->max_len = a->depth;
+			}
+			out[o++] = a->symbol[node];
+			_update(a,a->symbol[node]);
+			a->depth = 0;
+			node = HUFA_ROOT;
+			continue;
+		}
+
+		if (a->bits == 0)
+		{
+			if (i == len)
+			{
+				break;
+			}
+			a->byte = in[i++];
+			a->bits = CHAR_BIT;
+		}
+		bit = (a->byte >> --a->bits) & 1;
+		if (node == a->escape)
+		{
+			a->raw = (a->raw << 1) | bit;
+			a->raw_bits++;
+		}
+		else
+		{
+			node = a->child[node][bit];
+			a->depth++;
+		}
+	}
+
+	a->node  = node;
+	*used    = i;
+	*written = o;
+	return rc;
+}
@@ -0,0 +1,220 @@
+/* Implements the CRC-32C checksum declared in huffman_crc.h
+ *
+ * On x86-64 processors with SSE4.2 the crc32 instruction adds eight bytes
+ * to the checksum at a time. Each instruction has to wait for the one
+ * before it, so three pieces of the input are checksummed side by side
+ * and their checksums combined, the checksum of the first two pieces
+ * being moved past the bytes of the next with a table of the effect of
+ * appending that many zero bytes. Elsewhere the
+ * checksum is worked out eight bytes at a time with eight tables, one for
+ * each byte of the word, whose lookups do not depend on each other
+ * (slicing-by-8). The tables are built, and the processor checked, the
+ * first time a checksum is asked for.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman_crc.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+/* The CRC-32C polynomial, bit reversed */
+#define CRC32C_POLY 0x82f63b78
+
+/* Lengths of the pieces checksummed side by side, powers of two */
+#define CRC_LONG  8192
+#define CRC_SHORT 256
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_long[4][256];	/* Append CRC_LONG zero bytes */
+static uint32_t crc_short[4][256];	/* Append CRC_SHORT zero bytes */
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_update)(uint32_t crc, const uint8_t *p, size_t len);
+
+/* Add `len' bytes to the checksum a table lookup per byte at a time, *
+ * eight lookups for eight bytes at once.                             */
+static uint32_t _crc_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len >= 8)
+	{
+		crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = crc_table[7][crc & 0xff] ^
+			crc_table[6][(crc >> 8) & 0xff] ^
+			crc_table[5][(crc >> 16) & 0xff] ^
+			crc_table[4][crc >> 24] ^
+			crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+			crc_table[1][p[6]] ^ crc_table[0][p[7]];
+		p   += 8;
+		len -= 8;
+	}
+	while (len > 0)
+	{
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	return crc;
+}
+
+/* Multiply the 32x32 bit matrix `mat' by the vector `vec' */
+static uint32_t _gf2_times(const uint32_t mat[32], uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec != 0)
+	{
+		if (vec & 1)
+		{
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+/* Fill `table' with the effect on a checksum of appending `len' zero   *
+ * bytes, a power of two, looked up a byte of the checksum at a time.   *
+ * The matrix of one zero bit is squared until it covers `len' bytes.   */
+static void _crc_zeros(uint32_t table[4][256], size_t len)
+{
+	uint32_t op[32], sq[32];
+	size_t bits;
+	unsigned int i, k;
+
+	op[0] = CRC32C_POLY;
+	for (i=1; i<32; i++)
+	{
+		op[i] = (uint32_t)1 << (i - 1);
+	}
+	for (bits=1; bits<8*len; bits*=2)
+	{
+		for (i=0; i<32; i++)
+		{
+			sq[i] = _gf2_times(op,op[i]);
+		}
+		memcpy(op,sq,sizeof(op));
+	}
+
+	for (i=0; i<256; i++)
+	{
+		for (k=0; k<4; k++)
+		{
+			table[k][i] = _gf2_times(op,(uint32_t)i << 8*k);
+		}
+	}
+}
+
+/* Move the checksum `crc' past the zero bytes of `table' */
+static inline uint32_t _crc_shift(const uint32_t table[4][256], uint32_t crc)
+{
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+		table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#ifdef CRC_SSE42
+/* Checksum three pieces of `len' bytes from `*p' side by side and     *
+ * combine them into `crc', moving `*p' past them                      */
+__attribute__((target("sse4.2")))
+static inline uint32_t _crc_sse42_3(uint32_t crc, const uint8_t **p,
+		size_t len, const uint32_t shift[4][256])
+{
+	const uint8_t *q = *p, *end = *p + len;
+	uint64_t c0 = crc, c1 = 0, c2 = 0, w0, w1, w2;
+
+	while (q < end)
+	{
+		memcpy(&w0,q,sizeof(w0));
+		memcpy(&w1,q+len,sizeof(w1));
+		memcpy(&w2,q+2*len,sizeof(w2));
+		c0 = _mm_crc32_u64(c0,w0);
+		c1 = _mm_crc32_u64(c1,w1);
+		c2 = _mm_crc32_u64(c2,w2);
+		q += 8;
+	}
+	*p += 3*len;
+	crc = _crc_shift(shift,c0) ^ c1;
+	return _crc_shift(shift,crc) ^ c2;
+}
+
+/* Add `len' bytes to the checksum with the SSE4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t _crc_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c, w;
+
+	while (len >= 3*CRC_LONG)
+	{
+		crc = _crc_sse42_3(crc,&p,CRC_LONG,crc_long);
+		len -= 3*CRC_LONG;
+	}
+	while (len >= 3*CRC_SHORT)
+	{
+		crc = _crc_sse42_3(crc,&p,CRC_SHORT,crc_short);
+		len -= 3*CRC_SHORT;
+	}
+
+	c = crc;
+	while (len >= 8)
+	{
+		memcpy(&w,p,sizeof(w));
+		c = _mm_crc32_u64(c,w);
+		p   += 8;
+		len -= 8;
+	}
+	crc = c;
+	while (len > 0)
+	{
+		crc = _mm_crc32_u8(crc,*p++);
+		len--;
+	}
+	return crc;
+}
+#endif /* CRC_SSE42 */
+
+/* Build the tables and pick how the checksum is worked out */
+static void _crc_init(void)
+{
+	uint32_t crc;
+	unsigned int i, j;
+
+	for (i=0; i<256; i++)
+	{
+		crc = i;
+		for (j=0; j<8; j++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		}
+		crc_table[0][i] = crc;
+	}
+	for (i=0; i<256; i++)
+	{
+		for (j=1; j<8; j++)
+		{
+			crc_table[j][i] = crc_table[0][crc_table[j-1][i] & 0xff] ^
+				(crc_table[j-1][i] >> 8);
+		}
+	}
+
+	crc_update = _crc_slice8;
+#ifdef CRC_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		_crc_zeros(crc_long,CRC_LONG);
+		_crc_zeros(crc_short,CRC_SHORT);
+		crc_update = _crc_sse42;
+	}
+#endif /* CRC_SSE42 */
+}
+
+uint32_t huffman_crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc_once,_crc_init);
+	return ~crc_update(~crc,data,len);
+}
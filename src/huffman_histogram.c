@@ -0,0 +1,129 @@
+/* Implements the byte histogram declared in huffman_histogram.h
+ *
+ * Counting a byte is a load, an increment and a store to a small table.
+ * When the same byte value turns up again straight away the next
+ * increment has to wait for the previous store to complete, so the counts
+ * are spread over several interleaved sub-tables which are summed at the
+ * end. Input is read a 64 bit word at a time, and 16 byte runs of a single
+ * value are counted with one comparison and one addition. The counts by
+ * previous byte are kept in a table too large to repeat, and are counted
+ * a byte at a time.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman_histogram.h"
+
+#include <string.h>
+#include <assert.h>
+
+/* Number of interleaved sub-tables */
+#define HIST_TABLES 4
+
+/* Largest number of bytes counted before the 32 bit sub-table counters *
+ * are folded into the 64 bit totals, so they can never overflow.       */
+#define HIST_CHUNK ((size_t)1 << 30)
+
+/* Every byte of a 64 bit word set to 0x01 */
+#define HIST_BYTES_ONE 0x0101010101010101ULL
+
+/* Read a 64 bit word from a possibly unaligned address */
+static inline uint64_t _load_word(const uint8_t *p)
+{
+	uint64_t w;
+	memcpy(&w,p,sizeof(w));
+	return w;
+}
+
+/* Count the bytes in a single word. The order the bytes are extracted in *
+ * depends on the machine byte order but that does not affect the counts.*/
+#define HIST_COUNT_WORD(t,w) do {                   \
+		t[0][(uint8_t)((w)      )]++;       \
+		t[1][(uint8_t)((w) >>  8)]++;       \
+		t[2][(uint8_t)((w) >> 16)]++;       \
+		t[3][(uint8_t)((w) >> 24)]++;       \
+		t[0][(uint8_t)((w) >> 32)]++;       \
+		t[1][(uint8_t)((w) >> 40)]++;       \
+		t[2][(uint8_t)((w) >> 48)]++;       \
+		t[3][(uint8_t)((w) >> 56)]++;       \
+	} while (0)
+
+/* Count at most HIST_CHUNK bytes into the sub-tables */
+static void _histogram_chunk(uint32_t t[HIST_TABLES][HUFF_SYMBOLS],
+		const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint64_t w0, w1, fill;
+
+	while (end - p >= 16)
+	{
+		w0 = _load_word(p);
+		w1 = _load_word(p+8);
+
+		/* A run of one byte value, such as zero padding, is counted *
+		 * in a single step.                                         */
+		fill = (w0 & 0xff) * HIST_BYTES_ONE;
+		if (w0 == fill && w1 == fill)
+		{
+			t[0][w0 & 0xff] += 16;
+		}
+		else
+		{
+			HIST_COUNT_WORD(t,w0);
+			HIST_COUNT_WORD(t,w1);
+		}
+		p += 16;
+	}
+
+	while (p < end)
+	{
+		t[0][*p]++;
+		p++;
+	}
+}
+
+void huffman_histogram(uint64_t counts[HUFF_SYMBOLS], const uint8_t *data,
+		size_t len)
+{
+	assert(counts != NULL);
+	assert(data != NULL || len == 0);
+
+	uint32_t t[HIST_TABLES][HUFF_SYMBOLS];
+	size_t n;
+	int i, j;
+
+	while (len > 0)
+	{
+		n = (len < HIST_CHUNK) ? len : HIST_CHUNK;
+
+		memset(t,0,sizeof(t));
+		_histogram_chunk(t,data,n);
+
+		for (i=0; i<HUFF_SYMBOLS; i++)
+		{
+			for (j=0; j<HIST_TABLES; j++)
+			{
+				counts[i] += t[j][i];
+			}
+		}
+
+		data += n;
+		len  -= n;
+	}
+}
+
+void huffman_histogram_order1(uint32_t counts[HUFF_SYMBOLS][HUFF_SYMBOLS],
+		const uint8_t *data, size_t len)
+{
+	assert(counts != NULL);
+	assert(data != NULL || len == 0);
+
+	const uint8_t *end = data + len;
+	uint8_t prev = 0;
+
+	while (data < end)
+	{
+		counts[prev][*data]++;
+		prev = *data++;
+	}
+}
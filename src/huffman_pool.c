@@ -0,0 +1,168 @@
+/* Implements the thread pool declared in huffman_pool.h
+ *
+ * The jobs of a run are handed out from a shared counter, so a thread
+ * which finishes a short job goes straight on to the next one. The thread
+ * which starts a run takes jobs as well and returns once the last job has
+ * finished, leaving the workers waiting for the next run.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <assert.h>
+
+struct huff_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  work;		/* Signalled when a run starts */
+	pthread_cond_t  done;		/* Signalled when a run finishes */
+	pthread_t      *workers;
+	unsigned int    nworkers;
+	huff_job_fn     fn;		/* Job function of the current run */
+	void           *arg;
+	size_t          njobs;
+	size_t          next;		/* Next job to hand out */
+	size_t          finished;	/* Number of jobs finished */
+	bool            shutdown;
+};
+
+/* Run jobs from the current run until there are none left. Called and *
+ * returns with the pool locked.                                       */
+static void _run_jobs(HuffPool *pool)
+{
+	size_t job;
+
+	while (pool->next < pool->njobs)
+	{
+		job = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->fn(pool->arg,job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->finished == pool->njobs)
+		{
+			pthread_cond_signal(&pool->done);
+		}
+	}
+}
+
+static void *_worker(void *arg)
+{
+	HuffPool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->shutdown)
+	{
+		_run_jobs(pool);
+		if (!pool->shutdown)
+		{
+			pthread_cond_wait(&pool->work,&pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+HUFF_ERR huffman_pool_create(HuffPool **pool, unsigned int threads)
+{
+	assert(pool != NULL);
+
+	HuffPool *p;
+
+	if (threads == 0 || threads > HUFF_MAX_THREADS)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	p = calloc(1,sizeof(HuffPool));
+	if (p == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		return HUFF_NOMEM;
+	}
+	p->workers = calloc(threads,sizeof(pthread_t));
+	if (p->workers == NULL)
+	{
+		/* Out of memory */
+		perror("Unable to allocate memory");
+		free(p);
+		return HUFF_NOMEM;
+	}
+	pthread_mutex_init(&p->lock,NULL);
+	pthread_cond_init(&p->work,NULL);
+	pthread_cond_init(&p->done,NULL);
+
+	/* The calling thread is the last of the `threads' */
+	for (p->nworkers=0; p->nworkers<threads-1; p->nworkers++)
+	{
+		if (pthread_create(&p->workers[p->nworkers],NULL,_worker,p) != 0)
+		{
+			huffman_pool_destroy(p);
+			return HUFF_FAILURE;
+		}
+	}
+
+	*pool = p;
+	return HUFF_SUCCESS;
+}
+
+void huffman_pool_run(HuffPool *pool, huff_job_fn fn, void *arg,
+		size_t njobs)
+{
+	assert(pool != NULL);
+	assert(fn != NULL);
+
+	if (njobs == 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn       = fn;
+	pool->arg      = arg;
+	pool->njobs    = njobs;
+	pool->next     = 0;
+	pool->finished = 0;
+	pthread_cond_broadcast(&pool->work);
+
+	_run_jobs(pool);
+	while (pool->finished < pool->njobs)
+	{
+		pthread_cond_wait(&pool->done,&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void huffman_pool_destroy(HuffPool *pool)
+{
+	unsigned int i;
+
+	if (pool == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->nworkers; i++)
+	{
+		pthread_join(pool->workers[i],NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
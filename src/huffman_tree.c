@@ -0,0 +1,279 @@
+/* Implements the huffman tree construction declared in huffman_tree.h
+ *
+ * The leaves arrive sorted by weight, and every internal node weighs at
+ * least as much as the one created before it, so the two lightest nodes
+ * are always at the head of one of two queues: the leaves not yet merged
+ * and the internal nodes not yet merged. Both queues are ranges of the
+ * node array so no list has to be re-sorted after each merge.
+ *
+ * Code lengths are the depths of the leaves in that tree. When the tree
+ * is deeper than the length limit the lengths are worked out again with
+ * the package-merge algorithm, which gives the optimal lengths subject to
+ * the limit.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman_tree.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int _symbol_cmp (const void *s1, const void *s2)
+{
+	/* Validate the input */
+	assert(s1 != NULL && s2 != NULL);
+
+	const Symbol *_s1 = s1;
+	const Symbol *_s2 = s2;
+
+	/* Compare rather than subtract, the difference of two weights does *
+	 * not fit in an int for large inputs. Ties are broken on the symbol *
+	 * value so that the same input always gives the same tree.          */
+	if (_s1->weight != _s2->weight)
+	{
+		return (_s1->weight < _s2->weight) ? -1 : 1;
+	}
+	return (int)_s1->symbol - (int)_s2->symbol;
+}
+
+/* Sort the `n' leaves at the start of the node array by weight. The  *
+ * nodes are small enough to be sorted in place with qsort.            */
+static void _sort_leaves(Symbol *nodes, unsigned int n)
+{
+	qsort(nodes, n, sizeof (Symbol), _symbol_cmp);
+}
+
+/* Remove the lightest node at the head of either queue and return its *
+ * index. On equal weights the leaf is taken first.                    */
+static inline unsigned int _pop_lightest(const Symbol *nodes, unsigned int n,
+		unsigned int *leaf, unsigned int *internal, unsigned int next)
+{
+	if (*leaf < n && (*internal >= next ||
+			nodes[*leaf].weight <= nodes[*internal].weight))
+	{
+		return (*leaf)++;
+	}
+	assert(*internal < next);
+	return (*internal)++;
+}
+
+void huffman_build_tree(Symbol *nodes, unsigned int n)
+{
+	assert(nodes != NULL);
+	assert(n > 0 && n <= HUFF_SYMBOLS);
+
+	unsigned int leaf = 0;		/* Head of the leaf queue */
+	unsigned int internal = n;	/* Head of the internal node queue */
+	unsigned int next;		/* Next internal node to create */
+	Symbol *node;
+
+	for (next = n; next < 2*n-1; next++)
+	{
+		node = &nodes[next];
+		node->symbol = 0;
+		node->code   = false;
+
+		node->left  = _pop_lightest(nodes,n,&leaf,&internal,next);
+		node->right = _pop_lightest(nodes,n,&leaf,&internal,next);
+
+		/* Make the left/right nodes know who their parent node is */
+		nodes[node->left].parent = nodes[node->right].parent = next;
+
+		/* Give the nodes a binary code */
+		nodes[node->left].code  = false; /* 0 */
+		nodes[node->right].code = true;  /* 1 */
+
+		node->weight = nodes[node->left].weight +
+			nodes[node->right].weight;
+	}
+
+	/* The root has no parent, and leaves have no children */
+	nodes[2*n-2].parent = HUFF_NO_NODE;
+	for (leaf=0; leaf<n; leaf++)
+	{
+		nodes[leaf].left = nodes[leaf].right = HUFF_NO_NODE;
+	}
+}
+
+/* Package-merge: `leaves' holds the `n' leaf Symbols sorted by weight. *
+ * At each of `max_len' levels the items of the level below are paired  *
+ * into packages and merged with the leaves. The cheapest 2n-2 items of *
+ * the top level are selected, and every leaf gets one bit of code      *
+ * length for each level at which it is part of the selection.          */
+static void _package_merge(uint8_t lengths[HUFF_SYMBOLS], const Symbol *leaves,
+		unsigned int n, unsigned int max_len)
+{
+	/* Symbol of each item on each level, or -1 for a package */
+	int16_t item[HUFF_MAX_CODE_LEN][2*HUFF_SYMBOLS];
+	unsigned int count[HUFF_MAX_CODE_LEN];
+	uint64_t weight[2][2*HUFF_SYMBOLS];
+	uint64_t package;
+	unsigned int level, i, l, p, m, packages;
+	uint64_t *prev, *cur;
+
+	/* Bottom level is just the leaves */
+	for (i=0; i<n; i++)
+	{
+		weight[0][i] = leaves[i].weight;
+		item[0][i]   = leaves[i].symbol;
+	}
+	count[0] = n;
+
+	for (level=1; level<max_len; level++)
+	{
+		prev = weight[(level-1) & 1];
+		cur  = weight[level & 1];
+		packages = count[level-1]/2;
+
+		/* Merge the leaves with the packages of pairs from below */
+		for (i=0, l=0, p=0; l<n || p<packages; i++)
+		{
+			package = (p < packages) ? prev[2*p] + prev[2*p+1] : 0;
+			if (l < n && (p >= packages ||
+					(uint64_t)leaves[l].weight <= package))
+			{
+				cur[i] = leaves[l].weight;
+				item[level][i] = leaves[l].symbol;
+				l++;
+			}
+			else
+			{
+				cur[i] = package;
+				item[level][i] = -1;
+				p++;
+			}
+		}
+		count[level] = i;
+	}
+
+	/* Walk down from the selection at the top level. The packages in *
+	 * the first m items of a level are made from the first 2*packages *
+	 * items of the level below.                                       */
+	memset(lengths,0,HUFF_SYMBOLS);
+	m = 2*n-2;
+	for (level=max_len; level-- > 0; )
+	{
+		packages = 0;
+		for (i=0; i<m; i++)
+		{
+			if (item[level][i] < 0)
+			{
+				packages++;
+			}
+			else
+			{
+				lengths[item[level][i]]++;
+			}
+		}
+		m = 2*packages;
+	}
+}
+
+HUFF_ERR huffman_code_lengths(uint8_t lengths[HUFF_SYMBOLS],
+		const uint64_t counts[HUFF_SYMBOLS], unsigned int max_len)
+{
+	assert(lengths != NULL);
+	assert(counts != NULL);
+
+	Symbol nodes[HUFF_MAX_NODES];
+	unsigned int depth[HUFF_MAX_NODES];
+	unsigned int n = 0, i, max_depth = 0;
+
+	if (max_len < HUFF_MIN_CODE_LEN || max_len > HUFF_MAX_CODE_LEN)
+	{
+		return HUFF_INVALIDARG;
+	}
+
+	memset(lengths,0,HUFF_SYMBOLS);
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (counts[i] > 0)
+		{
+			memset(&nodes[n],0,sizeof(Symbol));
+			nodes[n].symbol = i;
+			nodes[n].weight = counts[i];
+			n++;
+		}
+	}
+
+	if (n == 0)
+	{
+		return HUFF_SUCCESS;
+	}
+	if (n == 1)
+	{
+		/* A code needs at least one bit */
+		lengths[nodes[0].symbol] = 1;
+		return HUFF_SUCCESS;
+	}
+
+	_sort_leaves(nodes,n);
+	huffman_build_tree(nodes,n);
+
+	/* Internal nodes come after their children, so walking back from *
+	 * the root sets the depth of every parent before its children.   */
+	depth[2*n-2] = 0;
+	for (i=2*n-2; i-- > 0; )
+	{
+		depth[i] = depth[nodes[i].parent] + 1;
+	}
+	for (i=0; i<n; i++)
+	{
+		lengths[nodes[i].symbol] = depth[i];
+		if (depth[i] > max_depth)
+		{
+			max_depth = depth[i];
+		}
+	}
+
+	if (max_depth > max_len)
+	{
+		_package_merge(lengths,nodes,n,max_len);
+	}
+
+	return HUFF_SUCCESS;
+}
+
+HUFF_ERR huffman_canonical_codes(uint16_t codes[HUFF_SYMBOLS],
+		const uint8_t lengths[HUFF_SYMBOLS])
+{
+	assert(codes != NULL);
+	assert(lengths != NULL);
+
+	unsigned int bl_count[HUFF_MAX_CODE_LEN+1] = { 0 };
+	unsigned int next_code[HUFF_MAX_CODE_LEN+1];
+	unsigned int code = 0, len, i;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (lengths[i] > HUFF_MAX_CODE_LEN)
+		{
+			return HUFF_CORRUPT;
+		}
+		bl_count[lengths[i]]++;
+	}
+	bl_count[0] = 0;
+
+	/* First code of each length */
+	for (len=1; len<=HUFF_MAX_CODE_LEN; len++)
+	{
+		code = (code + bl_count[len-1]) << 1;
+		next_code[len] = code;
+
+		/* More codes of this length than there is room for */
+		if (next_code[len] + bl_count[len] > (1u << len))
+		{
+			return HUFF_CORRUPT;
+		}
+	}
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		codes[i] = (lengths[i] > 0) ? next_code[lengths[i]]++ : 0;
+	}
+
+	return HUFF_SUCCESS;
+}
@@ -6,47 +6,66 @@
  */
 
 #include "huffman.h"
+#include "huffman_util.h"
+#include "huffman_histogram.h"
 
 #include <assert.h>
 #include <stdio.h>
+#include <inttypes.h>
 
-/* Used in debugging to symbols with their bit codes */
-void print_codes_from_tree(Symbol **leaves)
+/* Used in debugging to symbols with their bit codes, from the `n'  *
+ * leaves at the start of a tree built by huffman_build_tree          */
+void print_codes_from_tree(const Symbol *nodes, unsigned int n)
 {
-	assert(leaves != NULL);
+	assert(nodes != NULL);
 
-	int n = 0;
-	Symbol *s;
-	while (leaves[n] != NULL)
+	unsigned int i;
+	const Symbol *s;
+	for (i=0; i<n; i++)
 	{
-		s = leaves[n];
-		assert(s != NULL);
-		printf("%#x|%ld|\t",s->symbol,s->weight);
-		do 
+		s = &nodes[i];
+		printf("%#x|%" PRIu64 "|\t",s->symbol,s->weight);
+		while (s->parent != HUFF_NO_NODE)
 		{
 			printf("%d ",s->code);
-			s=s->parent;
-		} while (s->parent != NULL);
+			s = &nodes[s->parent];
+		}
 		printf("\n");
-		n++;
 	}
 }
 
-/* Prints the symbol and its code as stored in the symbol linked list */
-void print_ll(Symbol *s)
+/* Prints every node of a tree of `count' nodes with its children */
+void print_tree(const Symbol *nodes, unsigned int count)
 {
-	assert(s != NULL);
+	assert(nodes != NULL);
 
-	Symbol *p = s;
+	unsigned int i;
+	const Symbol *p;
 
-	while (p != NULL)
+	for (i=0; i<count; i++)
 	{
-		printf("%c(%#x) %ld",p->symbol,p->symbol,p->weight);
-		if (p->left != NULL) printf("\tl: %d",p->left->code);
-		if (p->right != NULL) printf("\tr: %d",p->right->code);
+		p = &nodes[i];
+		printf("%u: %c(%#x) %" PRIu64,i,p->symbol,p->symbol,p->weight);
+		if (p->left != HUFF_NO_NODE) printf("\tl: %u",p->left);
+		if (p->right != HUFF_NO_NODE) printf("\tr: %u",p->right);
 		printf("\n");
-		p=p->next;
 	}
 }
 
 
+
+/* Prints the symbols with a code and the length of their code */
+void print_code_lengths(const uint8_t *lengths)
+{
+	assert(lengths != NULL);
+
+	int i;
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		if (lengths[i] != 0)
+		{
+			printf("%#x|%d\n",i,lengths[i]);
+		}
+	}
+}
@@ -3,6 +3,7 @@
 #include "file_stat_error.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int tests_run = 0;
 
@@ -32,6 +33,43 @@ static char *test_fgetc_stat()
 	return NULL;
 }
 
+static char *test_fview_stat()
+{
+	const void *ptr;
+	f_stat stream;
+	FILE *fp;
+
+	mu_assert("fview_stat(,,NULL) != E_UNEXPECTED_NULL_POINTER",fview_stat(&ptr,1,NULL)==E_UNEXPECTED_NULL_POINTER);
+
+	/* A regular file is viewed without copying and can be re-read */
+	fp = tmpfile();
+	mu_assert("tmpfile() failed",fp != NULL);
+	fputs("abc",fp);
+	rewind(fp);
+	finit_stat(&stream,fp);
+
+	mu_assert("fview_stat did not return 3 bytes",fview_stat(&ptr,16,&stream) == 3);
+	mu_assert("fview_stat returned wrong bytes",((const char *)ptr)[1] == 'b');
+	mu_assert("fview_stat past the end != 0",fview_stat(&ptr,16,&stream) == 0);
+	mu_assert("byte_count != 3",stream.byte_count == 3);
+	rewind_stat(&stream);
+	mu_assert("fgetc_stat after rewind != 'a'",fgetc_stat(&stream) == 'a');
+
+	fclose_stat(&stream);
+
+	/* A read error is a negative code, never taken for a count */
+	fp = fopen(".","r");
+	mu_assert("fopen(\".\") failed",fp != NULL);
+	finit_stat(&stream,fp);
+
+	mu_assert("fview_stat of a directory != E_FAILED_FILE_READ",fview_stat(&ptr,16,&stream) == (size_t)E_FAILED_FILE_READ);
+	mu_assert("fview_stat(,SIZE_MAX,) error <= FVIEW_MAX",fview_stat(&ptr,SIZE_MAX,&stream) > FVIEW_MAX);
+	mu_assert("fgetc_stat of a directory != E_FAILED_FILE_READ",fgetc_stat(&stream) == E_FAILED_FILE_READ);
+
+	fclose_stat(&stream);
+	return NULL;
+}
+
 static char *test_rewind_stat()
 {
 	mu_assert("rewind_stat(NULL) != E_UNEXPECTED_NULL_POINTER",rewind_stat(NULL)==E_UNEXPECTED_NULL_POINTER);
@@ -40,7 +78,32 @@ static char *test_rewind_stat()
 
 static char *test_fflush_stat()
 {
+	f_stat stream;
+	char buf[16];
+	FILE *fp;
+
 	mu_assert("fflush_stat(NULL) != E_UNEXPECTED_NULL_POINTER",fflush_stat(NULL)==E_UNEXPECTED_NULL_POINTER);
+
+	/* Writes are held in the write buffer until it fills or is flushed */
+	fp = tmpfile();
+	mu_assert("tmpfile() failed",fp != NULL);
+	finit_stat(&stream,fp);
+	mu_assert("fsetbuf_stat failed",fsetbuf_stat(&stream,4) == E_SUCCESS);
+
+	fputc_stat('a',&stream);
+	fwrite_stat("bc",1,2,&stream);
+	mu_assert("write buffer flushed early",ftell(fp) == 0);
+	fwrite_stat("defgh",1,5,&stream);
+	mu_assert("fputc_stat after a large write failed",fputc_stat('i',&stream) == 'i');
+	mu_assert("byte_count != 9",stream.byte_count == 9);
+	mu_assert("fsetbuf_stat accepted while in use",fsetbuf_stat(&stream,8) != E_SUCCESS);
+
+	mu_assert("fflush_stat failed",fflush_stat(&stream) == 0);
+	rewind(fp);
+	mu_assert("wrong bytes written",fread(buf,1,sizeof(buf),fp) == 9 &&
+			memcmp(buf,"abcdefghi",9) == 0);
+
+	fclose_stat(&stream);
 	return NULL;
 }
 
@@ -55,6 +118,7 @@ static char *all_tests()
 	mu_run_test(test_fwrite_stat);
 	mu_run_test(test_fputc_stat);
 	mu_run_test(test_fgetc_stat);
+	mu_run_test(test_fview_stat);
 	mu_run_test(test_rewind_stat);
 	mu_run_test(test_fflush_stat);
 	mu_run_test(test_fclose_stat);
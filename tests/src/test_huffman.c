@@ -6,8 +6,13 @@
 #include "huffman.h"
 #include "minunit.h"
 #include "huffman_errno.h"
+#include "huffman_histogram.h"
+#include "huffman_tree.h"
+#include "huffman_format.h"
+#include "huffman_crc.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int tests_run = 0;
 
@@ -16,11 +21,991 @@ static char *test_symbol_cmp()
 	Symbol symbol1, symbol2;
 	symbol1.weight   = 0;
 	symbol2.weight   = 1;
-	Symbol *s1_ptr = &symbol1;
-	Symbol *s2_ptr = &symbol2;
 
-	mu_assert("symbol1.weight != symbol1.weight", _symbol_cmp(&s1_ptr,&s1_ptr) == 0);
-	mu_assert("symbol1.weight == symbol2.weight", _symbol_cmp(&s1_ptr,&s2_ptr) != 0);
+	mu_assert("symbol1.weight != symbol1.weight", _symbol_cmp(&symbol1,&symbol1) == 0);
+	mu_assert("symbol1.weight == symbol2.weight", _symbol_cmp(&symbol1,&symbol2) != 0);
+	return NULL;
+}
+
+static char *test_histogram()
+{
+	uint64_t counts[HUFF_SYMBOLS] = { 0 };
+	uint8_t data[100];
+
+	/* A run long enough for the single value fast path plus a tail */
+	memset(data,'a',64);
+	memset(data+64,'b',35);
+	data[99] = 'c';
+
+	huffman_histogram(counts,data,sizeof(data));
+	mu_assert("histogram count of 'a' != 64", counts['a'] == 64);
+	mu_assert("histogram count of 'b' != 35", counts['b'] == 35);
+	mu_assert("histogram count of 'c' != 1",  counts['c'] == 1);
+	mu_assert("histogram count of 'd' != 0",  counts['d'] == 0);
+
+	/* Counts accumulate over calls */
+	huffman_histogram(counts,data,sizeof(data));
+	mu_assert("histogram does not accumulate", counts['a'] == 128);
+	return NULL;
+}
+
+static char *test_build_tree()
+{
+	Symbol nodes[7];
+	long int weights[4] = { 1, 1, 2, 4 };
+	int i, depth;
+	Symbol *s;
+
+	memset(nodes,0,sizeof(nodes));
+	for (i=0; i<4; i++)
+	{
+		nodes[i].symbol = 'a'+i;
+		nodes[i].weight = weights[i];
+	}
+	huffman_build_tree(nodes,4);
+
+	mu_assert("root weight != 8", nodes[6].weight == 8);
+	mu_assert("root has a parent", nodes[6].parent == HUFF_NO_NODE);
+	mu_assert("leaf has a child", nodes[0].left == HUFF_NO_NODE);
+
+	/* Lightest symbols have the longest codes */
+	for (s=&nodes[0], depth=0; s->parent != HUFF_NO_NODE;
+			s=&nodes[s->parent])
+	{
+		depth++;
+	}
+	mu_assert("depth of lightest leaf != 3", depth == 3);
+	for (s=&nodes[3], depth=0; s->parent != HUFF_NO_NODE;
+			s=&nodes[s->parent])
+	{
+		depth++;
+	}
+	mu_assert("depth of heaviest leaf != 1", depth == 1);
+	return NULL;
+}
+
+static char *test_code_lengths()
+{
+	uint64_t counts[HUFF_SYMBOLS] = { 0 };
+	uint8_t lengths[HUFF_SYMBOLS];
+	uint16_t codes[HUFF_SYMBOLS];
+	uint64_t a = 1, b = 1, t;
+	unsigned int kraft = 0;
+	int i;
+
+	/* Fibonacci weights give a tree deeper than the length limit */
+	for (i=0; i<30; i++)
+	{
+		counts[i] = a;
+		t = a + b;
+		a = b;
+		b = t;
+	}
+
+	mu_assert("huffman_code_lengths failed",
+		huffman_code_lengths(lengths,counts,HUFF_MIN_CODE_LEN) == HUFF_SUCCESS);
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		mu_assert("code longer than the limit", lengths[i] <= HUFF_MIN_CODE_LEN);
+		mu_assert("missing code", (lengths[i] == 0) == (counts[i] == 0));
+		if (lengths[i] != 0)
+		{
+			kraft += 1u << (HUFF_MAX_CODE_LEN - lengths[i]);
+		}
+	}
+	mu_assert("code lengths not complete", kraft == 1u << HUFF_MAX_CODE_LEN);
+	mu_assert("lengths not a prefix code",
+		huffman_canonical_codes(codes,lengths) == HUFF_SUCCESS);
+
+	/* Too many short codes is not a prefix code */
+	memset(lengths,0,sizeof(lengths));
+	lengths[0] = lengths[1] = lengths[2] = 1;
+	mu_assert("over-subscribed lengths accepted",
+		huffman_canonical_codes(codes,lengths) == HUFF_CORRUPT);
+	return NULL;
+}
+
+static char *test_round_trip()
+{
+	static uint8_t data[1 << 16];
+	f_stat in, coded, decoded;
+	huffman_opts opts[] = { { 0, 0, 0, 0 }, { 1024, 0, 3, 0 },
+				{ 4096, 0, 0, 4 } };
+	uint64_t a = 1, b = 1, t;
+	size_t n = 0, i, k;
+	int rc;
+
+	/* Fibonacci weights give codes longer than the first level of the *
+	 * decode table                                                     */
+	for (i=0; n<sizeof(data); i++)
+	{
+		for (t=0; t<a && n<sizeof(data); t++)
+		{
+			data[n++] = i;
+		}
+		t = a + b;
+		a = b;
+		b = t;
+	}
+	for (i=0; i<sizeof(data); i++)
+	{
+		/* Spread the symbols through the input */
+		t = data[i];
+		data[i] = data[(i*40503) % sizeof(data)];
+		data[(i*40503) % sizeof(data)] = t;
+	}
+
+	/* As a single stream, as blocks coded on three threads and as *
+	 * blocks of four interleaved streams                           */
+	for (k=0; k<sizeof(opts)/sizeof(opts[0]); k++)
+	{
+		fmemopen_stat(&in,data,sizeof(data));
+		fmemopen_stat(&coded,NULL,0);
+		rc = huffman_opt(&in,&coded,&opts[k]);
+		fclose_stat(&in);
+		mu_assert("huffman failed", rc == HUFF_SUCCESS);
+
+		fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+		fmemopen_stat(&decoded,NULL,0);
+		rc = unhuffman(&in,&decoded);
+		fclose_stat(&in);
+		mu_assert("unhuffman failed", rc == HUFF_SUCCESS);
+		mu_assert("decoded length differs",
+			decoded.buffer_usage == sizeof(data));
+		mu_assert("decoded data differs",
+			memcmp(decoded.buffer,data,sizeof(data)) == 0);
+
+		fclose_stat(&decoded);
+		fclose_stat(&coded);
+	}
+	return NULL;
+}
+
+static char *test_stats()
+{
+	static uint8_t data[10000];
+	f_stat in, coded, decoded;
+	huffman_stats stats;
+	huffman_opts opts = { .block_size = 4096, .stats = &stats };
+	size_t i;
+	int rc;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i * i) >> 9;
+	}
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	mu_assert("huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("input bytes not counted", stats.in_bytes == sizeof(data));
+	mu_assert("output bytes not counted",
+		stats.out_bytes == coded.buffer_usage);
+	mu_assert("blocks not counted", stats.blocks == 3);
+	mu_assert("longest code not noted",
+		stats.max_code_len > 0 && stats.max_code_len <= 15);
+
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&decoded,NULL,0);
+	rc = unhuffman_opt(&in,&decoded,&opts);
+	fclose_stat(&in);
+	mu_assert("unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("decoded bytes not counted",
+		stats.out_bytes == sizeof(data));
+	mu_assert("decoded blocks not counted", stats.blocks == 3);
+	fclose_stat(&decoded);
+	fclose_stat(&coded);
+	return NULL;
+}
+
+static char *test_read_range()
+{
+	static uint8_t data[10000];
+	f_stat in, coded, part;
+	huffman_opts opts = { 1024, 0, 0, 0, true };
+	size_t i;
+	int rc;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i * i) >> 7;
+	}
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	mu_assert("huffman failed", rc == HUFF_SUCCESS);
+
+	/* Across a block boundary */
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&part,NULL,0);
+	rc = huffman_read_range(&in,&part,1000,2000);
+	fclose_stat(&in);
+	mu_assert("huffman_read_range failed", rc == HUFF_SUCCESS);
+	mu_assert("range length differs", part.buffer_usage == 2000);
+	mu_assert("range data differs",
+		memcmp(part.buffer,data+1000,2000) == 0);
+	fclose_stat(&part);
+
+	/* Running past the end of the data */
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&part,NULL,0);
+	rc = huffman_read_range(&in,&part,9990,100);
+	fclose_stat(&in);
+	mu_assert("huffman_read_range failed at the end", rc == HUFF_SUCCESS);
+	mu_assert("range not cut at the end", part.buffer_usage == 10);
+	mu_assert("end of range differs",
+		memcmp(part.buffer,data+9990,10) == 0);
+	fclose_stat(&part);
+	fclose_stat(&coded);
+
+	/* Without an index */
+	opts.index = false;
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	mu_assert("huffman failed without an index", rc == HUFF_SUCCESS);
+
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&part,NULL,0);
+	rc = huffman_read_range(&in,&part,0,10);
+	mu_assert("range read without an index", rc == HUFF_NOINDEX);
+	fclose_stat(&in);
+	fclose_stat(&part);
+	fclose_stat(&coded);
+	return NULL;
+}
+
+static char *test_buffer()
+{
+	static uint8_t data[5000], coded[10000], decoded[5000];
+	f_stat in, out;
+	huffman_opts opts = { 1024, 0, 0, 4 };
+	size_t len, n, i;
+	int rc;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i % 7) * (i % 11);
+	}
+	mu_assert("bound too small",
+		huffman_compress_bound(sizeof(data)) <= sizeof(coded));
+
+	/* The same output as huffman() */
+	rc = huffman_compress_buffer(data,sizeof(data),coded,sizeof(coded),
+			&len);
+	mu_assert("huffman_compress_buffer failed", rc == HUFF_SUCCESS);
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	huffman(&in,&out);
+	mu_assert("buffer output differs from huffman()",
+		out.buffer_usage == len &&
+		memcmp(out.buffer,coded,len) == 0);
+	fclose_stat(&in);
+	fclose_stat(&out);
+
+	rc = huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),&n);
+	mu_assert("huffman_decompress_buffer failed", rc == HUFF_SUCCESS);
+	mu_assert("decoded buffer differs",
+		n == sizeof(data) && memcmp(decoded,data,n) == 0);
+
+	/* Too little room either way */
+	rc = huffman_compress_buffer(data,sizeof(data),coded,len-1,&n);
+	mu_assert("compressed into too small a buffer", rc == HUFF_NOSPACE);
+	rc = huffman_decompress_buffer(coded,len,decoded,sizeof(data)-1,&n);
+	mu_assert("decompressed into too small a buffer", rc == HUFF_NOSPACE);
+
+	/* A block stream */
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&opts);
+	mu_assert("huffman_opt failed", rc == HUFF_SUCCESS);
+	memset(decoded,0,sizeof(decoded));
+	rc = huffman_decompress_buffer(out.buffer,out.buffer_usage,decoded,
+			sizeof(decoded),&n);
+	mu_assert("block stream not decompressed", rc == HUFF_SUCCESS);
+	mu_assert("decoded blocks differ",
+		n == sizeof(data) && memcmp(decoded,data,n) == 0);
+	fclose_stat(&in);
+	fclose_stat(&out);
+	return NULL;
+}
+
+/* Push `len' bytes through the stream `chunk' bytes at a time, pulling *
+ * the output into `out' as it comes. Returns the number of bytes out.  */
+static size_t stream_through(HuffStream *s, const uint8_t *in, size_t len,
+		uint8_t *out, size_t chunk, bool finish)
+{
+	size_t pushed = 0, total = 0, used, n;
+
+	while (pushed < len)
+	{
+		used = (len - pushed < chunk) ? len - pushed : chunk;
+		if (huffman_stream_push(s,in+pushed,used,&used) != HUFF_SUCCESS)
+		{
+			break;
+		}
+		pushed += used;
+		do
+		{
+			huffman_stream_pull(s,out+total,chunk,&n);
+			total += n;
+		} while (n > 0);
+	}
+	if (finish)
+	{
+		huffman_stream_finish(s);
+	}
+	do
+	{
+		huffman_stream_pull(s,out+total,chunk,&n);
+		total += n;
+	} while (n > 0);
+	return total;
+}
+
+static char *test_codebook()
+{
+	static uint8_t sample[4000], msg[300], coded[1000], decoded[300];
+	uint64_t counts[HUFF_SYMBOLS] = { 0 };
+	HuffCodebook *book, *loaded, *other;
+	f_stat out, in;
+	size_t len, n, i;
+	int rc;
+
+	for (i=0; i<sizeof(sample); i++)
+	{
+		sample[i] = 'a' + (i*i) % 13;
+	}
+	huffman_histogram(counts,sample,sizeof(sample));
+	rc = huffman_codebook_train(&book,counts,0);
+	mu_assert("huffman_codebook_train failed", rc == HUFF_SUCCESS);
+
+	/* Saved and loaded it is the same code */
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_codebook_save(book,&out);
+	mu_assert("huffman_codebook_save failed", rc == HUFF_SUCCESS);
+	fmemopen_stat(&in,out.buffer,out.buffer_usage);
+	rc = huffman_codebook_load(&loaded,&in);
+	fclose_stat(&in);
+	fclose_stat(&out);
+	mu_assert("huffman_codebook_load failed", rc == HUFF_SUCCESS);
+	mu_assert("loaded codebook has another ID",
+		huffman_codebook_id(loaded) == huffman_codebook_id(book));
+
+	/* Bytes missing from the sample still have a code */
+	for (i=0; i<sizeof(msg); i++)
+	{
+		msg[i] = (i % 50 == 0) ? 0xff : sample[i*7 % sizeof(sample)];
+	}
+	rc = huffman_codebook_compress(book,msg,sizeof(msg),coded,
+			sizeof(coded),&len);
+	mu_assert("huffman_codebook_compress failed", rc == HUFF_SUCCESS);
+	mu_assert("codebook message not smaller", len < sizeof(msg)/2);
+	rc = huffman_codebook_decompress(loaded,coded,len,decoded,
+			sizeof(decoded),&n);
+	mu_assert("huffman_codebook_decompress failed", rc == HUFF_SUCCESS);
+	mu_assert("codebook message differs",
+		n == sizeof(msg) && memcmp(decoded,msg,n) == 0);
+
+	/* Another codebook, or none, cannot decode it */
+	counts['z'] += 100000;
+	rc = huffman_codebook_train(&other,counts,0);
+	mu_assert("second codebook not trained", rc == HUFF_SUCCESS);
+	rc = huffman_codebook_decompress(other,coded,len,decoded,
+			sizeof(decoded),&n);
+	mu_assert("decoded with the wrong codebook", rc == HUFF_CODEBOOK);
+	rc = huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),&n);
+	mu_assert("decoded without a codebook", rc == HUFF_CODEBOOK);
+
+	huffman_codebook_free(other);
+	huffman_codebook_free(loaded);
+	huffman_codebook_free(book);
+	return NULL;
+}
+
+static char *test_stream()
+{
+	static uint8_t data[5000], coded[12000], decoded[5000];
+	huffman_stats stats;
+	huffman_opts opts = { 1024, 0, 0, 0 };
+	HuffStream *enc, *dec;
+	size_t len, first, n, i;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i % 13) * (i % 5);
+	}
+	opts.stats = &stats;
+
+	/* A flush makes everything pushed so far decodable */
+	mu_assert("huffman_stream_init failed",
+		huffman_stream_init(&enc,&opts) == HUFF_SUCCESS);
+	mu_assert("unhuffman_stream_init failed",
+		unhuffman_stream_init(&dec) == HUFF_SUCCESS);
+	len = stream_through(enc,data,1500,coded,7,false);
+	huffman_stream_flush(enc);
+	len += stream_through(enc,NULL,0,coded+len,7,false);
+	n = stream_through(dec,coded,len,decoded,5,false);
+	mu_assert("flushed data not decoded",
+		n == 1500 && memcmp(decoded,data,n) == 0);
+	first = len;
+
+	len += stream_through(enc,data+1500,sizeof(data)-1500,coded+len,7,true);
+	mu_assert("encoder not done", huffman_stream_done(enc));
+	huffman_stream_end(enc);
+
+	/* Two blocks up to the flush and four after it */
+	mu_assert("stream statistics not collected",
+		stats.blocks == 6 && stats.in_bytes == sizeof(data) &&
+		stats.out_bytes == len);
+
+	/* The decoder picks up where it left off */
+	n = stream_through(dec,coded+first,len-first,decoded,5,true);
+	mu_assert("decoder not done", huffman_stream_done(dec));
+	huffman_stream_end(dec);
+	mu_assert("stream decoded length differs", n == sizeof(data) - 1500);
+	mu_assert("stream decoded data differs",
+		memcmp(decoded,data+1500,n) == 0);
+
+	/* A single stream, one byte at a time, stops mid-code and resumes */
+	huffman_compress_buffer(data,sizeof(data),coded,sizeof(coded),&len);
+	unhuffman_stream_init(&dec);
+	n = stream_through(dec,coded,len,decoded,1,true);
+	mu_assert("single stream not done", huffman_stream_done(dec));
+	huffman_stream_end(dec);
+	mu_assert("single stream decoded data differs",
+		n == sizeof(data) && memcmp(decoded,data,n) == 0);
+
+	/* Truncated input is corrupt */
+	unhuffman_stream_init(&dec);
+	huffman_stream_push(dec,coded,len-1,&n);
+	huffman_stream_finish(dec);
+	while (huffman_stream_pull(dec,decoded,sizeof(decoded),&n) ==
+			HUFF_SUCCESS && n > 0);
+	mu_assert("truncated stream accepted",
+		huffman_stream_pull(dec,decoded,sizeof(decoded),&n) ==
+		HUFF_CORRUPT);
+	huffman_stream_end(dec);
+	return NULL;
+}
+
+static char *test_adaptive()
+{
+	static uint8_t data[5000], coded[12000], decoded[5000];
+	huffman_opts opts = { .adaptive = true };
+	huffman_opts blocks = { .adaptive = true, .block_size = 1024 };
+	HuffStream *enc, *dec;
+	f_stat in, out;
+	size_t len, first, n, i;
+	int rc;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i % 13) * (i % 5) + (i > 4000 ? i % 7 : 0);
+	}
+
+	/* Through f_stat streams, decoded by unhuffman and from memory */
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&opts);
+	fclose_stat(&in);
+	mu_assert("adaptive huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("adaptive output too large", out.buffer_usage < sizeof(data));
+	len = out.buffer_usage;
+	memcpy(coded,out.buffer,len);
+	fclose_stat(&out);
+
+	fmemopen_stat(&in,coded,len);
+	fmemopen_stat(&out,NULL,0);
+	rc = unhuffman(&in,&out);
+	fclose_stat(&in);
+	mu_assert("adaptive unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("adaptive decoded data differs",
+		out.buffer_usage == sizeof(data) &&
+		memcmp(out.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&out);
+
+	mu_assert("adaptive buffer decode failed",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&n) == HUFF_SUCCESS);
+	mu_assert("adaptive buffer decoded data differs",
+		n == sizeof(data) && memcmp(decoded,data,n) == 0);
+	mu_assert("adaptive truncated input accepted",
+		huffman_decompress_buffer(coded,len-1,decoded,sizeof(decoded),
+			&n) == HUFF_CORRUPT);
+	mu_assert("adaptive small output accepted",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(data)-1,
+			&n) == HUFF_NOSPACE);
+
+	/* Blocks are not adaptive */
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	mu_assert("adaptive blocks accepted",
+		huffman_opt(&in,&out,&blocks) == HUFF_INVALIDARG);
+	fclose_stat(&in);
+	fclose_stat(&out);
+	mu_assert("adaptive block stream accepted",
+		huffman_stream_init(&enc,&blocks) == HUFF_INVALIDARG);
+
+	/* A flush makes everything pushed so far decodable, and the      *
+	 * decoder picks up from there taking the input a byte at a time  */
+	mu_assert("adaptive huffman_stream_init failed",
+		huffman_stream_init(&enc,&opts) == HUFF_SUCCESS);
+	unhuffman_stream_init(&dec);
+	len = stream_through(enc,data,1500,coded,7,false);
+	huffman_stream_flush(enc);
+	len += stream_through(enc,NULL,0,coded+len,7,false);
+	n = stream_through(dec,coded,len,decoded,5,false);
+	mu_assert("adaptive flushed data not decoded",
+		n == 1500 && memcmp(decoded,data,n) == 0);
+	first = len;
+
+	len += stream_through(enc,data+1500,sizeof(data)-1500,coded+len,7,true);
+	mu_assert("adaptive encoder not done", huffman_stream_done(enc));
+	huffman_stream_end(enc);
+
+	n = stream_through(dec,coded+first,len-first,decoded,1,true);
+	mu_assert("adaptive decoder not done", huffman_stream_done(dec));
+	huffman_stream_end(dec);
+	mu_assert("adaptive stream decoded data differs",
+		n == sizeof(data) - 1500 &&
+		memcmp(decoded,data+1500,n) == 0);
+	return NULL;
+}
+
+static char *test_sample()
+{
+	static uint8_t data[1 << 20];
+	huffman_opts opts = { .sample = 25 };
+	huffman_opts blocks = { .sample = 25, .block_size = 4096 };
+	huffman_stats st;
+	f_stat in, coded, decoded;
+	size_t i;
+	int rc;
+
+	for (i=0; i<sizeof(data); i++)
+	{
+		data[i] = (i % 7) * (i % 11);
+	}
+	/* Only in the bytes between the sampled pieces */
+	data[10000] = 0xff;
+	data[sizeof(data) - 1] = 0xfe;
+
+	opts.stats = &st;
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	mu_assert("sampled huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("input not sampled",
+		st.counted_bytes > 0 && st.counted_bytes < sizeof(data) / 2);
+
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&decoded,NULL,0);
+	rc = unhuffman(&in,&decoded);
+	fclose_stat(&in);
+	mu_assert("sampled unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("sampled decoded data differs",
+		decoded.buffer_usage == sizeof(data) &&
+		memcmp(decoded.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&decoded);
+	fclose_stat(&coded);
+
+	/* Short input has every byte counted */
+	fmemopen_stat(&in,data,4096);
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	fclose_stat(&coded);
+	mu_assert("short input sampled",
+		rc == HUFF_SUCCESS && st.counted_bytes == 4096);
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	mu_assert("sampled blocks accepted",
+		huffman_opt(&in,&coded,&blocks) == HUFF_INVALIDARG);
+	fclose_stat(&in);
+	fclose_stat(&coded);
+	return NULL;
+}
+
+static char *test_context()
+{
+	static uint8_t data[100000], decoded[100000];
+	static uint64_t scratch[HUFF_DECODE_SCRATCH_SIZE/8];
+	huffman_opts opts = { .block_size = 32*1024, .context = true };
+	huffman_opts plain = { .block_size = 32*1024 };
+	huffman_opts streams = { .context = true, .streams = 4 };
+	const char *fields[] = { "id=", ",level=INFO", ",level=WARN",
+				 ",msg=ok\n", ",msg=retry\n" };
+	f_stat in, coded, decoded_fp;
+	size_t n = 0, len, plain_len, i;
+	uint64_t x = 1;
+	int rc;
+
+	/* Lines of fields, each byte well predicted by the one before */
+	while (n < sizeof(data) - 32)
+	{
+		x = x*6364136223846793005ULL + 1442695040888963407ULL;
+		n += sprintf((char *)data+n,"%s%u%s%s",fields[0],
+			(unsigned int)(x >> 54),fields[1 + (x >> 63)],
+			fields[3 + ((x >> 62) & 1)]);
+	}
+	for (i=n; i<sizeof(data); i++)
+	{
+		data[i] = 'x';
+	}
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&plain);
+	fclose_stat(&in);
+	mu_assert("plain blocks failed", rc == HUFF_SUCCESS);
+	plain_len = coded.buffer_usage;
+	fclose_stat(&coded);
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	rc = huffman_opt(&in,&coded,&opts);
+	fclose_stat(&in);
+	mu_assert("context blocks failed", rc == HUFF_SUCCESS);
+	mu_assert("context blocks not smaller",
+		coded.buffer_usage < plain_len*3/4);
+
+	fmemopen_stat(&in,coded.buffer,coded.buffer_usage);
+	fmemopen_stat(&decoded_fp,NULL,0);
+	rc = unhuffman(&in,&decoded_fp);
+	fclose_stat(&in);
+	mu_assert("context unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("context decoded data differs",
+		decoded_fp.buffer_usage == sizeof(data) &&
+		memcmp(decoded_fp.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&decoded_fp);
+
+	mu_assert("context buffer decode failed",
+		huffman_decompress_buffer(coded.buffer,coded.buffer_usage,
+			decoded,sizeof(decoded),&len) == HUFF_SUCCESS);
+	mu_assert("context buffer decoded data differs",
+		len == sizeof(data) && memcmp(decoded,data,len) == 0);
+
+	/* Every block decoded with the tables in the scratch area */
+	memset(decoded,0,sizeof(decoded));
+	mu_assert("context scratch decode failed",
+		huffman_decompress_buffer_scratch(coded.buffer,
+			coded.buffer_usage,decoded,sizeof(decoded),&len,
+			scratch,sizeof(scratch)) == HUFF_SUCCESS);
+	mu_assert("context scratch decoded data differs",
+		len == sizeof(data) && memcmp(decoded,data,len) == 0);
+	mu_assert("short scratch accepted",
+		huffman_decompress_buffer_scratch(coded.buffer,
+			coded.buffer_usage,decoded,sizeof(decoded),&len,
+			scratch,sizeof(scratch)-1) == HUFF_INVALIDARG);
+
+	/* The context map names codes past a count of one */
+	mu_assert("first block not a context block",
+		((uint8_t *)coded.buffer)[HUFB_HEADER_SIZE] == HUFB_CONTEXT);
+	((uint8_t *)coded.buffer)[HUFB_HEADER_SIZE +
+		HUFB_BLOCK_HEADER_SIZE] = 1;
+	mu_assert("bad context map accepted",
+		huffman_decompress_buffer(coded.buffer,coded.buffer_usage,
+			decoded,sizeof(decoded),&len) == HUFF_CORRUPT);
+	fclose_stat(&coded);
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&coded,NULL,0);
+	mu_assert("context streams accepted",
+		huffman_opt(&in,&coded,&streams) == HUFF_INVALIDARG);
+	fclose_stat(&in);
+	fclose_stat(&coded);
+	return NULL;
+}
+
+static char *test_stored()
+{
+	static uint8_t data[300000], coded[300000 + 1024], decoded[300000];
+	huffman_opts blocks = { .block_size = 64*1024 };
+	huffman_stats stats;
+	huffman_opts opts = { .stats = &stats };
+	f_stat in, out, decoded_fp;
+	size_t len, i;
+	uint64_t x = 1;
+	int rc;
+
+	/* Random bytes, which no code makes smaller */
+	for (i=0; i<sizeof(data); i++)
+	{
+		x = x*6364136223846793005ULL + 1442695040888963407ULL;
+		data[i] = x >> 56;
+	}
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&opts);
+	fclose_stat(&in);
+	mu_assert("stored huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("stored stream grew",
+		out.buffer_usage <= sizeof(data) + 64);
+	mu_assert("stored stream not counted", stats.stored_blocks == 1);
+	mu_assert("stored stream not a block stream",
+		memcmp(out.buffer,HUFB_MAGIC,4) == 0);
+
+	/* The buffer coder gives the same output */
+	mu_assert("stored buffer failed",
+		huffman_compress_buffer(data,sizeof(data),coded,
+			sizeof(coded),&len) == HUFF_SUCCESS);
+	mu_assert("stored buffer differs", len == out.buffer_usage &&
+		memcmp(coded,out.buffer,len) == 0);
+	fclose_stat(&out);
+
+	mu_assert("stored buffer decode failed",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&len) == HUFF_SUCCESS);
+	mu_assert("stored buffer decoded data differs",
+		len == sizeof(data) && memcmp(decoded,data,len) == 0);
+
+	/* Blocks of random bytes after a block of text */
+	memset(data,'a',64*1024);
+	for (i=0; i<64*1024; i+=7)
+	{
+		data[i] = 'b';
+	}
+	blocks.stats = &stats;
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&blocks);
+	fclose_stat(&in);
+	mu_assert("stored blocks failed", rc == HUFF_SUCCESS);
+	mu_assert("random blocks not stored", stats.stored_blocks == 4);
+	mu_assert("stored blocks miscounted", stats.blocks == 5);
+
+	fmemopen_stat(&in,out.buffer,out.buffer_usage);
+	fmemopen_stat(&decoded_fp,NULL,0);
+	rc = unhuffman(&in,&decoded_fp);
+	fclose_stat(&in);
+	mu_assert("stored blocks unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("stored blocks decoded data differs",
+		decoded_fp.buffer_usage == sizeof(data) &&
+		memcmp(decoded_fp.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&decoded_fp);
+
+	/* The payload of a stored block is as long as its input */
+	len = out.buffer_usage;
+	memcpy(coded,out.buffer,len);
+	fclose_stat(&out);
+	for (i=HUFB_HEADER_SIZE; coded[i] != HUFB_STORED;
+			i+=HUFB_BLOCK_HEADER_SIZE + huff_get_u32(coded+i+8))
+		;
+	huff_put_u32(coded+i+4,huff_get_u32(coded+i+4) - 1);
+	mu_assert("bad stored block accepted",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&len) == HUFF_CORRUPT);
+	return NULL;
+}
+
+static char *test_runs()
+{
+	static uint8_t data[200000], coded[200000], decoded[200000];
+	huffman_stats stats;
+	huffman_opts blocks = { .block_size = 64*1024, .stats = &stats };
+	huffman_opts opts = { .stats = &stats };
+	f_stat in, out, decoded_fp;
+	size_t len, i;
+	unsigned int k;
+	uint8_t *p;
+	int rc;
+
+	/* One byte repeated is a few run blocks, whichever way it is coded */
+	memset(data,0,sizeof(data));
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&opts);
+	fclose_stat(&in);
+	mu_assert("run huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("run stream not small", out.buffer_usage < 64);
+	mu_assert("run stream not counted", stats.run_blocks == 1);
+	mu_assert("run buffer failed",
+		huffman_compress_buffer(data,sizeof(data),coded,
+			sizeof(coded),&len) == HUFF_SUCCESS);
+	mu_assert("run buffer differs", len == out.buffer_usage &&
+		memcmp(coded,out.buffer,len) == 0);
+	fclose_stat(&out);
+	memset(decoded,0xff,sizeof(decoded));
+	mu_assert("run buffer decode failed",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&len) == HUFF_SUCCESS);
+	mu_assert("run buffer decoded data differs",
+		len == sizeof(data) && memcmp(decoded,data,len) == 0);
+
+	/* Text with runs of padding between, and a run at each end */
+	for (i=1000; i<sizeof(data)-5000; i+=5000)
+	{
+		sprintf((char *)data+i,"%zu: the quick brown fox jumps over "
+			"the lazy dog, again and again and again", i);
+	}
+	memset(data+100000,0xff,150);
+	memset(data+150000,'a',20000);
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&blocks);
+	fclose_stat(&in);
+	mu_assert("runs huffman failed", rc == HUFF_SUCCESS);
+	mu_assert("runs not found", stats.run_blocks == 4);
+	mu_assert("runs not small", out.buffer_usage < 4000);
+
+	fmemopen_stat(&in,out.buffer,out.buffer_usage);
+	fmemopen_stat(&decoded_fp,NULL,0);
+	rc = unhuffman(&in,&decoded_fp);
+	fclose_stat(&in);
+	mu_assert("runs unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("runs decoded data differs",
+		decoded_fp.buffer_usage == sizeof(data) &&
+		memcmp(decoded_fp.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&decoded_fp);
+
+	/* A run must end inside its block */
+	len = out.buffer_usage;
+	memcpy(coded,out.buffer,len);
+	fclose_stat(&out);
+	mu_assert("first block not a runs block",
+		coded[HUFB_HEADER_SIZE] == HUFB_RUNS);
+	p = coded + HUFB_HEADER_SIZE + HUFB_BLOCK_HEADER_SIZE + 4;
+	huff_put_u32(p+4,64*1024);
+	mu_assert("bad run accepted",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&len) == HUFF_CORRUPT);
+
+	/* The bytes between the runs are coded in the layout asked for */
+	for (i=0; i<sizeof(data)-100; i+=50)
+	{
+		sprintf((char *)data+i,"%06zu: the quick brown fox jumps over",i);
+	}
+	for (i=0; i+48000<sizeof(data); i+=64*1024)
+	{
+		memset(data+i+40000,0,8192);
+	}
+	for (k=0; k<2; k++)
+	{
+		blocks.streams = (k == 0) ? HUFB_STREAMS : 1;
+		blocks.context = (k == 1);
+		fmemopen_stat(&in,data,sizeof(data));
+		fmemopen_stat(&out,NULL,0);
+		rc = huffman_opt(&in,&out,&blocks);
+		fclose_stat(&in);
+		mu_assert("layout runs huffman failed", rc == HUFF_SUCCESS);
+		len = out.buffer_usage;
+		memcpy(coded,out.buffer,len);
+		fclose_stat(&out);
+
+		p = coded + HUFB_HEADER_SIZE;
+		mu_assert("layout block not a runs block", p[0] == HUFB_RUNS);
+		p += HUFB_BLOCK_HEADER_SIZE + 4 +
+			huff_get_u32(p + HUFB_BLOCK_HEADER_SIZE)*HUFB_RUN_SIZE;
+		mu_assert("layout not kept between the runs",
+			p[0] == ((k == 0) ? HUFB_HUFFMAN4 : HUFB_CONTEXT));
+		mu_assert("layout runs decode failed",
+			huffman_decompress_buffer(coded,len,decoded,
+				sizeof(decoded),&i) == HUFF_SUCCESS &&
+			i == sizeof(data) && memcmp(decoded,data,i) == 0);
+	}
+	return NULL;
+}
+
+static char *test_checksum()
+{
+	static uint8_t data[200000], coded[200000], decoded[200000];
+	huffman_opts opts = { .block_size = 64*1024, .checksum = true };
+	huffman_opts adaptive = { .adaptive = true, .checksum = true };
+	f_stat in, out, decoded_fp;
+	size_t len, i, pos;
+	uint32_t x = 1;
+	int rc;
+
+	mu_assert("crc32c check value wrong",
+		huffman_crc32c(0,"123456789",9) == 0xe3069283);
+	mu_assert("crc32c in pieces differs",
+		huffman_crc32c(huffman_crc32c(0,"1234",4),"56789",5) ==
+			0xe3069283);
+
+	/* Text, then bytes which do not compress */
+	for (i=0; i<sizeof(data)-100; i+=50)
+	{
+		sprintf((char *)data+i,"%06zu: the quick brown fox jumps over",i);
+	}
+	for (i=140000; i<sizeof(data); i++)
+	{
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 24;
+	}
+
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&opts);
+	fclose_stat(&in);
+	mu_assert("checksum huffman failed", rc == HUFF_SUCCESS);
+
+	fmemopen_stat(&in,out.buffer,out.buffer_usage);
+	fmemopen_stat(&decoded_fp,NULL,0);
+	rc = unhuffman(&in,&decoded_fp);
+	fclose_stat(&in);
+	mu_assert("checksum unhuffman failed", rc == HUFF_SUCCESS);
+	mu_assert("checksum decoded data differs",
+		decoded_fp.buffer_usage == sizeof(data) &&
+		memcmp(decoded_fp.buffer,data,sizeof(data)) == 0);
+	fclose_stat(&decoded_fp);
+
+	len = out.buffer_usage;
+	memcpy(coded,out.buffer,len);
+	fclose_stat(&out);
+	mu_assert("checksum buffer decode failed",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&i) == HUFF_SUCCESS && i == sizeof(data) &&
+		memcmp(decoded,data,sizeof(data)) == 0);
+
+	/* Every block carries a checksum, the last block is stored */
+	pos = HUFB_HEADER_SIZE;
+	while (coded[pos] != HUFB_END)
+	{
+		mu_assert("block without checksum",
+			coded[pos+1] == HUFB_BLOCK_CRC);
+		if (coded[pos] == HUFB_STORED)
+		{
+			break;
+		}
+		pos += HUFB_BLOCK_HEADER_SIZE + huff_get_u32(coded+pos+8);
+	}
+	mu_assert("no stored block", coded[pos] == HUFB_STORED);
+
+	/* A changed byte of a stored block decodes, but not its checksum */
+	coded[pos+HUFB_BLOCK_HEADER_SIZE+10] ^= 0x40;
+	mu_assert("changed stored block accepted",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&i) == HUFF_CHECKSUM);
+	coded[pos+HUFB_BLOCK_HEADER_SIZE+10] ^= 0x40;
+
+	/* As does a changed checksum of the first block */
+	pos = HUFB_HEADER_SIZE + HUFB_BLOCK_HEADER_SIZE +
+		huff_get_u32(coded+HUFB_HEADER_SIZE+8) - 1;
+	coded[pos] ^= 0x01;
+	mu_assert("changed checksum accepted",
+		huffman_decompress_buffer(coded,len,decoded,sizeof(decoded),
+			&i) == HUFF_CHECKSUM);
+	fmemopen_stat(&in,coded,len);
+	fmemopen_stat(&decoded_fp,NULL,0);
+	rc = unhuffman(&in,&decoded_fp);
+	fclose_stat(&in);
+	fclose_stat(&decoded_fp);
+	mu_assert("changed checksum unhuffman accepted", rc == HUFF_CHECKSUM);
+
+	/* The adaptive coder has no blocks to check */
+	fmemopen_stat(&in,data,sizeof(data));
+	fmemopen_stat(&out,NULL,0);
+	rc = huffman_opt(&in,&out,&adaptive);
+	fclose_stat(&in);
+	fclose_stat(&out);
+	mu_assert("checksum adaptive accepted", rc == HUFF_INVALIDARG);
 	return NULL;
 }
 
@@ -39,6 +1024,21 @@ static char *test_huffman()
 char *all_tests()
 {
 	mu_run_test(test_symbol_cmp);
+	mu_run_test(test_histogram);
+	mu_run_test(test_build_tree);
+	mu_run_test(test_code_lengths);
+	mu_run_test(test_round_trip);
+	mu_run_test(test_stats);
+	mu_run_test(test_read_range);
+	mu_run_test(test_buffer);
+	mu_run_test(test_codebook);
+	mu_run_test(test_stream);
+	mu_run_test(test_adaptive);
+	mu_run_test(test_sample);
+	mu_run_test(test_context);
+	mu_run_test(test_stored);
+	mu_run_test(test_runs);
+	mu_run_test(test_checksum);
 	mu_run_test(test_unhuffman);
 	mu_run_test(test_huffman);
 
@@ -0,0 +1,756 @@
+/* bench - time the huffman coder over a generated or given corpus
+ *
+ * Every corpus kind is generated from a fixed seed so the same sizes
+ * always give the same data. Each input is compressed and decompressed
+ * separately, in memory through the buffer functions and file to file
+ * through the stream functions, a number of times. The throughput of
+ * each stage is reported over the uncompressed size, in MB of 10^6 bytes
+ * a second, along with percentiles of the run times. With -a the file
+ * to file runs are repeated with the one pass adaptive coder, to set its
+ * throughput and ratio beside those of the block coder.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman.h"
+#include "huffman_errno.h"
+#include "file_stat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Size of the pieces a corpus is generated and written to disk in */
+#define GEN_CHUNK (1024*1024)
+
+/* Most sizes and input files in one run */
+#define MAX_SIZES 32
+#define MAX_FILES 32
+
+/* Corpus kinds */
+enum kind {
+	KIND_TEXT,	/* Words and punctuation */
+	KIND_LOG,	/* Timestamped log lines */
+	KIND_RANDOM,	/* Uniform bytes, as in JPEG data */
+	KIND_SKEWED,	/* Symbol probabilities halving one to the next */
+	KIND_SINGLE,	/* One symbol repeated */
+	KIND_FILE,	/* Read from a file */
+	KINDS
+};
+
+static const char *kind_names[KINDS] = {
+	"text", "log", "random", "skewed", "single", "file"
+};
+
+static const char *words[] = {
+	"the", "of", "and", "to", "a", "in", "is", "it", "that", "was",
+	"for", "on", "are", "with", "as", "his", "they", "be", "at", "one",
+	"have", "this", "from", "or", "had", "by", "word", "but", "what",
+	"some", "we", "can", "out", "other", "were", "all", "there", "when",
+	"up", "use", "your", "how", "said", "an", "each", "she", "which",
+	"do", "their", "time", "if", "will", "way", "about", "many", "then",
+	"them", "write", "would", "like", "so", "these", "her", "long",
+	"huffman", "compression", "symbol", "frequency", "tree", "code",
+};
+
+static const char *levels[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ",
+	"ERROR" };
+
+static const char *events[] = { "request served", "cache miss",
+	"connection opened", "connection closed", "block flushed",
+	"retrying upstream", "checkpoint written" };
+
+/* Deterministic generator of one corpus kind. Lines are built in `line' *
+ * and handed out a piece at a time.                                      */
+typedef struct generator
+{
+	enum kind kind;
+	uint64_t  state;
+	uint64_t  clock;	/* Milliseconds into the log */
+	char      line[256];
+	size_t    line_len;
+	size_t    line_pos;
+} Generator;
+
+/* Settings of a run */
+struct bench_opts
+{
+	unsigned int runs;
+	size_t sizes[MAX_SIZES];
+	unsigned int nsizes;
+	bool kinds[KINDS];
+	const char *files[MAX_FILES];
+	unsigned int nfiles;
+	bool memory;
+	bool file;
+	bool adaptive;
+	huffman_opts hopts;
+	const char *format;
+	const char *dir;
+};
+
+/* Timings of one stage of one input */
+struct result
+{
+	const char *kind;
+	size_t      size;
+	const char *mode;
+	const char *stage;
+	double      ratio;
+	double     *seconds;
+	unsigned int runs;
+};
+
+static uint64_t _next(Generator *g)
+{
+	/* xorshift64* */
+	g->state ^= g->state >> 12;
+	g->state ^= g->state << 25;
+	g->state ^= g->state >> 27;
+	return g->state * 2685821657736338717ULL;
+}
+
+static void gen_init(Generator *g, enum kind kind)
+{
+	memset(g,0,sizeof(Generator));
+	g->kind  = kind;
+	g->state = 0x9E3779B97F4A7C15ULL + kind;
+	g->clock = 1357000000000ULL;
+}
+
+/* Make up the next line of text or log output */
+static void _gen_line(Generator *g)
+{
+	size_t n = 0;
+	uint64_t r;
+	time_t secs;
+	struct tm tm;
+
+	if (g->kind == KIND_LOG)
+	{
+		g->clock += _next(g) % 250;
+		secs = g->clock / 1000;
+		gmtime_r(&secs,&tm);
+		n = strftime(g->line,sizeof(g->line),"%Y-%m-%d %H:%M:%S",&tm);
+		r = _next(g);
+		n += snprintf(g->line+n,sizeof(g->line)-n,
+			".%03u %s [worker-%u] %s id=%u in %u ms\n",
+			(unsigned)(g->clock % 1000),levels[r % 6],
+			(unsigned)(r >> 8) % 16,events[(r >> 16) % 7],
+			(unsigned)(r >> 24) % 100000,(unsigned)(r >> 44) % 500);
+	}
+	else
+	{
+		/* Common words are picked more often */
+		while (n < 70)
+		{
+			r = _next(g);
+			n += snprintf(g->line+n,sizeof(g->line)-n,"%s%s",
+				words[(r % (sizeof(words)/sizeof(words[0]))) *
+					((r >> 32) % 4 + 1) / 4],
+				(r >> 40) % 12 == 0 ? ", " : " ");
+		}
+		g->line[n-1] = '.';
+		g->line[n++] = '\n';
+	}
+	g->line_len = n;
+	g->line_pos = 0;
+}
+
+/* Fill `buf' with the next `len' bytes of the corpus */
+static void gen_fill(Generator *g, uint8_t *buf, size_t len)
+{
+	size_t i, n;
+	uint64_t r;
+
+	switch (g->kind)
+	{
+	case KIND_TEXT:
+	case KIND_LOG:
+		for (i=0; i<len; i+=n)
+		{
+			if (g->line_pos == g->line_len)
+			{
+				_gen_line(g);
+			}
+			n = g->line_len - g->line_pos;
+			if (n > len - i)
+			{
+				n = len - i;
+			}
+			memcpy(buf+i,g->line+g->line_pos,n);
+			g->line_pos += n;
+		}
+		break;
+	case KIND_RANDOM:
+		for (i=0; i<len; i++)
+		{
+			buf[i] = _next(g) >> 56;
+		}
+		break;
+	case KIND_SKEWED:
+		for (i=0; i<len; i++)
+		{
+			/* Each symbol half as likely as the one before */
+			r = _next(g) | (1ULL << 40);
+			buf[i] = 'a' + __builtin_ctzll(r);
+		}
+		break;
+	default:
+		memset(buf,'x',len);
+		break;
+	}
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Parse a size with an optional K, M or G suffix */
+static size_t parse_size(const char *arg, char **end)
+{
+	size_t size = strtoull(arg,end,10);
+
+	switch (toupper((unsigned char)**end))
+	{
+	case 'K':
+		size <<= 10;
+		(*end)++;
+		break;
+	case 'M':
+		size <<= 20;
+		(*end)++;
+		break;
+	case 'G':
+		size <<= 30;
+		(*end)++;
+		break;
+	}
+	return size;
+}
+
+static int _cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* The `p'th percentile of the sorted run times, by nearest rank */
+static double percentile(const double *sorted, unsigned int n, double p)
+{
+	unsigned int rank = (unsigned int)(p/100.0*n + 0.999999);
+
+	return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+static void report(const struct result *r, const char *format, bool *first)
+{
+	double p50, p90, p99, best, mbs;
+
+	qsort(r->seconds,r->runs,sizeof(double),_cmp_double);
+	best = r->seconds[0];
+	p50  = percentile(r->seconds,r->runs,50);
+	p90  = percentile(r->seconds,r->runs,90);
+	p99  = percentile(r->seconds,r->runs,99);
+	mbs  = r->size / p50 / 1e6;
+
+	if (strcmp(format,"csv") == 0)
+	{
+		if (*first)
+		{
+			printf("kind,size,mode,stage,runs,ratio,mb_s,"
+				"best_ms,p50_ms,p90_ms,p99_ms\n");
+		}
+		printf("%s,%zu,%s,%s,%u,%.4f,%.1f,%.3f,%.3f,%.3f,%.3f\n",
+			r->kind,r->size,r->mode,r->stage,r->runs,r->ratio,mbs,
+			best*1e3,p50*1e3,p90*1e3,p99*1e3);
+	}
+	else if (strcmp(format,"json") == 0)
+	{
+		printf("%s\n  {\"kind\": \"%s\", \"size\": %zu, \"mode\": \"%s\", "
+			"\"stage\": \"%s\", \"runs\": %u, \"ratio\": %.4f, "
+			"\"mb_s\": %.1f, \"best_ms\": %.3f, \"p50_ms\": %.3f, "
+			"\"p90_ms\": %.3f, \"p99_ms\": %.3f}",
+			*first ? "[" : ",",r->kind,r->size,r->mode,r->stage,
+			r->runs,r->ratio,mbs,best*1e3,p50*1e3,p90*1e3,p99*1e3);
+	}
+	else
+	{
+		if (*first)
+		{
+			printf("%-8s %12s %-6s %-10s %7s %9s %9s %9s %9s\n",
+				"kind","size","mode","stage","ratio","MB/s",
+				"p50 ms","p90 ms","p99 ms");
+		}
+		printf("%-8s %12zu %-6s %-10s %7.4f %9.1f %9.3f %9.3f %9.3f\n",
+			r->kind,r->size,r->mode,r->stage,r->ratio,mbs,
+			p50*1e3,p90*1e3,p99*1e3);
+	}
+	*first = false;
+}
+
+/* Time compressing and decompressing `data' with the buffer functions */
+static int bench_memory(const char *kind, const uint8_t *data, size_t len,
+		const struct bench_opts *o, bool *first)
+{
+	size_t bound = huffman_compress_bound(len), clen = 0, dlen = 0;
+	uint8_t *coded = malloc(bound), *decoded = malloc(len ? len : 1);
+	double *times = calloc(2*o->runs,sizeof(double));
+	struct result r = { kind, len, "memory", "compress", 0, times, o->runs };
+	unsigned int i;
+	double t;
+	int rc = HUFF_SUCCESS;
+
+	if (coded == NULL || decoded == NULL || times == NULL)
+	{
+		fprintf(stderr,"Not enough memory for %s %zu in memory\n",
+				kind,len);
+		rc = HUFF_NOMEM;
+	}
+
+	for (i=0; rc == HUFF_SUCCESS && i<o->runs; i++)
+	{
+		t = now();
+		rc = huffman_compress_buffer(data,len,coded,bound,&clen);
+		times[i] = now() - t;
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+
+		t = now();
+		rc = huffman_decompress_buffer(coded,clen,decoded,len,&dlen);
+		times[o->runs+i] = now() - t;
+		if (rc == HUFF_SUCCESS && (dlen != len ||
+				memcmp(decoded,data,len) != 0))
+		{
+			fprintf(stderr,"Round trip of %s %zu differs\n",kind,len);
+			rc = HUFF_CORRUPT;
+		}
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		r.ratio = len ? (double)clen/len : 0;
+		report(&r,o->format,first);
+		r.stage   = "decompress";
+		r.seconds = times + o->runs;
+		report(&r,o->format,first);
+	}
+
+	free(times);
+	free(decoded);
+	free(coded);
+	return rc;
+}
+
+/* Code the file `from' into the file `to' */
+static int _code_file(const char *from, const char *to, bool decode,
+		const huffman_opts *hopts, uint64_t *out_size)
+{
+	FILE *fin = fopen(from,"rb"), *fout = fopen(to,"wb");
+	f_stat in, out;
+	int rc;
+
+	if (fin == NULL || fout == NULL)
+	{
+		fprintf(stderr,"Failed to open %s or %s\n",from,to);
+		if (fin != NULL)
+		{
+			fclose(fin);
+		}
+		if (fout != NULL)
+		{
+			fclose(fout);
+		}
+		return HUFF_FAILURE;
+	}
+
+	finit_stat(&in,fin);
+	finit_stat(&out,fout);
+	rc = decode ? unhuffman_opt(&in,&out,hopts) :
+		huffman_opt(&in,&out,hopts);
+	fclose_stat(&in);
+	if (fclose_stat(&out) != 0 && rc == HUFF_SUCCESS)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+	*out_size = out.byte_count;
+	return rc;
+}
+
+/* Time compressing and decompressing the file `path' of `len' bytes   *
+ * file to file with `hopts', reported as the mode `mode'.              */
+static int _bench_file(const char *kind, const char *path, size_t len,
+		const char *mode, const huffman_opts *hopts,
+		const struct bench_opts *o, bool *first)
+{
+	char coded[4096], decoded[4096];
+	double *times = calloc(2*o->runs,sizeof(double));
+	struct result r = { kind, len, mode, "compress", 0, times, o->runs };
+	uint64_t clen = 0, dlen = 0;
+	unsigned int i;
+	double t;
+	int rc = HUFF_SUCCESS;
+
+	if (times == NULL)
+	{
+		return HUFF_NOMEM;
+	}
+	snprintf(coded,sizeof(coded),"%s/coded",o->dir);
+	snprintf(decoded,sizeof(decoded),"%s/decoded",o->dir);
+
+	for (i=0; rc == HUFF_SUCCESS && i<o->runs; i++)
+	{
+		t = now();
+		rc = _code_file(path,coded,false,hopts,&clen);
+		times[i] = now() - t;
+		if (rc != HUFF_SUCCESS)
+		{
+			break;
+		}
+
+		t = now();
+		rc = _code_file(coded,decoded,true,hopts,&dlen);
+		times[o->runs+i] = now() - t;
+		if (rc == HUFF_SUCCESS && dlen != len)
+		{
+			fprintf(stderr,"Round trip of %s %zu differs\n",kind,len);
+			rc = HUFF_CORRUPT;
+		}
+	}
+
+	if (rc == HUFF_SUCCESS)
+	{
+		r.ratio = len ? (double)clen/len : 0;
+		report(&r,o->format,first);
+		r.stage   = "decompress";
+		r.seconds = times + o->runs;
+		report(&r,o->format,first);
+	}
+	else
+	{
+		fprintf(stderr,"Failed to code %s %zu %s: %d\n",
+				kind,len,mode,rc);
+	}
+
+	unlink(coded);
+	unlink(decoded);
+	free(times);
+	return rc;
+}
+
+/* Time the file `path' file to file, and with the adaptive coder too  *
+ * if it was asked for.                                                 */
+static int bench_file(const char *kind, const char *path, size_t len,
+		const struct bench_opts *o, bool *first)
+{
+	huffman_opts adaptive = { .adaptive = true };
+	int rc;
+
+	rc = _bench_file(kind,path,len,"file",&o->hopts,o,first);
+	if (o->adaptive)
+	{
+		rc |= _bench_file(kind,path,len,"adapt",&adaptive,o,first);
+	}
+	return rc;
+}
+
+/* Write `len' bytes of the corpus `kind' to the file `path' a piece at *
+ * a time, so that inputs larger than memory can be written.           */
+static int write_corpus(const char *path, enum kind kind, size_t len)
+{
+	FILE *f = fopen(path,"wb");
+	uint8_t *buf = malloc(GEN_CHUNK);
+	Generator g;
+	size_t n;
+	int rc = HUFF_SUCCESS;
+
+	if (f == NULL || buf == NULL)
+	{
+		rc = HUFF_FAILURE;
+	}
+	gen_init(&g,kind);
+	while (rc == HUFF_SUCCESS && len > 0)
+	{
+		n = (len < GEN_CHUNK) ? len : GEN_CHUNK;
+		gen_fill(&g,buf,n);
+		if (fwrite(buf,1,n,f) != n)
+		{
+			rc = HUFF_WRITEFAIL;
+		}
+		len -= n;
+	}
+	if (f != NULL && fclose(f) != 0)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+	free(buf);
+	return rc;
+}
+
+/* Read the whole of the file `path' into memory */
+static uint8_t *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path,"rb");
+	uint8_t *buf = NULL, *tmp;
+	size_t size = 0, n;
+
+	*len = 0;
+	if (f == NULL)
+	{
+		return NULL;
+	}
+	do
+	{
+		if (*len == size)
+		{
+			size = size ? 2*size : GEN_CHUNK;
+			tmp = realloc(buf,size);
+			if (tmp == NULL)
+			{
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *len,1,size - *len,f);
+		*len += n;
+	} while (n > 0);
+	fclose(f);
+	return buf;
+}
+
+static void usage(char *argv[])
+{
+	printf("%s [-n runs] [-s sizes] [-k kinds] [-m modes] [-f format]\n"
+		"      [-b size] [-T threads] [-i] [-a] [-d dir] [file ...]\n",
+		argv[0]);
+	printf("\n");
+	printf("Options:\n");
+	printf("-n: time each stage runs times, default 5\n");
+	printf("-s: comma separated corpus sizes, with K, M and G suffixes,\n");
+	printf("    default 1K,64K,1M,16M\n");
+	printf("-k: comma separated corpus kinds from text, log, random,\n");
+	printf("    skewed and single, default all of them\n");
+	printf("-m: memory, file or both, default both\n");
+	printf("-f: output format, text, csv or json, default text\n");
+	printf("-b, -T, -i: block size, threads and interleaved streams for\n");
+	printf("    the file to file runs, as for huffman\n");
+	printf("-a: time the file to file runs with the adaptive coder as\n");
+	printf("    well, as mode adapt\n");
+	printf("-d: directory for the files of the file to file runs\n");
+	printf("-h: this message\n");
+	printf("\nFiles given are timed as they are, alongside the corpus\n");
+}
+
+static void parse_args(struct bench_opts *o, int argc, char *argv[])
+{
+	char *arg, *end;
+	int c, k;
+	bool error = false, kinds = false;
+
+	memset(o,0,sizeof(*o));
+	o->runs   = 5;
+	o->memory = o->file = true;
+	o->format = "text";
+	o->dir    = NULL;
+
+	while ((c = getopt(argc,argv,"n:s:k:m:f:b:T:iad:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			o->runs = atoi(optarg);
+			error |= o->runs == 0;
+			break;
+		case 's':
+			for (arg=optarg; *arg != '\0' && o->nsizes < MAX_SIZES; )
+			{
+				o->sizes[o->nsizes++] = parse_size(arg,&end);
+				if (end == arg || (*end != ',' && *end != '\0'))
+				{
+					error = true;
+					break;
+				}
+				arg = (*end == ',') ? end+1 : end;
+			}
+			break;
+		case 'k':
+			kinds = true;
+			for (arg=strtok(optarg,","); arg != NULL;
+					arg=strtok(NULL,","))
+			{
+				for (k=0; k<KIND_FILE; k++)
+				{
+					if (strcmp(arg,kind_names[k]) == 0)
+					{
+						o->kinds[k] = true;
+						break;
+					}
+				}
+				error |= k == KIND_FILE;
+			}
+			break;
+		case 'm':
+			o->memory = strcmp(optarg,"file") != 0;
+			o->file   = strcmp(optarg,"memory") != 0;
+			error |= !o->memory && !o->file;
+			break;
+		case 'f':
+			o->format = optarg;
+			error |= strcmp(optarg,"text") != 0 &&
+				strcmp(optarg,"csv") != 0 &&
+				strcmp(optarg,"json") != 0;
+			break;
+		case 'b':
+			o->hopts.block_size = parse_size(optarg,&end);
+			break;
+		case 'T':
+			o->hopts.threads = atoi(optarg);
+			break;
+		case 'i':
+			o->hopts.streams = 4;
+			break;
+		case 'a':
+			o->adaptive = true;
+			break;
+		case 'd':
+			o->dir = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			exit(c == 'h' ? 0 : 2);
+		}
+	}
+	if (error)
+	{
+		usage(argv);
+		exit(2);
+	}
+
+	if (o->nsizes == 0)
+	{
+		o->sizes[o->nsizes++] = 1 << 10;
+		o->sizes[o->nsizes++] = 64 << 10;
+		o->sizes[o->nsizes++] = 1 << 20;
+		o->sizes[o->nsizes++] = 16 << 20;
+	}
+	if (!kinds)
+	{
+		for (k=0; k<KIND_FILE; k++)
+		{
+			o->kinds[k] = true;
+		}
+	}
+	for (; optind < argc && o->nfiles < MAX_FILES; optind++)
+	{
+		o->files[o->nfiles++] = argv[optind];
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts o;
+	char dir[] = "/tmp/huffbench.XXXXXX", path[4096];
+	const char *name;
+	uint8_t *data;
+	size_t len;
+	unsigned int i, k;
+	bool first = true, made_dir = false;
+	Generator g;
+	int rc = HUFF_SUCCESS;
+
+	parse_args(&o,argc,argv);
+	if (o.file && o.dir == NULL)
+	{
+		if (mkdtemp(dir) == NULL)
+		{
+			perror("Unable to create a directory for the files");
+			return 2;
+		}
+		o.dir = dir;
+		made_dir = true;
+	}
+	snprintf(path,sizeof(path),"%s/input",o.dir ? o.dir : ".");
+
+	for (k=0; k<KIND_FILE; k++)
+	{
+		for (i=0; o.kinds[k] && i<o.nsizes; i++)
+		{
+			len = o.sizes[i];
+			if (o.memory)
+			{
+				data = malloc(len ? len : 1);
+				if (data == NULL)
+				{
+					fprintf(stderr,"Not enough memory for %s %zu "
+						"in memory\n",kind_names[k],len);
+				}
+				else
+				{
+					gen_init(&g,k);
+					gen_fill(&g,data,len);
+					rc |= bench_memory(kind_names[k],data,len,&o,
+							&first);
+					free(data);
+				}
+			}
+			if (o.file)
+			{
+				if (write_corpus(path,k,len) != HUFF_SUCCESS)
+				{
+					fprintf(stderr,"Failed to write %s\n",path);
+					rc = HUFF_WRITEFAIL;
+					continue;
+				}
+				rc |= bench_file(kind_names[k],path,len,&o,&first);
+				unlink(path);
+			}
+		}
+	}
+
+	for (i=0; i<o.nfiles; i++)
+	{
+		name = strrchr(o.files[i],'/');
+		name = name ? name+1 : o.files[i];
+		data = read_file(o.files[i],&len);
+		if (data == NULL)
+		{
+			fprintf(stderr,"Failed to read %s\n",o.files[i]);
+			rc = HUFF_FAILURE;
+			continue;
+		}
+		if (o.memory)
+		{
+			rc |= bench_memory(name,data,len,&o,&first);
+		}
+		free(data);
+		if (o.file)
+		{
+			rc |= bench_file(name,o.files[i],len,&o,&first);
+		}
+	}
+
+	if (strcmp(o.format,"json") == 0)
+	{
+		printf(first ? "[]\n" : "\n]\n");
+	}
+	if (made_dir)
+	{
+		rmdir(dir);
+	}
+	return rc != HUFF_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/* codebook - train a codebook for huffman --codebook on sample data
+ *
+ * The bytes of every sample file are counted together and a code is
+ * built from the counts, giving every byte value a code whether or not
+ * it appears in the samples. The codebook is written to the output file
+ * and its ID, which the messages coded with it carry, is printed along
+ * with the average code length over the samples.
+ *
+ * Iestyn Pryce 2012/2013
+ */
+
+#include "huffman.h"
+#include "huffman_errno.h"
+#include "huffman_histogram.h"
+#include "file_stat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Size of the pieces the samples are read in */
+#define READ_CHUNK (64*1024)
+
+static void usage(char *argv[])
+{
+	printf("%s [-l bits] -o codebook sample [sample ...]\n",argv[0]);
+	printf("\n");
+	printf("Options:\n");
+	printf("-o: file to write the codebook to\n");
+	printf("-l: limit codes to at most bits bits, from 11 to 15\n");
+	printf("-h: this message\n");
+	printf("\nA sample of - is read from STDIN\n");
+}
+
+/* Add the byte counts of the file `path' to `counts'. Returns the     *
+ * number of bytes read, or -1 if the file cannot be read.             */
+static int64_t count_file(const char *path, uint64_t counts[HUFF_SYMBOLS])
+{
+	static uint8_t buf[READ_CHUNK];
+	FILE *f = (strcmp(path,"-") == 0) ? stdin : fopen(path,"rb");
+	int64_t total = 0;
+	size_t n;
+
+	if (f == NULL)
+	{
+		return -1;
+	}
+	while ((n = fread(buf,1,sizeof(buf),f)) > 0)
+	{
+		huffman_histogram(counts,buf,n);
+		total += n;
+	}
+	if (ferror(f))
+	{
+		total = -1;
+	}
+	if (f != stdin)
+	{
+		fclose(f);
+	}
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t counts[HUFF_SYMBOLS] = { 0 };
+	const char *output = NULL;
+	unsigned int max_len = 0, i;
+	HuffCodebook *book;
+	uint64_t total = 0, bits = 0;
+	int64_t n;
+	FILE *file;
+	f_stat out;
+	int c, rc;
+
+	while ((c = getopt(argc,argv,"o:l:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'o':
+			output = optarg;
+			break;
+		case 'l':
+			max_len = atoi(optarg);
+			if (max_len < 11 || max_len > 15)
+			{
+				fprintf(stderr,"Invalid code length: %s\n",optarg);
+				exit(2);
+			}
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			exit(c == 'h' ? 0 : 2);
+		}
+	}
+	if (output == NULL || optind == argc)
+	{
+		usage(argv);
+		exit(2);
+	}
+
+	for (; optind < argc; optind++)
+	{
+		n = count_file(argv[optind],counts);
+		if (n < 0)
+		{
+			fprintf(stderr,"Failed to read file: %s\n",argv[optind]);
+			exit(2);
+		}
+		total += n;
+	}
+
+	rc = huffman_codebook_train(&book,counts,max_len);
+	if (rc != HUFF_SUCCESS)
+	{
+		fprintf(stderr,"Failed to train the codebook\n");
+		return rc;
+	}
+
+	file = fopen(output,"wb");
+	if (file == NULL)
+	{
+		fprintf(stderr,"Failed to open file: %s\n",output);
+		huffman_codebook_free(book);
+		exit(2);
+	}
+	finit_stat(&out,file);
+	rc = huffman_codebook_save(book,&out);
+	if (fclose_stat(&out) != 0 && rc == HUFF_SUCCESS)
+	{
+		rc = HUFF_WRITEFAIL;
+	}
+	if (rc != HUFF_SUCCESS)
+	{
+		fprintf(stderr,"Failed to write the codebook\n");
+		huffman_codebook_free(book);
+		return rc;
+	}
+
+	for (i=0; i<HUFF_SYMBOLS; i++)
+	{
+		bits += counts[i] * huffman_codebook_length(book,i);
+	}
+	printf("Codebook ID: %08" PRIx32 "\n",huffman_codebook_id(book));
+	printf("Sample bytes: %" PRIu64 "\n",total);
+	printf("Bits per byte: %.4f\n",total ? (double)bits/total : 0.0);
+
+	huffman_codebook_free(book);
+	return HUFF_SUCCESS;
+}